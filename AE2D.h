@@ -17,6 +17,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 class AE_Display {
 
@@ -33,6 +34,7 @@ private:
 
     bool m_CloseRequested;
     SDL_Event m_Event;
+    std::vector<SDL_Keycode> m_KeysPressed;
 
     uint8_t m_RenderMode;
 
@@ -134,13 +136,29 @@ public:
 
     void pollEvents()
     {
+        m_KeysPressed.clear();
         while (SDL_PollEvent(&m_Event) != 0)
         {
             if (m_Event.type == SDL_QUIT)
             {
                 m_CloseRequested = true;
             }
+            else if (m_Event.type == SDL_KEYDOWN)
+            {
+                m_KeysPressed.push_back(m_Event.key.keysym.sym);
+            }
+        }
+    }
+
+    // True if the key went down during the last pollEvents()
+    bool keyPressed(SDL_Keycode key)
+    {
+        for (SDL_Keycode pressed : m_KeysPressed)
+        {
+            if (pressed == key)
+                return true;
         }
+        return false;
     }
 
     bool closeRequested()
@@ -0,0 +1,288 @@
+/*
+ * Shared memory frame ring
+ *
+ * A renderer publishes its frames into a POSIX shared memory ring of
+ * slots, so another process on the same machine can read them without
+ * copies or screen capture. The producer never waits for the consumer:
+ * it overwrites the oldest slot, and a consumer that falls behind skips
+ * frames. Every slot carries a sequence number that is odd while the slot
+ * is being written, so a reader can tell if the frame changed under it.
+ * On Linux a waiting consumer sleeps on a futex, elsewhere it polls.
+ */
+
+#ifndef __FRAMERING_H__
+#define __FRAMERING_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+
+#ifndef _WIN32
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+const uint32_t FRAME_RING_MAGIC = 0x474E5246; // "FRNG"
+const uint32_t FRAME_RING_VERSION = 1;
+
+// Start of the shared memory. The slots follow, then the pixels of every
+// slot at page aligned offsets.
+struct FrameRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t slot_count;
+    uint32_t reserved;
+    uint64_t pixels_offset;             // Bytes from the start to the pixels of slot 0
+    uint64_t slot_stride;               // Bytes between the pixels of two slots
+    alignas(64) std::atomic<uint64_t> frames;   // Frames published so far
+    std::atomic<uint32_t> notify;       // Futex word, changes with every frame
+    std::atomic<uint32_t> waiters;      // Consumers sleeping on notify
+};
+
+struct alignas(64) FrameSlot {
+    std::atomic<uint64_t> sequence;     // 2*frame + 1 while written, 2*frame + 2 when complete
+    uint64_t time_ns;                   // Steady clock time of publishing
+};
+
+inline uint64_t frameRingTime() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class FrameRing {
+private:
+    std::string name;
+    bool owner;
+    uint8_t *memory;
+    size_t size;
+
+    FrameRingHeader *header() const {
+        return (FrameRingHeader*)memory;
+    }
+    FrameSlot *slot(uint64_t frame) const {
+        return (FrameSlot*)(memory + sizeof(FrameRingHeader)) + frame % header()->slot_count;
+    }
+    uint32_t *slotPixels(uint64_t frame) const {
+        return (uint32_t*)(memory + header()->pixels_offset + frame % header()->slot_count*header()->slot_stride);
+    }
+
+    void wake() {
+#ifdef __linux__
+        syscall(SYS_futex, &header()->notify, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+    void sleep(uint32_t notify, int timeout_ms) {
+#ifdef __linux__
+        timespec timeout = {timeout_ms/1000, (timeout_ms % 1000)*1000000L};
+        syscall(SYS_futex, &header()->notify, FUTEX_WAIT, notify, &timeout, nullptr, 0);
+#elif !defined(_WIN32)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+    }
+
+public:
+    FrameRing() : owner(false), memory(nullptr), size(0) {}
+    FrameRing(const FrameRing&) = delete;
+    FrameRing &operator=(const FrameRing&) = delete;
+    ~FrameRing() {
+        close();
+    }
+
+    // Producer side. Creates the shared memory object name, e.g. "/ray",
+    // replacing an old one with the same name.
+    bool create(const std::string &ring_name, int width, int height, int slots) {
+        close();
+#ifdef _WIN32
+        std::cout << "Shared memory frames need POSIX shared memory" << std::endl;
+        return false;
+#else
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t pixels_offset = (sizeof(FrameRingHeader) + slots*sizeof(FrameSlot) + page - 1)/page*page;
+        uint64_t slot_stride = ((uint64_t)width*height*4 + page - 1)/page*page;
+        size = pixels_offset + slots*slot_stride;
+
+        shm_unlink(ring_name.c_str());
+        int fd = shm_open(ring_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(fd < 0)
+            return false;
+        if(ftruncate(fd, size) != 0) {
+            ::close(fd);
+            shm_unlink(ring_name.c_str());
+            return false;
+        }
+        void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(mapped == MAP_FAILED) {
+            shm_unlink(ring_name.c_str());
+            return false;
+        }
+        memory = (uint8_t*)mapped;
+        name = ring_name;
+        owner = true;
+
+        FrameRingHeader *h = new (memory) FrameRingHeader();
+        h->width = width;
+        h->height = height;
+        h->slot_count = slots;
+        h->reserved = 0;
+        h->pixels_offset = pixels_offset;
+        h->slot_stride = slot_stride;
+        h->frames.store(0, std::memory_order_relaxed);
+        h->notify.store(0, std::memory_order_relaxed);
+        h->waiters.store(0, std::memory_order_relaxed);
+        for(int i = 0; i < slots; i++) {
+            FrameSlot *s = new (slot(i)) FrameSlot();
+            s->sequence.store(0, std::memory_order_relaxed);
+            s->time_ns = 0;
+        }
+        // Consumers check the magic last
+        h->version = FRAME_RING_VERSION;
+        std::atomic_thread_fence(std::memory_order_release);
+        h->magic = FRAME_RING_MAGIC;
+        return true;
+#endif
+    }
+
+    // Pixels to render the next frame into, published with endFrame()
+    uint32_t *beginFrame() {
+        uint64_t frame = header()->frames.load(std::memory_order_relaxed);
+        slot(frame)->sequence.store(2*frame + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return slotPixels(frame);
+    }
+
+    void endFrame() {
+        FrameRingHeader *h = header();
+        uint64_t frame = h->frames.load(std::memory_order_relaxed);
+        FrameSlot *s = slot(frame);
+        s->time_ns = frameRingTime();
+        s->sequence.store(2*frame + 2, std::memory_order_release);
+        h->frames.store(frame + 1, std::memory_order_release);
+        h->notify.fetch_add(1, std::memory_order_seq_cst);
+        // Only pay for a system call when somebody sleeps
+        if(h->waiters.load(std::memory_order_seq_cst) > 0)
+            wake();
+    }
+
+    void publish(const uint32_t *pixels) {
+        uint32_t *target = beginFrame();
+        memcpy(target, pixels, (size_t)getWidth()*getHeight()*4);
+        endFrame();
+    }
+
+    // Consumer side. Maps an existing ring created by another process.
+    bool open(const std::string &ring_name) {
+        close();
+#ifdef _WIN32
+        return false;
+#else
+        int fd = shm_open(ring_name.c_str(), O_RDWR, 0);
+        if(fd < 0)
+            return false;
+        struct stat info;
+        if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(FrameRingHeader)) {
+            ::close(fd);
+            return false;
+        }
+        // Writable only for the waiters count and the futex
+        void *mapped = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(mapped == MAP_FAILED)
+            return false;
+        memory = (uint8_t*)mapped;
+        size = info.st_size;
+        name = ring_name;
+        owner = false;
+
+        FrameRingHeader *h = header();
+        bool valid = h->magic == FRAME_RING_MAGIC;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        valid = valid && h->version == FRAME_RING_VERSION && h->slot_count > 0;
+        // Slots must fit before the pixels, and every slot must hold a frame, inside the mapping
+        valid = valid && h->slot_stride >= (uint64_t)h->width*h->height*4 &&
+                h->pixels_offset >= sizeof(FrameRingHeader) + (uint64_t)h->slot_count*sizeof(FrameSlot) &&
+                h->pixels_offset <= size && h->slot_stride <= (size - h->pixels_offset)/h->slot_count;
+        if(!valid) {
+            close();
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    // Waits up to timeout_ms for a frame newer than after and returns the
+    // newest frame number, or -1 on timeout. Frames between are skipped.
+    int64_t waitFrame(int64_t after, int timeout_ms) {
+        FrameRingHeader *h = header();
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while(true) {
+            uint32_t notify = h->notify.load(std::memory_order_acquire);
+            int64_t newest = (int64_t)h->frames.load(std::memory_order_acquire) - 1;
+            if(newest > after)
+                return newest;
+            int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if(left <= 0)
+                return -1;
+            // The futex returns at once if notify changed after it was read
+            h->waiters.fetch_add(1, std::memory_order_seq_cst);
+            sleep(notify, std::min(left, 100));
+            h->waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Pixels of a published frame in place, nullptr if its slot was reused.
+    // After reading them and getFrameTime(), frameIntact() tells if the
+    // producer wrote over either.
+    const uint32_t *getFrame(uint64_t frame) const {
+        if(slot(frame)->sequence.load(std::memory_order_acquire) != 2*frame + 2)
+            return nullptr;
+        return slotPixels(frame);
+    }
+
+    bool frameIntact(uint64_t frame) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot(frame)->sequence.load(std::memory_order_relaxed) == 2*frame + 2;
+    }
+
+    uint64_t getFrameTime(uint64_t frame) const {
+        return slot(frame)->time_ns;
+    }
+
+    void close() {
+#ifndef _WIN32
+        if(memory != nullptr)
+            munmap(memory, size);
+        if(owner)
+            shm_unlink(name.c_str());
+#endif
+        memory = nullptr;
+        owner = false;
+    }
+
+    bool isOpen() const {
+        return memory != nullptr;
+    }
+    int getWidth() const {
+        return header()->width;
+    }
+    int getHeight() const {
+        return header()->height;
+    }
+    int getSlotCount() const {
+        return header()->slot_count;
+    }
+};
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * Performance overlay
+ *
+ * Draws lines of text and a frame time graph over a framebuffer of
+ * 0xRRGGBB pixels. Uses a built in 5x7 font, so it needs no libraries.
+ */
+
+#ifndef __HUD_H__
+#define __HUD_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// 5x7 glyphs for ' ' to 'Z', one byte per column with the top row in bit 0
+const uint8_t HUD_FONT[][5] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, // ' '
+    {0x00, 0x00, 0x5F, 0x00, 0x00}, // !
+    {0x00, 0x07, 0x00, 0x07, 0x00}, // "
+    {0x14, 0x7F, 0x14, 0x7F, 0x14}, // #
+    {0x24, 0x2A, 0x7F, 0x2A, 0x12}, // $
+    {0x23, 0x13, 0x08, 0x64, 0x62}, // %
+    {0x36, 0x49, 0x55, 0x22, 0x50}, // &
+    {0x00, 0x05, 0x03, 0x00, 0x00}, // '
+    {0x00, 0x1C, 0x22, 0x41, 0x00}, // (
+    {0x00, 0x41, 0x22, 0x1C, 0x00}, // )
+    {0x14, 0x08, 0x3E, 0x08, 0x14}, // *
+    {0x08, 0x08, 0x3E, 0x08, 0x08}, // +
+    {0x00, 0x50, 0x30, 0x00, 0x00}, // ,
+    {0x08, 0x08, 0x08, 0x08, 0x08}, // -
+    {0x00, 0x60, 0x60, 0x00, 0x00}, // .
+    {0x20, 0x10, 0x08, 0x04, 0x02}, // /
+    {0x3E, 0x51, 0x49, 0x45, 0x3E}, // 0
+    {0x00, 0x42, 0x7F, 0x40, 0x00}, // 1
+    {0x42, 0x61, 0x51, 0x49, 0x46}, // 2
+    {0x21, 0x41, 0x45, 0x4B, 0x31}, // 3
+    {0x18, 0x14, 0x12, 0x7F, 0x10}, // 4
+    {0x27, 0x45, 0x45, 0x45, 0x39}, // 5
+    {0x3C, 0x4A, 0x49, 0x49, 0x30}, // 6
+    {0x01, 0x71, 0x09, 0x05, 0x03}, // 7
+    {0x36, 0x49, 0x49, 0x49, 0x36}, // 8
+    {0x06, 0x49, 0x49, 0x29, 0x1E}, // 9
+    {0x00, 0x36, 0x36, 0x00, 0x00}, // :
+    {0x00, 0x56, 0x36, 0x00, 0x00}, // ;
+    {0x08, 0x14, 0x22, 0x41, 0x00}, // <
+    {0x14, 0x14, 0x14, 0x14, 0x14}, // =
+    {0x00, 0x41, 0x22, 0x14, 0x08}, // >
+    {0x02, 0x01, 0x51, 0x09, 0x06}, // ?
+    {0x32, 0x49, 0x79, 0x41, 0x3E}, // @
+    {0x7E, 0x11, 0x11, 0x11, 0x7E}, // A
+    {0x7F, 0x49, 0x49, 0x49, 0x36}, // B
+    {0x3E, 0x41, 0x41, 0x41, 0x22}, // C
+    {0x7F, 0x41, 0x41, 0x22, 0x1C}, // D
+    {0x7F, 0x49, 0x49, 0x49, 0x41}, // E
+    {0x7F, 0x09, 0x09, 0x09, 0x01}, // F
+    {0x3E, 0x41, 0x49, 0x49, 0x7A}, // G
+    {0x7F, 0x08, 0x08, 0x08, 0x7F}, // H
+    {0x00, 0x41, 0x7F, 0x41, 0x00}, // I
+    {0x20, 0x40, 0x41, 0x3F, 0x01}, // J
+    {0x7F, 0x08, 0x14, 0x22, 0x41}, // K
+    {0x7F, 0x40, 0x40, 0x40, 0x40}, // L
+    {0x7F, 0x02, 0x0C, 0x02, 0x7F}, // M
+    {0x7F, 0x04, 0x08, 0x10, 0x7F}, // N
+    {0x3E, 0x41, 0x41, 0x41, 0x3E}, // O
+    {0x7F, 0x09, 0x09, 0x09, 0x06}, // P
+    {0x3E, 0x41, 0x51, 0x21, 0x5E}, // Q
+    {0x7F, 0x09, 0x19, 0x29, 0x46}, // R
+    {0x46, 0x49, 0x49, 0x49, 0x31}, // S
+    {0x01, 0x01, 0x7F, 0x01, 0x01}, // T
+    {0x3F, 0x40, 0x40, 0x40, 0x3F}, // U
+    {0x1F, 0x20, 0x40, 0x20, 0x1F}, // V
+    {0x3F, 0x40, 0x38, 0x40, 0x3F}, // W
+    {0x63, 0x14, 0x08, 0x14, 0x63}, // X
+    {0x07, 0x08, 0x70, 0x08, 0x07}, // Y
+    {0x61, 0x51, 0x49, 0x45, 0x43}, // Z
+};
+
+// Darkens the rectangle [x0, x1) x [y0, y1) to a quarter
+inline void hudShade(uint32_t *pixels, int w, int h, int x0, int y0, int x1, int y1) {
+    for(int y = std::max(y0, 0); y < std::min(y1, h); y++) {
+        for(int x = std::max(x0, 0); x < std::min(x1, w); x++) {
+            pixels[y*w + x] = (pixels[y*w + x] >> 2) & 0x3f3f3f;
+        }
+    }
+}
+
+// Text at (x, y), lower case is drawn as upper case. Returns the width in pixels.
+inline int hudText(uint32_t *pixels, int w, int h, int x, int y, const std::string &text, uint32_t color, int scale = 1) {
+    for(size_t c = 0; c < text.size(); c++) {
+        char ch = text[c];
+        if(ch >= 'a' && ch <= 'z')
+            ch -= 'a' - 'A';
+        if(ch < ' ' || ch > 'Z')
+            ch = '?';
+        const uint8_t *glyph = HUD_FONT[ch - ' '];
+        for(int col = 0; col < 5; col++) {
+            for(int row = 0; row < 7; row++) {
+                if(!(glyph[col] >> row & 1)) continue;
+                for(int sy = 0; sy < scale; sy++) {
+                    for(int sx = 0; sx < scale; sx++) {
+                        int px = x + (c*6 + col)*scale + sx;
+                        int py = y + row*scale + sy;
+                        if(px >= 0 && px < w && py >= 0 && py < h)
+                            pixels[py*w + px] = color;
+                    }
+                }
+            }
+        }
+    }
+    return text.size()*6*scale;
+}
+
+// Keeps the last frame times and draws them with lines of text in the
+// top left corner
+class Hud {
+private:
+    std::vector<float> frame_times;     // Milliseconds, oldest first
+    int history;
+    int scale;
+
+public:
+    Hud(int history = 120, int scale = 1) : history(history), scale(scale) {}
+
+    void addFrameTime(double ms) {
+        frame_times.push_back(ms);
+        if((int)frame_times.size() > history)
+            frame_times.erase(frame_times.begin());
+    }
+
+    void draw(uint32_t *pixels, int w, int h, const std::vector<std::string> &lines) const {
+        const int margin = 4*scale;
+        const int line_height = 9*scale;
+        const int graph_height = 40*scale;
+        size_t longest = 0;
+        for(const auto& line : lines) {
+            longest = std::max(longest, line.size());
+        }
+        int box_w = std::max((int)longest*6*scale, history*scale) + 2*margin;
+        int box_h = lines.size()*line_height + graph_height + 3*margin;
+        hudShade(pixels, w, h, 0, 0, box_w, box_h);
+
+        for(size_t i = 0; i < lines.size(); i++) {
+            hudText(pixels, w, h, margin, margin + i*line_height, lines[i], 0xffffff, scale);
+        }
+
+        // Frame time graph, with lines at 16.7 and 33.3 ms
+        float top = 34.0f;
+        for(float t : frame_times) {
+            top = std::max(top, t);
+        }
+        int base = box_h - margin;
+        for(size_t i = 0; i < frame_times.size(); i++) {
+            float t = frame_times[i];
+            int bar = std::max(1, (int)(t/top*graph_height));
+            uint32_t color = t <= 1000.0f/60 ? 0x40ff40 : t <= 1000.0f/30 ? 0xffff40 : 0xff4040;
+            for(int y = base - bar; y < base; y++) {
+                for(int sx = 0; sx < scale; sx++) {
+                    int x = margin + i*scale + sx;
+                    if(x < w && y >= 0 && y < h)
+                        pixels[y*w + x] = color;
+                }
+            }
+        }
+        const float marks[] = {1000.0f/60, 1000.0f/30};
+        for(float mark : marks) {
+            int y = base - (int)(mark/top*graph_height);
+            for(int x = margin; x < margin + history*scale && x < w; x += 2) {
+                if(y >= 0 && y < h)
+                    pixels[y*w + x] = 0x808080;
+            }
+        }
+    }
+};
+
+#endif
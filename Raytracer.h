@@ -0,0 +1,4668 @@
+/*
+ * Ray tracer core
+ *
+ * Scene description, tracing and the renderers. Does not depend on
+ * SDL, so it can be used without a window.
+ */
+
+#ifndef __RAYTRACER_H__
+#define __RAYTRACER_H__
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <list>
+#include <atomic>
+#include <omp.h>
+
+class Vec3 {
+public:
+    float x, y, z;
+
+    Vec3() : x(0), y(0), z(0) {}
+    Vec3(float xyz) : x(xyz), y(xyz), z(xyz) {}
+    Vec3(float x, float y, float z) : x(x), y(y), z(z) {}
+
+    float getLength() const {
+        return sqrtf((x * x) + (y * y) + (z * z));
+    }
+    void normalize() {
+        float s = 1.0f / getLength();
+        x = x * s;
+        y = y * s;
+        z = z * s;
+    }
+    const float dotProduct(const Vec3 &other) const {
+        return other.x*x + other.y*y + other.z*z;
+    }
+    Vec3 crossProduct(const Vec3 &other) const {
+        return Vec3(y*other.z - z*other.y, z*other.x - x*other.z, x*other.y - y*other.x);
+    }
+
+    Vec3 operator+ (const Vec3 &other) const {
+        return Vec3(this->x + other.x, this->y + other.y, this->z + other.z);
+    }
+    Vec3 operator- (const Vec3 &other) const {
+        return Vec3(this->x - other.x, this->y - other.y, this->z - other.z);
+    }
+    Vec3 operator* (float scale) const {
+        return Vec3(this->x * scale, this->y * scale, this->z * scale);
+    }
+    Vec3 operator- () const {
+        return Vec3(-this->x, -this->y, -this->z);
+    }
+    friend Vec3 operator* (float scale, const Vec3 &other) {
+        return Vec3(other.x * scale, other.y * scale, other.z * scale);
+    }
+    Vec3 copy() const {
+        return *this;
+    }
+};
+
+class Ray {
+private:
+    Vec3 pos;
+    Vec3 dir;
+public:
+    Ray() : pos(Vec3()), dir(Vec3()) {}
+    Ray(Vec3 pos, Vec3 dir) : pos(pos), dir(dir) {}
+
+    const Vec3 getPos() const{
+        return pos;
+    }
+    const Vec3 getDir() const{
+        return dir;
+    }
+    void setPos(const Vec3 pos) {
+        this->pos = pos;
+    }
+    void setDir(const Vec3 dir) {
+        this->dir = dir;
+    }
+};
+
+class Material {
+private:
+    Vec3 color;
+    float roughness;
+public:
+    Material(Vec3 color, float roughness) : color(color), roughness(roughness) {}
+
+    Material() : color(Vec3()), roughness(0) {}
+
+    float getRoughness() const {
+        return roughness;
+    }
+    const Vec3 &getColor() const{
+        return color;
+    }
+};
+
+// Same as intersectSphere() for a direction that is already normalized
+inline bool intersectSphereUnit(const Vec3 &pos, float radius, const Vec3 &origin, const Vec3 &dir, float &distance) {
+    Vec3 L = origin - pos;
+    float a = dir.dotProduct(dir);
+    float b = 2.0*dir.dotProduct(L);
+    float c = L.dotProduct(L) - radius*radius;
+
+    float discriminant = b*b - 4*a*c;
+    if(discriminant <= 0.0f) return false;
+
+    float root = sqrt(discriminant);
+    float t0 = (-b + root)/(2*a);
+    float t1 = (-b - root)/(2*a);
+    float t = (t0 < t1) ? t0 : t1;
+
+    if(t<0) return false;
+    distance = t;
+    return true;
+}
+
+// Closest intersection distance of a ray and a sphere in front of the ray origin
+inline bool intersectSphere(const Vec3 &pos, float radius, const Ray &in, float &distance) {
+    Vec3 dir = in.getDir().copy();
+    dir.normalize();
+    return intersectSphereUnit(pos, radius, in.getPos(), dir, distance);
+}
+
+// Lanes of N floats, N vectors in structure of arrays layout and masks for
+// kernels that work on a batch of rays or balls at once. The lanes are GCC
+// vector types, so the operations compile to SSE, AVX2 or AVX-512
+// instructions for the target (-msse4.2, -mavx2, -mavx512f) and a kernel is
+// written once for every width.
+template<int N>
+struct LaneTypes;
+template<>
+struct LaneTypes<4> {
+    typedef float Float __attribute__((vector_size(16)));
+    typedef int32_t Int __attribute__((vector_size(16)));
+};
+template<>
+struct LaneTypes<8> {
+    typedef float Float __attribute__((vector_size(32)));
+    typedef int32_t Int __attribute__((vector_size(32)));
+};
+template<>
+struct LaneTypes<16> {
+    typedef float Float __attribute__((vector_size(64)));
+    typedef int32_t Int __attribute__((vector_size(64)));
+};
+
+// Widest lanes the target has registers for. Wider types still work, their
+// comparisons are split into halves of this width by compareLanes().
+#if defined(__AVX512F__)
+const int SIMD_WIDTH = 16;
+#elif defined(__AVX__)
+const int SIMD_WIDTH = 8;
+#else
+const int SIMD_WIDTH = 4;
+#endif
+
+// a cmp b lane by lane. GCC does comparisons wider than the target one lane
+// at a time with scalar compares and branches, so those go through halves.
+template<int N, typename Cmp>
+inline void compareLanes(const typename LaneTypes<N>::Float &a, const typename LaneTypes<N>::Float &b, Cmp cmp, typename LaneTypes<N>::Int &r) {
+    if constexpr(N > SIMD_WIDTH) {
+        typedef typename LaneTypes<N/2>::Float Half;
+        typedef typename LaneTypes<N/2>::Int HalfMask;
+        Half a_low, a_high, b_low, b_high;
+        memcpy(&a_low, &a, sizeof(Half));
+        memcpy(&a_high, (const char*)&a + sizeof(Half), sizeof(Half));
+        memcpy(&b_low, &b, sizeof(Half));
+        memcpy(&b_high, (const char*)&b + sizeof(Half), sizeof(Half));
+        HalfMask low, high;
+        compareLanes<N/2>(a_low, b_low, cmp, low);
+        compareLanes<N/2>(a_high, b_high, cmp, high);
+        memcpy(&r, &low, sizeof(HalfMask));
+        memcpy((char*)&r + sizeof(HalfMask), &high, sizeof(HalfMask));
+    } else {
+        r = cmp(a, b);
+    }
+}
+
+template<int N>
+struct MaskN {
+    typedef typename LaneTypes<N>::Int Lanes;
+    Lanes v;                // -1 for true, 0 for false
+
+    MaskN() {}
+    MaskN(bool b) {
+        v = Lanes{} - (int32_t)b;
+    }
+    MaskN operator& (const MaskN &o) const {
+        MaskN r;
+        r.v = v & o.v;
+        return r;
+    }
+    MaskN operator| (const MaskN &o) const {
+        MaskN r;
+        r.v = v | o.v;
+        return r;
+    }
+    MaskN operator! () const {
+        MaskN r;
+        r.v = ~v;
+        return r;
+    }
+    bool operator[] (int i) const {
+        return v[i] != 0;
+    }
+    bool any() const {
+        int32_t r = 0;
+        for(int i = 0; i < N; i++) r |= v[i];
+        return r != 0;
+    }
+    bool all() const {
+        int32_t r = -1;
+        for(int i = 0; i < N; i++) r &= v[i];
+        return r != 0;
+    }
+};
+
+template<int N>
+struct FloatN {
+    typedef typename LaneTypes<N>::Float Lanes;
+    Lanes v;
+
+    FloatN() {}
+    FloatN(float f) {
+        v = Lanes{} + f;
+    }
+    float operator[] (int i) const {
+        return v[i];
+    }
+    void set(int i, float f) {
+        v[i] = f;
+    }
+
+    // Friends, so that a float on either side is broadcast to all lanes
+#define FLOATN_OP(op) \
+    friend FloatN operator op (const FloatN &a, const FloatN &b) { \
+        FloatN r; \
+        r.v = a.v op b.v; \
+        return r; \
+    }
+    FLOATN_OP(+)
+    FLOATN_OP(-)
+    FLOATN_OP(*)
+    FLOATN_OP(/)
+#undef FLOATN_OP
+#define FLOATN_CMP(op) \
+    friend MaskN<N> operator op (const FloatN &a, const FloatN &b) { \
+        MaskN<N> r; \
+        compareLanes<N>(a.v, b.v, [](const auto &x, const auto &y) { return x op y; }, r.v); \
+        return r; \
+    }
+    FLOATN_CMP(<)
+    FLOATN_CMP(<=)
+    FLOATN_CMP(>)
+    FLOATN_CMP(>=)
+#undef FLOATN_CMP
+    FloatN operator- () const {
+        FloatN r;
+        r.v = -v;
+        return r;
+    }
+};
+
+template<int N>
+inline FloatN<N> select(const MaskN<N> &m, const FloatN<N> &a, const FloatN<N> &b) {
+    // As a bit blend, a ?: on vectors wider than the target is done lane by lane
+    typedef typename MaskN<N>::Lanes Int;
+    FloatN<N> r;
+    r.v = (typename FloatN<N>::Lanes)(((Int)a.v & m.v) | ((Int)b.v & ~m.v));
+    return r;
+}
+template<int N>
+inline FloatN<N> min(const FloatN<N> &a, const FloatN<N> &b) {
+    return select(a < b, a, b);
+}
+template<int N>
+inline FloatN<N> max(const FloatN<N> &a, const FloatN<N> &b) {
+    return select(a > b, a, b);
+}
+template<int N>
+inline FloatN<N> sqrt(const FloatN<N> &a) {
+    FloatN<N> r;
+    for(int i = 0; i < N; i++) r.v[i] = sqrtf(a.v[i]);
+    return r;
+}
+
+// 1/sqrt(x). The fast version is the bit trick estimate with one Newton
+// step, about 0.2% off, for directions that are only used for shading.
+template<int N>
+inline FloatN<N> rsqrt(const FloatN<N> &a, bool fast = false) {
+    FloatN<N> r;
+    if(fast) {
+        typename MaskN<N>::Lanes bits = 0x5f375a86 - ((typename MaskN<N>::Lanes)a.v >> 1);
+        r.v = (typename FloatN<N>::Lanes)bits;
+        r.v = r.v*(1.5f - 0.5f*a.v*r.v*r.v);
+    } else {
+        r.v = 1.0f/sqrt(a).v;
+    }
+    return r;
+}
+
+template<int N>
+struct Vec3xN {
+    FloatN<N> x, y, z;
+
+    Vec3xN() {}
+    Vec3xN(const Vec3 &a) : x(a.x), y(a.y), z(a.z) {}
+    Vec3xN(const FloatN<N> &x, const FloatN<N> &y, const FloatN<N> &z) : x(x), y(y), z(z) {}
+
+    // count vectors from a, the remaining lanes get the last one
+    static Vec3xN load(const Vec3 *a, int count = N) {
+        Vec3xN r;
+        for(int i = 0; i < N; i++) {
+            const Vec3 &p = a[std::min(i, count - 1)];
+            r.x.v[i] = p.x;
+            r.y.v[i] = p.y;
+            r.z.v[i] = p.z;
+        }
+        return r;
+    }
+    void store(Vec3 *a, int count = N) const {
+        for(int i = 0; i < count; i++) {
+            a[i] = Vec3(x.v[i], y.v[i], z.v[i]);
+        }
+    }
+    Vec3 get(int i) const {
+        return Vec3(x.v[i], y.v[i], z.v[i]);
+    }
+    void set(int i, const Vec3 &a) {
+        x.v[i] = a.x;
+        y.v[i] = a.y;
+        z.v[i] = a.z;
+    }
+
+    FloatN<N> dotProduct(const Vec3xN &o) const {
+        return x*o.x + y*o.y + z*o.z;
+    }
+    FloatN<N> getLength() const {
+        return sqrt(dotProduct(*this));
+    }
+    void normalize(bool fast = false) {
+        FloatN<N> s = rsqrt(dotProduct(*this), fast);
+        x = x*s;
+        y = y*s;
+        z = z*s;
+    }
+
+    Vec3xN operator+ (const Vec3xN &o) const {
+        return Vec3xN(x + o.x, y + o.y, z + o.z);
+    }
+    Vec3xN operator- (const Vec3xN &o) const {
+        return Vec3xN(x - o.x, y - o.y, z - o.z);
+    }
+    Vec3xN operator* (const FloatN<N> &s) const {
+        return Vec3xN(x*s, y*s, z*s);
+    }
+    Vec3xN operator- () const {
+        return Vec3xN(-x, -y, -z);
+    }
+    friend Vec3xN operator* (const FloatN<N> &s, const Vec3xN &a) {
+        return a*s;
+    }
+};
+
+template<int N>
+inline Vec3xN<N> select(const MaskN<N> &m, const Vec3xN<N> &a, const Vec3xN<N> &b) {
+    return Vec3xN<N>(select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z));
+}
+
+typedef FloatN<4> Floatx4;
+typedef FloatN<8> Floatx8;
+typedef Vec3xN<4> Vec3x4;
+typedef Vec3xN<8> Vec3x8;
+
+// intersectSphereUnit() for N lanes. Lanes can be different balls for one
+// ray, different rays for one ball, or both.
+template<int N>
+inline MaskN<N> intersectSphereWide(const Vec3xN<N> &pos, const FloatN<N> &radius, const Vec3xN<N> &origin, const Vec3xN<N> &dir, FloatN<N> &distance) {
+    Vec3xN<N> L = origin - pos;
+    FloatN<N> a = dir.dotProduct(dir);
+    FloatN<N> b = 2.0f*dir.dotProduct(L);
+    FloatN<N> c = L.dotProduct(L) - radius*radius;
+
+    FloatN<N> discriminant = b*b - 4.0f*a*c;
+    MaskN<N> hit = discriminant > 0.0f;
+    FloatN<N> root = sqrt(max(discriminant, FloatN<N>(0.0f)));
+    FloatN<N> t0 = (-b + root)/(2.0f*a);
+    FloatN<N> t1 = (-b - root)/(2.0f*a);
+    FloatN<N> t = min(t0, t1);
+
+    hit = hit & (t >= 0.0f);
+    distance = select(hit, t, distance);
+    return hit;
+}
+
+// Ball::getNormal() and Ball::getMirrored() for N lanes
+template<int N>
+inline Vec3xN<N> sphereNormalWide(const Vec3xN<N> &pos, const Vec3xN<N> &point, bool fast = false) {
+    Vec3xN<N> normal = point - pos;
+    normal.normalize(fast);
+    return normal;
+}
+template<int N>
+inline Vec3xN<N> mirroredWide(const Vec3xN<N> &dir, const Vec3xN<N> &normal, bool fast = false) {
+    Vec3xN<N> in = -dir;
+    in.normalize(fast);
+    Vec3xN<N> projection = normal.dotProduct(in)*normal;
+    return projection + projection - in;
+}
+
+// Diffuse and specular terms of one light as in computeBrightness(), zero
+// where lit is false
+template<int N>
+inline void lightTermsWide(const Vec3xN<N> &point, const Vec3xN<N> &normal, const Vec3xN<N> &mirrored, const Vec3 &light_pos,
+                           const MaskN<N> &lit, FloatN<N> &diffuce, FloatN<N> &specular, bool fast = false) {
+    Vec3xN<N> light_dir = Vec3xN<N>(light_pos) - point;
+    light_dir.normalize(fast);
+    diffuce = select(lit, normal.dotProduct(light_dir), FloatN<N>(0.0f));
+    specular = select(lit, mirrored.dotProduct(light_dir), FloatN<N>(0.0f));
+}
+
+class Ball {
+private:
+    Vec3 pos;
+    Material material;
+    float radius;
+public:
+    Ball(Vec3 pos, Material material, float radius) :
+        pos(pos), material(material), radius(radius) {}
+
+    Ball() : pos(Vec3()), material(Material()), radius(0) {}
+    
+    const Vec3 &getPos() const{
+        return pos;
+    }
+    const float getRadius() const{
+        return radius;
+    }
+    const Material &getMaterial() const{
+        return material;
+    }
+    const bool intersect(const Ray &in, float &distance) const {
+        return intersectSphere(pos, radius, in, distance);
+    }
+    const Vec3 getNormal(const Vec3 &point) const{
+        Vec3 normal = point - pos;
+        normal.normalize();
+        return normal;
+    }
+    const Vec3 getMirrored(const Vec3 &dir, const Vec3 &point) const {
+        Vec3 in = (-1)*(dir.copy());
+        in.normalize();
+        Vec3 normal = this->getNormal(point);
+        Vec3 projection = normal.dotProduct(in)*normal;
+        Vec3 mirrored = projection + projection - in;
+        return mirrored;
+    }
+};
+
+class Light {
+private:
+    Vec3 pos;
+    Vec3 color;
+    float brightness;
+public:
+    Light(Vec3 pos) :
+        pos(pos), color(Vec3(1.0f)), brightness(1.0f) {}
+    Light(Vec3 pos, Vec3 color, float brightness) :
+        pos(pos), color(color), brightness(brightness) {}
+
+    const Vec3 &getPos() const{
+        return pos;
+    }
+    const Vec3 &getColor() const{
+        return color;
+    }
+    void rotate(float angle = 0.03f) {
+        // Rotation matrix
+        float cosalpha = cosf(angle);
+        float sinalpha = sinf(angle);
+        float temp_x = pos.x;
+        float temp_z = pos.z;
+        pos.x = temp_x*cosalpha + temp_z*sinalpha;
+        pos.z = -temp_x*sinalpha + temp_z*cosalpha;
+    }
+};
+
+class Camera {
+private:
+    Vec3 pos;
+    Vec3 dir;
+    float fov;
+public:
+    Camera(Vec3 pos, Vec3 dir, float fov) :
+        pos(pos), dir(dir), fov(fov) {}
+
+    const Vec3 &getPos() const{
+        return pos;
+    }
+    const Vec3 &getDir() const {
+        return dir;
+    }
+    const float getFov() const {
+        return fov;
+    }
+    void move(Vec3 amount) {
+        float cosalpha = cosf(0.006f);
+        float sinalpha = sinf(0.006f);
+
+        // Rotate direction
+        float temp_x = dir.x;
+        float temp_z = dir.z;
+        dir.x = temp_x*cosalpha + temp_z*sinalpha;
+        dir.z = -temp_x*sinalpha + temp_z*cosalpha;
+
+        cosalpha = cosf(-0.006f);
+        sinalpha = sinf(-0.006f);
+
+        //Rotate position around y-axis
+        /*
+        temp_x = pos.x;
+        temp_z = pos.z;
+        pos.x = temp_x*cosalpha + temp_z*sinalpha;
+        pos.z = -temp_x*sinalpha + temp_z*cosalpha;
+        */
+        return;
+    }
+};
+
+// A placed copy of a cluster of balls: rotation by angle around axis,
+// uniform scale and then translation to pos. Spheres stay spheres under
+// this transform, so a cluster can be traced in its own space.
+class Instance {
+private:
+    int cluster;
+    Vec3 pos;
+    float scale;
+    Vec3 rows[3];   // Rotation matrix
+
+public:
+    Instance(int cluster, Vec3 pos, Vec3 axis, float angle, float scale) :
+        cluster(cluster), pos(pos), scale(scale) {
+        axis.normalize();
+        float c = cosf(angle);
+        float s = sinf(angle);
+        float t = 1.0f - c;
+        rows[0] = Vec3(t*axis.x*axis.x + c, t*axis.x*axis.y - s*axis.z, t*axis.x*axis.z + s*axis.y);
+        rows[1] = Vec3(t*axis.x*axis.y + s*axis.z, t*axis.y*axis.y + c, t*axis.y*axis.z - s*axis.x);
+        rows[2] = Vec3(t*axis.x*axis.z - s*axis.y, t*axis.y*axis.z + s*axis.x, t*axis.z*axis.z + c);
+    }
+
+    int getCluster() const {
+        return cluster;
+    }
+    const Vec3 &getPos() const {
+        return pos;
+    }
+    float getScale() const {
+        return scale;
+    }
+    Vec3 pointToWorld(const Vec3 &p) const {
+        return pos + scale*Vec3(rows[0].dotProduct(p), rows[1].dotProduct(p), rows[2].dotProduct(p));
+    }
+    Vec3 pointToLocal(const Vec3 &p) const {
+        return dirToLocal(p - pos)*(1.0f/scale);
+    }
+    // Keeps the length of the direction
+    Vec3 dirToLocal(const Vec3 &d) const {
+        return d.x*rows[0] + d.y*rows[1] + d.z*rows[2];
+    }
+    Ball toWorld(const Ball &ball) const {
+        return Ball(pointToWorld(ball.getPos()), ball.getMaterial(), ball.getRadius()*scale);
+    }
+};
+
+// Sphere geometry without the material, 16 bytes
+struct SphereRecord {
+    float x, y, z, radius;
+};
+
+// Material with the colour and roughness quantised to 8 bits, 4 bytes
+struct PackedMaterial {
+    uint8_t r, g, b, roughness;
+
+    static uint8_t quantize(float f) {
+        return (uint8_t)lroundf(fminf(fmaxf(f, 0.0f), 1.0f)*255.0f);
+    }
+    static PackedMaterial pack(const Material &material) {
+        const Vec3 &c = material.getColor();
+        return {quantize(c.x), quantize(c.y), quantize(c.z), quantize(material.getRoughness())};
+    }
+    Material unpack() const {
+        return Material(Vec3(r, g, b)*(1.0f/255.0f), roughness*(1.0f/255.0f));
+    }
+};
+
+// Plain balls of a scene as geometry and packed materials, 20 bytes a ball.
+// Shared by the scene and its SphereBVH, see SphereBVH::adopt().
+struct CompactBalls {
+    std::vector<SphereRecord> spheres;
+    std::vector<PackedMaterial> materials;
+
+    Ball get(int i) const {
+        const SphereRecord &s = spheres[i];
+        return Ball(Vec3(s.x, s.y, s.z), materials[i].unpack(), s.radius);
+    }
+};
+
+// Number unique to every Scene object in the process. A copy gets a new
+// one, so a scene built in the place of another is never mistaken for it.
+class SceneId {
+private:
+    uint64_t id;
+
+    static uint64_t next() {
+        static std::atomic<uint64_t> counter(0);
+        return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+public:
+    SceneId() : id(next()) {}
+    SceneId(const SceneId&) : id(next()) {}
+    SceneId &operator=(const SceneId&) {
+        id = next();
+        return *this;
+    }
+    uint64_t get() const {
+        return id;
+    }
+};
+
+class Scene {
+private:
+    SceneId id;
+    std::vector<Ball> balls;
+    std::shared_ptr<const CompactBalls> compact;    // The plain balls instead of balls, if set
+    std::vector<Light> lights;
+    Camera camera;
+
+    // Balls that are stored once and placed many times. Instanced balls are
+    // numbered after the plain balls, instance by instance.
+    std::vector<std::vector<Ball>> clusters;
+    std::vector<Instance> instances;
+    std::vector<int> instance_first;    // Number of the first ball of every instance, minus getPlainCount()
+    int instanced_count;
+
+    // Bumped on every change so renderers can tell what is out of date
+    uint64_t balls_version;
+    uint64_t lights_version;
+    uint64_t camera_version;
+public:
+    Scene(Camera camera) : camera(camera), instanced_count(0), balls_version(0), lights_version(0), camera_version(0) {}
+
+    // Empty once the plain balls are compact, getBall() still has them
+    const std::vector<Ball> &getBalls() const {
+        return balls;
+    }
+    // Replaces the plain balls with compact ones in the order given by
+    // order, the old number of every new ball. Drops the Ball records.
+    std::shared_ptr<const CompactBalls> compactBalls(const std::vector<uint32_t> &order) {
+        std::shared_ptr<CompactBalls> packed(new CompactBalls());
+        packed->spheres.reserve(order.size());
+        packed->materials.reserve(order.size());
+        for(uint32_t i : order) {
+            Ball ball = getBall(i);
+            const Vec3 &p = ball.getPos();
+            packed->spheres.push_back({p.x, p.y, p.z, ball.getRadius()});
+            packed->materials.push_back(PackedMaterial::pack(ball.getMaterial()));
+        }
+        std::vector<Ball>().swap(balls);
+        compact = packed;
+        balls_version++;
+        return compact;
+    }
+    const CompactBalls *getCompactBalls() const {
+        return compact.get();
+    }
+    // Number of plain balls, compact or not
+    int getPlainCount() const {
+        return compact != nullptr ? compact->spheres.size() : balls.size();
+    }
+    void addBall(Ball ball) {
+        if(compact != nullptr) {
+            // Back to Ball records, the compact ones may be shared
+            for(int i = 0; i < (int)compact->spheres.size(); i++) {
+                balls.push_back(compact->get(i));
+            }
+            compact = nullptr;
+        }
+        balls.push_back(ball);
+        balls_version++;
+    }
+    // Returns the number of the new cluster
+    int addCluster(const std::vector<Ball> &cluster) {
+        clusters.push_back(cluster);
+        balls_version++;
+        return clusters.size() - 1;
+    }
+    void addInstance(const Instance &instance) {
+        instance_first.push_back(instanced_count);
+        instanced_count += clusters[instance.getCluster()].size();
+        instances.push_back(instance);
+        balls_version++;
+    }
+    const std::vector<std::vector<Ball>> &getClusters() const {
+        return clusters;
+    }
+    const std::vector<Instance> &getInstances() const {
+        return instances;
+    }
+    // Number of the first ball of instance i
+    int getInstanceFirst(int i) const {
+        return getPlainCount() + instance_first[i];
+    }
+    // Plain and instanced balls together
+    int getBallCount() const {
+        return getPlainCount() + instanced_count;
+    }
+    // Ball number index in world space, counting instanced balls too
+    Ball getBall(int index) const {
+        if(index < getPlainCount())
+            return compact != nullptr ? compact->get(index) : balls[index];
+        index -= getPlainCount();
+        int i = std::upper_bound(instance_first.begin(), instance_first.end(), index) - instance_first.begin() - 1;
+        return instances[i].toWorld(clusters[instances[i].getCluster()][index - instance_first[i]]);
+    }
+    const std::vector<Light> &getLights() const {
+        return lights;
+    }
+    void addLight(Light light) {
+        lights.push_back(light);
+        lights_version++;
+    }
+    const Camera &getCamera() const {
+        return camera;
+    }
+    void setCamera(Camera camera) {
+        this->camera = camera;
+        camera_version++;
+    }
+    void update() {
+        for(Light &light : lights) {
+            light.rotate();
+        }
+        if(!lights.empty())
+            lights_version++;
+        //this->camera.move(Vec3(0.0f, 0.0f, 0.05f));
+    }
+    // The scene after frame calls to update(), computed directly so that
+    // frames of an animation do not depend on each other
+    Scene atFrame(int frame) const {
+        Scene scene = *this;
+        for(Light &light : scene.lights) {
+            light.rotate(0.03f*frame);
+        }
+        if(frame != 0 && !lights.empty())
+            scene.lights_version++;
+        return scene;
+    }
+
+    uint64_t getId() const {
+        return id.get();
+    }
+    uint64_t getBallsVersion() const {
+        return balls_version;
+    }
+    uint64_t getLightsVersion() const {
+        return lights_version;
+    }
+    uint64_t getCameraVersion() const {
+        return camera_version;
+    }
+    // Changes whenever any of the versions above changes
+    uint64_t getVersion() const {
+        return balls_version + lights_version + camera_version;
+    }
+};
+
+// Stateless hash used for per-sample random numbers (PCG output function)
+inline uint32_t hashRandom(uint32_t v) {
+    uint32_t state = v*747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state)*277803737u;
+    return (word >> 22u) ^ word;
+}
+
+inline float hashFloat(uint32_t v) {
+    return (hashRandom(v) >> 8)*(1.0f/16777216.0f);
+}
+
+// Ball number i of the random part of setupScene(seed), computed from the
+// index alone so huge scenes can be generated in a stream
+inline Ball randomBall(uint32_t seed, uint32_t i) {
+    uint32_t base = hashRandom(seed) + i*7;
+    Vec3 pos = Vec3(hashFloat(base)*20 - 10, hashFloat(base + 1)*12 - 7.5f, hashFloat(base + 2)*20 - 10);
+    Vec3 color = Vec3(hashFloat(base + 3), hashFloat(base + 4), hashFloat(base + 5));
+    return Ball(pos, Material(color, 1.0f), hashFloat(base + 6)*3);
+}
+
+// Adds a cluster of seven balls and count randomly placed, turned and scaled copies of it
+inline void addClusterInstances(Scene &scene, int count, uint32_t seed) {
+    std::vector<Ball> cluster;
+    cluster.push_back(Ball(Vec3(0.0f), Material(Vec3(0.9f, 0.8f, 0.3f), 1.0f), 0.5f));
+    const Vec3 arms[6] = {Vec3(1, 0, 0), Vec3(-1, 0, 0), Vec3(0, 1, 0), Vec3(0, -1, 0), Vec3(0, 0, 1), Vec3(0, 0, -1)};
+    for(int i = 0; i < 6; i++) {
+        Vec3 color = Vec3(0.2f + 0.1f*i, 0.3f, 0.9f - 0.1f*i);
+        cluster.push_back(Ball(arms[i]*0.7f, Material(color, 1.0f), 0.25f));
+    }
+    int id = scene.addCluster(cluster);
+
+    for(int i = 0; i < count; i++) {
+        uint32_t base = hashRandom(seed ^ 0x9e3779b9u) + i*8;
+        Vec3 pos = Vec3(hashFloat(base)*20 - 10, hashFloat(base + 1)*12 - 7.5f, hashFloat(base + 2)*20 - 10);
+        Vec3 axis = Vec3(hashFloat(base + 3) - 0.5f, hashFloat(base + 4) - 0.5f, hashFloat(base + 5) - 0.5f + 1e-3f);
+        float angle = hashFloat(base + 6)*2*M_PI;
+        float scale = 0.5f + hashFloat(base + 7);
+        scene.addInstance(Instance(id, pos, axis, angle, scale));
+    }
+}
+
+inline const Scene setupScene(const int ballsmax, uint32_t seed, int instances = 0) {
+    float fov = 45.0f;
+    Camera camera = Camera(Vec3(0.0f, 0.0f, -2.0f),Vec3(1.0f, 0.0f, 0.0f),fov);
+    Scene scene = Scene(camera);
+
+    // Create balls
+    for(int i = 0; i < ballsmax; i++) {
+        scene.addBall(randomBall(seed, i));
+    }
+
+    // Red ball
+    Vec3 ball_color = Vec3(0.9f, 0.2f, 0.2f);
+    Material material = Material(ball_color, 1.0f);
+    Vec3 ball_pos = Vec3(4.0f, 1.0f, 8.0f);
+    Ball ball = Ball(ball_pos,material,1.0f);
+    scene.addBall(ball);
+
+    // Green ball
+    ball_color = Vec3(0.3f, 0.9f, 0.4f);
+    material = Material(ball_color, 1.0f);
+    ball_pos = Vec3(7.0f, 4.0f, 21.0f);
+    ball = Ball(ball_pos,material,10.0f);
+    scene.addBall(ball);
+
+    // Blue ball
+    ball_color = Vec3(0.2f, 0.2f, 0.9f);
+    material = Material(ball_color, 1.0f);
+    ball_pos = Vec3(50.0f, -1.0f, 00.0f);
+    ball = Ball(ball_pos,material,4.0f);
+    scene.addBall(ball);
+
+    // Light 1
+    Vec3 pos = Vec3(100.0f, 140.0f, 200.0f);
+    Vec3 color = Vec3(1.0f);
+    float brightness = 1.0f;
+    Light light = Light(pos, color, brightness);
+    scene.addLight(light);
+
+    if(instances > 0)
+        addClusterInstances(scene, instances, seed);
+    return scene;
+}
+
+inline float vectorAngle(float x, float y) {
+    if (x == 0) // special cases
+        return (y > 0)? 0.5f*M_PI
+            : (y == 0)? 0.0f
+            : 1.5f*M_PI;
+    else if (y == 0) // special cases
+        return (x >= 0)? 0.0f
+            : (float)M_PI;
+    float ret = atanf((float)y/x);
+    if (x < 0 && y < 0) // quadrant Ⅲ
+        ret = M_PI + ret;
+    else if (x < 0) // quadrant Ⅱ
+        ret = M_PI + ret; // it actually substracts
+    else if (y < 0) // quadrant Ⅳ
+        ret = 1.5f*M_PI + (0.5f*M_PI + ret); // it actually substracts
+    return ret;
+}
+
+// Image plane distance and rotation used to generate primary rays
+inline void cameraBasis(const Camera &camera, int h, float &z, float &cosalpha, float &sinalpha) {
+    float fov = camera.getFov();
+    Vec3 cam_dir = camera.getDir();
+    z = h/tanf(fov/180*M_PI)*0.5f;
+
+    float alpha = vectorAngle(cam_dir.x, cam_dir.z);  //(float)atanf(cam_dir.z/cam_dir.x);
+    cosalpha = cosf(alpha);
+    sinalpha = sinf(alpha);
+}
+
+// Direction of the ray through image point (sx, sy), rotated to the camera direction
+inline Vec3 primaryRayDir(float sx, float sy, int w, int h, float z, float cosalpha, float sinalpha) {
+    Vec3 dir = Vec3(sx-w*0.5f, -(sy-h*0.5f), z);
+    dir.normalize();
+
+    float temp_x = dir.x;
+    float temp_z = dir.z;
+    dir.x = temp_x*cosalpha + temp_z*sinalpha;
+    dir.z = -temp_x*sinalpha + temp_z*cosalpha;
+    return dir;
+}
+
+// Direction of the ray through the centre of pixel (x, y)
+inline Vec3 primaryRayDir(int x, int y, int w, int h, float z, float cosalpha, float sinalpha) {
+    return primaryRayDir((float)x+0.5f, (float)y+0.5f, w, h, z, cosalpha, sinalpha);
+}
+
+// primaryRayDir() for the N pixels from (x, y) to the right
+template<int N>
+inline Vec3xN<N> primaryRayDirWide(int x, int y, int w, int h, float z, float cosalpha, float sinalpha) {
+    Vec3xN<N> dir;
+    for(int i = 0; i < N; i++) {
+        dir.x.v[i] = ((float)(x + i) + 0.5f) - w*0.5f;
+        dir.y.v[i] = -(((float)y + 0.5f) - h*0.5f);
+        dir.z.v[i] = z;
+    }
+    dir.normalize();
+    return Vec3xN<N>(dir.x*cosalpha + dir.z*sinalpha, dir.y, -dir.x*sinalpha + dir.z*cosalpha);
+}
+
+inline void computeRays(std::vector<Ray> &rays, int w, int h, Camera camera) {
+    Vec3 cam_pos = camera.getPos();
+    float z, cosalpha, sinalpha;
+    cameraBasis(camera, h, z, cosalpha, sinalpha);
+    rays.resize(w*h);
+
+    // SIMD_WIDTH directions at a time
+    Vec3 dirs[SIMD_WIDTH];
+    for(int y = 0; y < h; y++) {
+        for(int x = 0; x < w; x += SIMD_WIDTH) {
+            int count = std::min(SIMD_WIDTH, w - x);
+            primaryRayDirWide<SIMD_WIDTH>(x, y, w, h, z, cosalpha, sinalpha).store(dirs, count);
+            for(int i = 0; i < count; i++) {
+                rays[y*w + x + i] = Ray(cam_pos, dirs[i]);
+            }
+        }
+    }
+}
+
+inline void moveRays(std::vector<Ray> &rays, Camera camera) {
+    Vec3 cam_dir = camera.getDir();
+    Vec3 cam_pos = camera.getPos();
+
+    //float alpha = vectorAngle(cam_dir.x, cam_dir.z);  //(float)atanf(cam_dir.z/cam_dir.x);
+    float alpha = 0.05f;
+    float cosalpha = cosf(alpha);
+    float sinalpha = sinf(alpha);
+
+
+    for(int i = 0; i < rays.size(); i++) {
+        // Rotate
+        Ray ray = rays[i];
+        Vec3 dir = ray.getDir();
+        float temp_x = dir.x;
+        float temp_z = dir.z;
+        dir.x = temp_x*cosalpha + temp_z*sinalpha;
+        dir.z = -temp_x*sinalpha + temp_z*cosalpha;   
+
+        rays[i].setPos(cam_pos);
+        rays[i].setDir(dir);// = Ray(cam_pos,dir);
+    }
+}
+
+inline std::vector<Vec3> computeRayDirs(int w, int h, Camera camera) {
+    std::vector<Vec3> ray_dirs;
+    float fov = camera.getFov();
+    Vec3 dir = camera.getDir();
+    float z = h/tanf(fov/180*M_PI)*0.5f;
+
+    for(int y = 0; y < h; y++) {
+        for(int x = 0; x < w; x++) {
+            Vec3 dir = Vec3((float)x+0.5f-w*0.5f, -((float)y+0.5f-h*0.5f), z);
+            dir.normalize();
+
+            Vec3 ray_dir = dir;
+            ray_dirs.push_back(ray_dir);
+        }
+    }
+    return ray_dirs;
+}
+
+inline void rotateRayDirections(std::vector<Vec3> &ray_dirs, float theta) {
+    float cosalpha = cosf(theta);
+    float sinalpha = sinf(theta);
+    for(Vec3 &dir : ray_dirs) {
+        float temp_x = dir.x;
+        float temp_z = dir.z;
+        float x = temp_x*cosalpha + temp_z*sinalpha;
+        float z = -temp_x*sinalpha + temp_z*cosalpha;
+        float y = dir.y;
+        dir = Vec3(x, y, z);
+    }
+}
+
+inline Vec3 computeBackground(const Ray &ray, const Scene &scene) {
+    Vec3 bg = Vec3(0.05f);
+    Vec3 bg_light = Vec3(0.0f); 
+    Vec3 dir = ray.getDir().copy();
+    dir.normalize();
+    float dot = 0.0f;
+    
+    const auto& lights = scene.getLights();
+    for(const auto& light : lights) {
+        Vec3 light_dir = ray.getPos() - light.getPos();
+        light_dir.normalize();
+        float dot_product = light_dir.dotProduct(-dir);
+        if(dot_product > dot) 
+            dot = dot_product;
+    }
+
+    if(dot > 0.991f) {
+        dot = (dot - 0.991)*130;
+        dot = powf(dot,8);
+        bg_light = Vec3(fmin(dot,1.0f),fmin(dot,1.0f),fmin(dot,1.0f));
+    }
+    return Vec3(fmin(bg.x+bg_light.x, 1.0f));
+    
+}
+
+// 4-wide tree node with full precision child bounds, 112 bytes
+struct WideNode {
+    float min_x[4], min_y[4], min_z[4];
+    float max_x[4], max_y[4], max_z[4];
+    uint32_t child[4];
+};
+
+// 4-wide tree node with child bounds quantised to 8 bits inside the node bounds, 64 bytes
+struct QuantizedNode {
+    float origin[3];
+    float scale[3];
+    uint8_t min_x[4], min_y[4], min_z[4];
+    uint8_t max_x[4], max_y[4], max_z[4];
+    uint32_t child[4];
+};
+
+enum BVHLayout {
+    BVH_WIDE,       // WideNode and full Ball records
+    BVH_COMPACT     // QuantizedNode, leaves of up to 8 and SphereRecord plus a ball index, or the CompactBalls of adopt()
+};
+
+// 4-ary bounding volume hierarchy over the balls of a scene. Queries
+// return the index of the ball in the scene, so materials and the rest
+// of the shading come from Scene::getBall(). After adopt() the tree and
+// the scene share one CompactBalls in tree order instead of a copy of the
+// spheres, a ball index and the scene's Ball records.
+class SphereBVH {
+private:
+    friend class SphereLOD;     // Builds with split()
+    static const uint32_t EMPTY = 0xffffffff;
+    static const uint32_t LEAF = 0x80000000;
+    static const int LEAF_SIZE = 4;
+    static const int COMPACT_LEAF_SIZE = 8;     // Fewer nodes per sphere, the most leafRef() holds
+
+    BVHLayout layout;
+    std::vector<WideNode> wide_nodes;
+    std::vector<QuantizedNode> quantized_nodes;
+    std::vector<Ball> balls;                // BVH_WIDE
+    std::vector<SphereRecord> spheres;      // BVH_COMPACT
+    std::vector<uint32_t> ball_index;       // Scene index of every sphere in tree order
+    std::shared_ptr<const CompactBalls> adopted;    // BVH_COMPACT after adopt(), replaces spheres and ball_index
+    uint32_t root;
+
+    // After adopt() the scene numbers its balls in tree order
+    uint32_t sceneIndex(uint32_t i) const {
+        return adopted != nullptr ? i : ball_index[i];
+    }
+
+    static uint32_t leafRef(uint32_t first, int count) {
+        return LEAF | first << 3 | (count - 1);
+    }
+
+    struct Bounds {
+        float min[3], max[3];
+    };
+
+    static Bounds sphereBounds(const Ball &ball) {
+        const Vec3 &p = ball.getPos();
+        float r = ball.getRadius();
+        return {{p.x - r, p.y - r, p.z - r}, {p.x + r, p.y + r, p.z + r}};
+    }
+    static Bounds rangeBounds(const std::vector<Ball> &source, const uint32_t *index, int count) {
+        Bounds b = {{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+        for(int i = 0; i < count; i++) {
+            Bounds s = sphereBounds(source[index[i]]);
+            for(int a = 0; a < 3; a++) {
+                b.min[a] = fminf(b.min[a], s.min[a]);
+                b.max[a] = fmaxf(b.max[a], s.max[a]);
+            }
+        }
+        return b;
+    }
+
+    // Median split of index[0, count) along the longest centroid axis
+    static int split(const std::vector<Ball> &source, uint32_t *index, int count) {
+        float min[3] = {INFINITY, INFINITY, INFINITY};
+        float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+        for(int i = 0; i < count; i++) {
+            const Vec3 &p = source[index[i]].getPos();
+            float c[3] = {p.x, p.y, p.z};
+            for(int a = 0; a < 3; a++) {
+                min[a] = fminf(min[a], c[a]);
+                max[a] = fmaxf(max[a], c[a]);
+            }
+        }
+        int axis = 0;
+        for(int a = 1; a < 3; a++) {
+            if(max[a] - min[a] > max[axis] - min[axis]) axis = a;
+        }
+        int middle = count / 2;
+        std::nth_element(index, index + middle, index + count, [&](uint32_t l, uint32_t r) {
+            const Vec3 &pl = source[l].getPos();
+            const Vec3 &pr = source[r].getPos();
+            return axis == 0 ? pl.x < pr.x : axis == 1 ? pl.y < pr.y : pl.z < pr.z;
+        });
+        return middle;
+    }
+
+    // Builds a subtree over index[first, first + count) and returns its reference
+    uint32_t build(const std::vector<Ball> &source, std::vector<uint32_t> &index, uint32_t first, int count) {
+        int leaf_size = layout == BVH_COMPACT ? COMPACT_LEAF_SIZE : LEAF_SIZE;
+        if(count <= leaf_size)
+            return leafRef(first, count);
+
+        // Two levels of binary splits give up to four children
+        int half = split(source, &index[first], count);
+        int ranges[4][2];
+        int children = 0;
+        const int halves[2][2] = {{0, half}, {half, count - half}};
+        for(int h = 0; h < 2; h++) {
+            int begin = halves[h][0];
+            int size = halves[h][1];
+            if(size <= leaf_size) {
+                ranges[children][0] = begin;
+                ranges[children][1] = size;
+                children++;
+            } else {
+                int quarter = split(source, &index[first + begin], size);
+                ranges[children][0] = begin;
+                ranges[children][1] = quarter;
+                ranges[children + 1][0] = begin + quarter;
+                ranges[children + 1][1] = size - quarter;
+                children += 2;
+            }
+        }
+
+        uint32_t node = wide_nodes.size();
+        wide_nodes.push_back(WideNode());
+        for(int c = 0; c < 4; c++) {
+            uint32_t ref = EMPTY;
+            Bounds b = {{0, 0, 0}, {0, 0, 0}};
+            if(c < children) {
+                b = rangeBounds(source, &index[first + ranges[c][0]], ranges[c][1]);
+                ref = build(source, index, first + ranges[c][0], ranges[c][1]);
+            }
+            WideNode &n = wide_nodes[node];
+            n.min_x[c] = b.min[0]; n.min_y[c] = b.min[1]; n.min_z[c] = b.min[2];
+            n.max_x[c] = b.max[0]; n.max_y[c] = b.max[1]; n.max_z[c] = b.max[2];
+            n.child[c] = ref;
+        }
+        return node;
+    }
+
+    static QuantizedNode quantize(const WideNode &n) {
+        QuantizedNode q;
+        const float *mins[3] = {n.min_x, n.min_y, n.min_z};
+        const float *maxs[3] = {n.max_x, n.max_y, n.max_z};
+        uint8_t *qmins[3] = {q.min_x, q.min_y, q.min_z};
+        uint8_t *qmaxs[3] = {q.max_x, q.max_y, q.max_z};
+        for(int a = 0; a < 3; a++) {
+            float lo = INFINITY, hi = -INFINITY;
+            for(int c = 0; c < 4; c++) {
+                if(n.child[c] == EMPTY) continue;
+                lo = fminf(lo, mins[a][c]);
+                hi = fmaxf(hi, maxs[a][c]);
+            }
+            // Round the step up so that 255 steps always reach the top
+            float step = (hi - lo)/255.0f;
+            step = step > 0.0f ? nextafterf(step, INFINITY) : 1.0f;
+            q.origin[a] = lo;
+            q.scale[a] = step;
+            for(int c = 0; c < 4; c++) {
+                if(n.child[c] == EMPTY) {
+                    qmins[a][c] = 255;
+                    qmaxs[a][c] = 0;
+                    continue;
+                }
+                // Round outwards so the quantised box still contains the child
+                qmins[a][c] = (uint8_t)std::max(0.0f, floorf((mins[a][c] - lo)/step) - 1.0f);
+                qmaxs[a][c] = (uint8_t)std::min(255.0f, ceilf((maxs[a][c] - lo)/step) + 1.0f);
+            }
+        }
+        for(int c = 0; c < 4; c++) {
+            q.child[c] = n.child[c];
+        }
+        return q;
+    }
+
+    // Distances where the ray enters every child box, INFINITY for a miss
+    static void childEntry(const WideNode &n, const float o[3], const float inv[3], float tmax, float t[4]) {
+        for(int c = 0; c < 4; c++) {
+            float t0x = (n.min_x[c] - o[0])*inv[0], t1x = (n.max_x[c] - o[0])*inv[0];
+            float t0y = (n.min_y[c] - o[1])*inv[1], t1y = (n.max_y[c] - o[1])*inv[1];
+            float t0z = (n.min_z[c] - o[2])*inv[2], t1z = (n.max_z[c] - o[2])*inv[2];
+            float near = fmaxf(fmaxf(fminf(t0x, t1x), fminf(t0y, t1y)), fmaxf(fminf(t0z, t1z), 0.0f));
+            float far = fminf(fminf(fmaxf(t0x, t1x), fmaxf(t0y, t1y)), fminf(fmaxf(t0z, t1z), tmax));
+            t[c] = (n.child[c] != EMPTY && near <= far) ? near : INFINITY;
+        }
+    }
+    static void childEntry(const QuantizedNode &n, const float o[3], const float inv[3], float tmax, float t[4]) {
+        for(int c = 0; c < 4; c++) {
+            float t0x = (n.origin[0] + n.min_x[c]*n.scale[0] - o[0])*inv[0], t1x = (n.origin[0] + n.max_x[c]*n.scale[0] - o[0])*inv[0];
+            float t0y = (n.origin[1] + n.min_y[c]*n.scale[1] - o[1])*inv[1], t1y = (n.origin[1] + n.max_y[c]*n.scale[1] - o[1])*inv[1];
+            float t0z = (n.origin[2] + n.min_z[c]*n.scale[2] - o[2])*inv[2], t1z = (n.origin[2] + n.max_z[c]*n.scale[2] - o[2])*inv[2];
+            float near = fmaxf(fmaxf(fminf(t0x, t1x), fminf(t0y, t1y)), fmaxf(fminf(t0z, t1z), 0.0f));
+            float far = fminf(fminf(fmaxf(t0x, t1x), fmaxf(t0y, t1y)), fminf(fmaxf(t0z, t1z), tmax));
+            t[c] = (n.child[c] != EMPTY && near <= far) ? near : INFINITY;
+        }
+    }
+
+    bool intersectLeaf(uint32_t i, const Vec3 &origin, const Vec3 &dir, float &distance) const {
+        if(layout == BVH_WIDE)
+            return intersectSphereUnit(balls[i].getPos(), balls[i].getRadius(), origin, dir, distance);
+        const SphereRecord &s = adopted != nullptr ? adopted->spheres[i] : spheres[i];
+        return intersectSphereUnit(Vec3(s.x, s.y, s.z), s.radius, origin, dir, distance);
+    }
+
+    // Visits the leaves whose boxes the ray reaches before tmax, nearest box first.
+    // leaf(first, count, origin, dir, tmax) may lower tmax and returns true to stop.
+    template<typename Node, typename Leaf>
+    void traverse(const std::vector<Node> &nodes, const Ray &ray, float &tmax, Leaf &&leaf) const {
+        Vec3 dir = ray.getDir();
+        dir.normalize();
+        const Vec3 pos = ray.getPos();
+        const float o[3] = {pos.x, pos.y, pos.z};
+        const float inv[3] = {1.0f/dir.x, 1.0f/dir.y, 1.0f/dir.z};
+
+        uint32_t stack[64*3];
+        float stack_t[64*3];
+        int top = 0;
+        stack[top] = root;
+        stack_t[top++] = 0.0f;
+        while(top > 0) {
+            top--;
+            uint32_t ref = stack[top];
+            if(stack_t[top] > tmax) continue;
+            if(ref & LEAF) {
+                uint32_t first = (ref & ~LEAF) >> 3;
+                int count = (ref & 7) + 1;
+                if(leaf(first, count, pos, dir, tmax))
+                    return;
+                continue;
+            }
+
+            // Push the hit children far to near so the nearest is visited first
+            float t[4];
+            childEntry(nodes[ref], o, inv, tmax, t);
+            int order[4] = {0, 1, 2, 3};
+            for(int i = 1; i < 4; i++) {
+                for(int j = i; j > 0 && t[order[j]] > t[order[j - 1]]; j--) {
+                    std::swap(order[j], order[j - 1]);
+                }
+            }
+            for(int i = 0; i < 4; i++) {
+                if(t[order[i]] != INFINITY) {
+                    stack[top] = nodes[ref].child[order[i]];
+                    stack_t[top++] = t[order[i]];
+                }
+            }
+        }
+    }
+
+    // Closest hit (AnyHit = false) or any hit (AnyHit = true)
+    template<typename Node, bool AnyHit>
+    int traverse(const std::vector<Node> &nodes, const Ray &ray, float &closest_distance) const {
+        int closest = -1;
+        closest_distance = -1;
+        float tmax = INFINITY;
+        traverse(nodes, ray, tmax, [&](uint32_t first, int count, const Vec3 &pos, const Vec3 &dir, float &tmax) {
+            for(uint32_t i = first; i < first + count; i++) {
+                float distance;
+                if(intersectLeaf(i, pos, dir, distance) && (distance < closest_distance || closest_distance < 0)) {
+                    closest_distance = distance;
+                    closest = sceneIndex(i);
+                    tmax = distance;
+                    if(AnyHit)
+                        return true;
+                }
+            }
+            return false;
+        });
+        return closest;
+    }
+
+public:
+    SphereBVH(BVHLayout layout = BVH_COMPACT) : layout(layout), root(EMPTY) {}
+
+    void build(const std::vector<Ball> &source) {
+        wide_nodes.clear();
+        quantized_nodes.clear();
+        balls.clear();
+        spheres.clear();
+        adopted = nullptr;
+        ball_index.resize(source.size());
+        for(uint32_t i = 0; i < source.size(); i++) {
+            ball_index[i] = i;
+        }
+        if(source.empty()) {
+            root = EMPTY;
+            return;
+        }
+        root = build(source, ball_index, 0, source.size());
+        if(root & LEAF) {
+            // Always start from a node so traversal has a single entry point
+            WideNode n = WideNode();
+            Bounds b = rangeBounds(source, ball_index.data(), source.size());
+            for(int c = 0; c < 4; c++) {
+                n.min_x[c] = b.min[0]; n.min_y[c] = b.min[1]; n.min_z[c] = b.min[2];
+                n.max_x[c] = b.max[0]; n.max_y[c] = b.max[1]; n.max_z[c] = b.max[2];
+                n.child[c] = c == 0 ? root : EMPTY;
+            }
+            wide_nodes.push_back(n);
+            root = wide_nodes.size() - 1;
+        }
+
+        // Store the spheres in tree order
+        if(layout == BVH_WIDE) {
+            balls.reserve(source.size());
+            for(uint32_t i : ball_index) {
+                balls.push_back(source[i]);
+            }
+        } else {
+            spheres.reserve(source.size());
+            for(uint32_t i : ball_index) {
+                const Vec3 &p = source[i].getPos();
+                spheres.push_back({p.x, p.y, p.z, source[i].getRadius()});
+            }
+            quantized_nodes.reserve(wide_nodes.size());
+            for(const WideNode &n : wide_nodes) {
+                quantized_nodes.push_back(quantize(n));
+            }
+            std::vector<WideNode>().swap(wide_nodes);
+        }
+    }
+
+    // Builds the tree over the plain balls of scene and moves them into it.
+    // The scene renumbers its plain balls in tree order and keeps them as
+    // CompactBalls shared with the tree, without Ball records. Meant for
+    // BVH_COMPACT, a BVH_WIDE tree still keeps its own Ball copies.
+    void adopt(Scene &scene) {
+        std::vector<Ball> plain(scene.getPlainCount());
+        for(int i = 0; i < (int)plain.size(); i++) {
+            plain[i] = scene.getBall(i);
+        }
+        build(plain);
+        std::vector<Ball>().swap(plain);
+        adopted = scene.compactBalls(ball_index);
+        std::vector<SphereRecord>().swap(spheres);
+        std::vector<uint32_t>().swap(ball_index);
+    }
+
+    // Index of the closest ball hit by the ray, -1 if none
+    int closestHit(const Ray &ray, float &distance) const {
+        if(root == EMPTY) return -1;
+        if(layout == BVH_WIDE)
+            return traverse<WideNode, false>(wide_nodes, ray, distance);
+        return traverse<QuantizedNode, false>(quantized_nodes, ray, distance);
+    }
+    bool anyHit(const Ray &ray) const {
+        if(root == EMPTY) return false;
+        float distance;
+        if(layout == BVH_WIDE)
+            return traverse<WideNode, true>(wide_nodes, ray, distance) >= 0;
+        return traverse<QuantizedNode, true>(quantized_nodes, ray, distance) >= 0;
+    }
+
+    // Calls leaf(index, origin, dir, tmax) for every sphere whose box the ray
+    // reaches before tmax, nearest box first. index is the position in the
+    // vector given to build(), origin and dir are the ray with a unit direction.
+    // leaf may lower tmax and returns true to stop.
+    template<typename Leaf>
+    void visit(const Ray &ray, float &tmax, Leaf &&leaf) const {
+        if(root == EMPTY) return;
+        auto leaves = [&](uint32_t first, int count, const Vec3 &pos, const Vec3 &dir, float &tmax) {
+            for(uint32_t i = first; i < first + count; i++) {
+                if(leaf(sceneIndex(i), pos, dir, tmax))
+                    return true;
+            }
+            return false;
+        };
+        if(layout == BVH_WIDE)
+            traverse(wide_nodes, ray, tmax, leaves);
+        else
+            traverse(quantized_nodes, ray, tmax, leaves);
+    }
+
+    BVHLayout getLayout() const {
+        return layout;
+    }
+    size_t getNodeBytes() const {
+        return wide_nodes.size()*sizeof(WideNode) + quantized_nodes.size()*sizeof(QuantizedNode);
+    }
+    // Spheres the tree reads and its ball index. After adopt() these are
+    // the shared CompactBalls, the scene's only copy of its plain balls.
+    size_t getSphereBytes() const {
+        size_t bytes = balls.size()*sizeof(Ball) + spheres.size()*sizeof(SphereRecord) + ball_index.size()*sizeof(uint32_t);
+        if(adopted != nullptr)
+            bytes += adopted->spheres.size()*(sizeof(SphereRecord) + sizeof(PackedMaterial));
+        return bytes;
+    }
+    size_t getSphereCount() const {
+        return adopted != nullptr ? adopted->spheres.size() : ball_index.size();
+    }
+};
+
+// Two level hierarchy over the instances of a scene. Every cluster has one
+// bottom level SphereBVH shared by all of its instances, and the top level
+// is a SphereBVH over the bounding spheres of the instances. Memory grows
+// with the clusters and the number of instances, not with the instanced balls.
+class InstanceBVH {
+private:
+    BVHLayout layout;
+    std::vector<SphereBVH> clusters;
+    std::vector<Instance> instances;
+    std::vector<int> first;     // Scene number of the first ball of every instance
+    std::vector<SphereRecord> bounds;   // World space bounding sphere of every instance
+    SphereBVH top;
+
+    // Closest hit (AnyHit = false) or any hit (AnyHit = true). Returns the
+    // scene number of the ball, for any hits just some ball of the instance.
+    template<bool AnyHit>
+    int query(const Ray &ray, float &closest_distance) const {
+        int closest = -1;
+        closest_distance = -1;
+        float tmax = INFINITY;
+        top.visit(ray, tmax, [&](uint32_t i, const Vec3 &pos, const Vec3 &dir, float &tmax) {
+            // Cheap rejection against the bounding sphere, which is tighter than its box
+            const SphereRecord &b = bounds[i];
+            Vec3 L = pos - Vec3(b.x, b.y, b.z);
+            float half_b = dir.dotProduct(L);
+            float c = L.dotProduct(L) - b.radius*b.radius;
+            float discriminant = half_b*half_b - c;
+            if(discriminant <= 0.0f || -half_b + sqrtf(discriminant) < 0.0f || -half_b - sqrtf(discriminant) > tmax)
+                return false;
+
+            const Instance &instance = instances[i];
+            const SphereBVH &cluster = clusters[instance.getCluster()];
+            Ray local = Ray(instance.pointToLocal(pos), instance.dirToLocal(dir));
+            if(AnyHit) {
+                if(!cluster.anyHit(local))
+                    return false;
+                closest = first[i];
+                return true;
+            }
+            float distance;
+            int hit = cluster.closestHit(local, distance);
+            distance *= instance.getScale();
+            if(hit >= 0 && (distance < closest_distance || closest_distance < 0)) {
+                closest_distance = distance;
+                closest = first[i] + hit;
+                tmax = distance;
+            }
+            return false;
+        });
+        return closest;
+    }
+
+public:
+    InstanceBVH(BVHLayout layout = BVH_COMPACT) : layout(layout), top(layout) {}
+
+    void build(const Scene &scene) {
+        const auto& source = scene.getClusters();
+        clusters.assign(source.size(), SphereBVH(layout));
+        std::vector<Ball> cluster_bounds(source.size());
+        for(int c = 0; c < (int)source.size(); c++) {
+            clusters[c].build(source[c]);
+
+            // Bounding sphere around the centroid
+            Vec3 center = Vec3(0.0f);
+            for(const Ball &ball : source[c]) {
+                center = center + ball.getPos();
+            }
+            center = center*(1.0f/std::max<size_t>(1, source[c].size()));
+            float radius = 0.0f;
+            for(const Ball &ball : source[c]) {
+                radius = fmaxf(radius, (ball.getPos() - center).getLength() + ball.getRadius());
+            }
+            cluster_bounds[c] = Ball(center, Material(), radius*1.0001f);
+        }
+
+        instances = scene.getInstances();
+        first.resize(instances.size());
+        bounds.resize(instances.size());
+        std::vector<Ball> instance_bounds(instances.size());
+        for(int i = 0; i < (int)instances.size(); i++) {
+            first[i] = scene.getInstanceFirst(i);
+            instance_bounds[i] = instances[i].toWorld(cluster_bounds[instances[i].getCluster()]);
+            const Vec3 &p = instance_bounds[i].getPos();
+            bounds[i] = {p.x, p.y, p.z, instance_bounds[i].getRadius()};
+        }
+        top.build(instance_bounds);
+    }
+
+    // Scene number of the closest ball hit by the ray, -1 if none
+    int closestHit(const Ray &ray, float &distance) const {
+        return query<false>(ray, distance);
+    }
+    bool anyHit(const Ray &ray) const {
+        float distance;
+        return query<true>(ray, distance) >= 0;
+    }
+
+    bool empty() const {
+        return instances.empty();
+    }
+    // Bottom level trees, top level tree and instance records
+    size_t getBytes() const {
+        size_t bytes = top.getNodeBytes() + top.getSphereBytes() + instances.size()*(sizeof(Instance) + sizeof(int) + sizeof(SphereRecord));
+        for(const SphereBVH &cluster : clusters) {
+            bytes += cluster.getNodeBytes() + cluster.getSphereBytes();
+        }
+        return bytes;
+    }
+};
+
+// Level of detail for balls too small to see. A binary tree of bounding
+// spheres over the balls, where every node also has a proxy ball: the area
+// weighted mean position and colour of the balls under it, with the radius
+// that covers the same area, kept inside the node's bound. A ray stops
+// descending where a node is narrower than lod_scale times the width of
+// its pixel cone there, and hits the proxy instead of the balls.
+class SphereLOD {
+private:
+    static const int LEAF_SIZE = 4;
+
+    struct Node {
+        Vec3 center;
+        float radius;           // Bound of the balls
+        uint32_t first, count;  // Balls in tree order
+        uint32_t left, right;   // Children, 0 for a leaf
+        Ball proxy;
+    };
+    std::vector<Node> nodes;
+    std::vector<Ball> balls;                // Tree order
+    std::vector<uint32_t> ball_index;       // Scene index of every ball in tree order
+    float pixel_angle;
+    float lod_scale;
+
+    uint32_t build(const std::vector<Ball> &source, uint32_t first, int count) {
+        uint32_t node = nodes.size();
+        nodes.push_back(Node());
+
+        // Bound around the middle of the box, proxy from the area weighted sums
+        Vec3 lo = Vec3(INFINITY), hi = Vec3(-INFINITY);
+        Vec3 centroid, color;
+        float area = 0.0f;
+        for(int i = 0; i < count; i++) {
+            const Ball &b = source[ball_index[first + i]];
+            const Vec3 &p = b.getPos();
+            float r = b.getRadius();
+            lo = Vec3(fminf(lo.x, p.x - r), fminf(lo.y, p.y - r), fminf(lo.z, p.z - r));
+            hi = Vec3(fmaxf(hi.x, p.x + r), fmaxf(hi.y, p.y + r), fmaxf(hi.z, p.z + r));
+            centroid = centroid + p*(r*r);
+            color = color + b.getMaterial().getColor()*(r*r);
+            area += r*r;
+        }
+        Vec3 center = 0.5f*(lo + hi);
+        float radius = 0.0f;
+        for(int i = 0; i < count; i++) {
+            const Ball &b = source[ball_index[first + i]];
+            radius = fmaxf(radius, (b.getPos() - center).getLength() + b.getRadius());
+        }
+        float weight = area > 0.0f ? 1.0f/area : 0.0f;
+        centroid = area > 0.0f ? centroid*weight : center;
+        float proxy_radius = fminf(sqrtf(area), radius - (centroid - center).getLength());
+
+        Node &n = nodes[node];
+        n.center = center;
+        n.radius = radius;
+        n.first = first;
+        n.count = count;
+        n.left = 0;
+        n.right = 0;
+        n.proxy = Ball(centroid, Material(color*weight, 1.0f), fmaxf(proxy_radius, 0.0f));
+        if(count > LEAF_SIZE) {
+            int half = SphereBVH::split(source, &ball_index[first], count);
+            uint32_t left = build(source, first, half);
+            uint32_t right = build(source, first + half, count - half);
+            nodes[node].left = left;
+            nodes[node].right = right;
+        }
+        return node;
+    }
+
+    // Distance where a unit ray enters the node's bound, 0 from inside, -1 for a miss
+    static float enterBound(const Node &n, const Vec3 &origin, const Vec3 &dir) {
+        Vec3 L = origin - n.center;
+        float c = L.dotProduct(L) - n.radius*n.radius;
+        if(c <= 0.0f)
+            return 0.0f;
+        float b = dir.dotProduct(L);
+        float discriminant = b*b - c;
+        if(b > 0.0f || discriminant < 0.0f)
+            return -1.0f;
+        return -b - sqrtf(discriminant);
+    }
+
+    // Closest (AnyHit = false) or any (AnyHit = true) ball or proxy hit by a
+    // ray that has already travelled start from the camera, nullptr if none
+    template<bool AnyHit>
+    const Ball *query(const Ray &ray, float start, float &closest_distance, int &index, bool *proxy) const {
+        closest_distance = -1;
+        index = -1;
+        if(nodes.empty())
+            return nullptr;
+        Vec3 origin = ray.getPos();
+        Vec3 dir = ray.getDir().copy();
+        dir.normalize();
+        const float cone = pixel_angle*lod_scale;
+
+        const Ball *closest = nullptr;
+        float best = INFINITY;
+        uint32_t stack[64];
+        float entry[64];
+        int top = 0;
+        float t = enterBound(nodes[0], origin, dir);
+        if(t >= 0.0f) {
+            stack[top] = 0;
+            entry[top++] = t;
+        }
+        while(top > 0) {
+            top--;
+            const Node &n = nodes[stack[top]];
+            if(entry[top] >= best)
+                continue;
+
+            float distance;
+            if(n.left != 0 && 2.0f*n.radius <= (start + entry[top])*cone) {
+                if(intersectSphereUnit(n.proxy.getPos(), n.proxy.getRadius(), origin, dir, distance) && distance < best) {
+                    best = distance;
+                    closest = &n.proxy;
+                    index = ball_index[n.first];
+                    if(proxy != nullptr)
+                        *proxy = true;
+                    if(AnyHit)
+                        break;
+                }
+            } else if(n.left == 0) {
+                for(uint32_t i = n.first; i < n.first + n.count; i++) {
+                    if(intersectSphereUnit(balls[i].getPos(), balls[i].getRadius(), origin, dir, distance) && distance < best) {
+                        best = distance;
+                        closest = &balls[i];
+                        index = ball_index[i];
+                        if(proxy != nullptr)
+                            *proxy = false;
+                        if(AnyHit)
+                            break;
+                    }
+                }
+                if(AnyHit && closest != nullptr)
+                    break;
+            } else {
+                // Nearer child on top
+                float t0 = enterBound(nodes[n.left], origin, dir);
+                float t1 = enterBound(nodes[n.right], origin, dir);
+                uint32_t near = n.left, far = n.right;
+                if(t1 >= 0.0f && (t0 < 0.0f || t1 < t0)) {
+                    std::swap(near, far);
+                    std::swap(t0, t1);
+                }
+                if(t1 >= 0.0f && top < 64) {
+                    stack[top] = far;
+                    entry[top++] = t1;
+                }
+                if(t0 >= 0.0f && top < 64) {
+                    stack[top] = near;
+                    entry[top++] = t0;
+                }
+            }
+        }
+        if(closest != nullptr)
+            closest_distance = best;
+        return closest;
+    }
+
+public:
+    SphereLOD(float lod_scale = 1.0f) : pixel_angle(0.0f), lod_scale(lod_scale) {}
+
+    void build(const std::vector<Ball> &source) {
+        nodes.clear();
+        balls.clear();
+        ball_index.resize(source.size());
+        for(uint32_t i = 0; i < source.size(); i++) {
+            ball_index[i] = i;
+        }
+        if(source.empty())
+            return;
+        build(source, 0, source.size());
+        for(uint32_t i : ball_index) {
+            balls.push_back(source[i]);
+        }
+    }
+
+    // Angle between the rays of neighbouring pixels, see cameraBasis()
+    void setView(const Camera &camera, int h) {
+        float z, cosalpha, sinalpha;
+        cameraBasis(camera, h, z, cosalpha, sinalpha);
+        pixel_angle = 1.0f/z;
+    }
+    void setScale(float scale) {
+        lod_scale = scale;
+    }
+
+    // Sets index to the scene index of the ball hit, or of the first ball
+    // under the proxy hit
+    const Ball *closestHit(const Ray &ray, float start, float &closest_distance, int &index, bool *proxy = nullptr) const {
+        return query<false>(ray, start, closest_distance, index, proxy);
+    }
+    // Shadow rays from points start away from the camera
+    bool anyHit(const Ray &ray, float start) const {
+        float distance;
+        int index;
+        return query<true>(ray, start, distance, index, nullptr) != nullptr;
+    }
+
+    size_t getNodeCount() const {
+        return nodes.size();
+    }
+};
+
+inline double getSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Approximate shadows from a depth cube map around every light. A map is
+// rebuilt only when its light moves or the balls change.
+class ShadowMaps {
+private:
+    int resolution;
+    float bias;
+    std::vector<std::vector<float>> maps;   // 6 faces of resolution^2 distances per light
+    std::vector<Vec3> light_positions;
+    uint64_t balls_version;
+    int builds;
+    double build_time;
+
+    // Face 0..5 is +x, -x, +y, -y, +z, -z. u and v are the two other axes divided by the major one.
+    static Vec3 faceDirection(int face, float u, float v) {
+        int axis = face / 2;
+        float sign = (face % 2 == 0) ? 1.0f : -1.0f;
+        float d[3];
+        d[axis] = sign;
+        d[(axis + 1) % 3] = u;
+        d[(axis + 2) % 3] = v;
+        return Vec3(d[0], d[1], d[2]);
+    }
+    static void faceCoordinates(const Vec3 &dir, int &face, float &u, float &v) {
+        float d[3] = {dir.x, dir.y, dir.z};
+        int axis = 0;
+        if(fabsf(d[1]) > fabsf(d[axis])) axis = 1;
+        if(fabsf(d[2]) > fabsf(d[axis])) axis = 2;
+        float major = fabsf(d[axis]);
+        face = axis*2 + (d[axis] < 0 ? 1 : 0);
+        u = d[(axis + 1) % 3] / major;
+        v = d[(axis + 2) % 3] / major;
+    }
+    int texel(float coordinate) const {
+        int t = (int)((coordinate*0.5f + 0.5f)*resolution);
+        return std::min(std::max(t, 0), resolution - 1);
+    }
+
+    // Conservative texel rectangle covered by a ball on one face, false if none
+    bool coverage(const Ball &ball, const Vec3 &light_pos, int face, int rect[4]) const {
+        int axis = face / 2;
+        float sign = (face % 2 == 0) ? 1.0f : -1.0f;
+        Vec3 center = ball.getPos() - light_pos;
+        float r = ball.getRadius();
+        float min_u = INFINITY, max_u = -INFINITY, min_v = INFINITY, max_v = -INFINITY;
+        int in_front = 0;
+        for(int corner = 0; corner < 8; corner++) {
+            float c[3] = {center.x + ((corner & 1) ? r : -r),
+                          center.y + ((corner & 2) ? r : -r),
+                          center.z + ((corner & 4) ? r : -r)};
+            float major = sign*c[axis];
+            if(major <= 0.0f) continue;
+            in_front++;
+            float u = c[(axis + 1) % 3] / major;
+            float v = c[(axis + 2) % 3] / major;
+            min_u = fminf(min_u, u); max_u = fmaxf(max_u, u);
+            min_v = fminf(min_v, v); max_v = fmaxf(max_v, v);
+        }
+        if(in_front == 0)
+            return false;
+        if(in_front < 8) {
+            // The box straddles the face plane, cover the whole face
+            min_u = min_v = -1.0f;
+            max_u = max_v = 1.0f;
+        }
+        if(min_u > 1.0f || max_u < -1.0f || min_v > 1.0f || max_v < -1.0f)
+            return false;
+        rect[0] = texel(min_u); rect[1] = texel(max_u);
+        rect[2] = texel(min_v); rect[3] = texel(max_v);
+        return true;
+    }
+
+    void build(int index, const Scene &scene) {
+        const Vec3 light_pos = scene.getLights()[index].getPos();
+        int ball_count = scene.getBallCount();
+        std::vector<float> &map = maps[index];
+        map.assign(6*resolution*resolution, INFINITY);
+
+        for(int face = 0; face < 6; face++) {
+            // Only texels covered by some ball need a ray
+            std::vector<std::pair<Ball, std::array<int, 4>>> covered;
+            for(int b = 0; b < ball_count; b++) {
+                Ball ball = scene.getBall(b);
+                std::array<int, 4> rect;
+                if(coverage(ball, light_pos, face, rect.data()))
+                    covered.push_back(std::make_pair(ball, rect));
+            }
+            float *depth = &map[face*resolution*resolution];
+
+#pragma omp parallel for schedule(dynamic, 8)
+            for(int ty = 0; ty < resolution; ty++) {
+                float v = (ty + 0.5f)/resolution*2.0f - 1.0f;
+                for(const auto& entry : covered) {
+                    const std::array<int, 4> &rect = entry.second;
+                    if(ty < rect[2] || ty > rect[3]) continue;
+                    const Ball &ball = entry.first;
+                    for(int tx = rect[0]; tx <= rect[1]; tx++) {
+                        float u = (tx + 0.5f)/resolution*2.0f - 1.0f;
+                        float distance;
+                        if(ball.intersect(Ray(light_pos, faceDirection(face, u, v)), distance))
+                            depth[ty*resolution + tx] = fminf(depth[ty*resolution + tx], distance);
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    ShadowMaps(int resolution, float bias) :
+        resolution(resolution), bias(bias), balls_version(0), builds(0), build_time(0.0) {}
+
+    // Rebuilds the maps of lights that moved, or all of them if the balls changed
+    void update(const Scene &scene) {
+        const auto& lights = scene.getLights();
+        bool geometry_changed = scene.getBallsVersion() != balls_version || maps.size() != lights.size();
+        maps.resize(lights.size());
+        light_positions.resize(lights.size());
+
+        for(int i = 0; i < (int)lights.size(); i++) {
+            const Vec3 &pos = lights[i].getPos();
+            const Vec3 &old = light_positions[i];
+            if(!geometry_changed && !maps[i].empty() && pos.x == old.x && pos.y == old.y && pos.z == old.z)
+                continue;
+            double begin = getSeconds();
+            build(i, scene);
+            build_time += getSeconds() - begin;
+            builds++;
+            light_positions[i] = pos;
+        }
+        balls_version = scene.getBallsVersion();
+    }
+
+    bool occluded(int light, const Vec3 &light_pos, const Vec3 &point) const {
+        Vec3 dir = point - light_pos;
+        int face;
+        float u, v;
+        faceCoordinates(dir, face, u, v);
+        float depth = maps[light][(face*resolution + texel(v))*resolution + texel(u)];
+        return dir.getLength() - bias > depth;
+    }
+
+    int getBuilds() const {
+        return builds;
+    }
+    // Total time spent rebuilding maps in milliseconds
+    double getBuildTime() const {
+        return build_time*1000.0;
+    }
+};
+
+// Shading features a trace pipeline can be specialised for
+enum ShadingFeature : unsigned {
+    SHADE_SHADOWS   = 1 << 0,
+    SHADE_SPECULAR  = 1 << 1,
+    SHADE_ALL       = SHADE_SHADOWS | SHADE_SPECULAR
+};
+
+// Balls that rays of one screen tile can hit. Primary ray lists are sorted
+// by the smallest distance at which each ball can be hit, shadow ray lists
+// have no near distances.
+struct TileList {
+    const uint32_t *balls;
+    const float *near;
+    int count;
+};
+
+// Closest plain ball seen through a pixel and its distance, -1 for none
+struct VisibilityHit {
+    int ball;
+    float distance;
+};
+
+// Rays traced and time spent working, counted per thread so that the
+// threads do not share cache lines
+class RenderCounters {
+public:
+    struct alignas(64) Counts {
+        long long primary = 0;
+        long long secondary = 0;
+        long long shadow = 0;
+        double busy = 0.0;      // Seconds inside renderFrame()'s parallel loops
+    };
+
+private:
+    std::vector<Counts> threads;
+
+public:
+    RenderCounters() : threads(std::max(omp_get_max_threads(), omp_get_num_procs())) {}
+
+    Counts &local() {
+        return threads[omp_get_thread_num() % threads.size()];
+    }
+
+    // Sum over the threads since the last reset()
+    Counts total() const {
+        Counts sum;
+        for(const auto& t : threads) {
+            sum.primary += t.primary;
+            sum.secondary += t.secondary;
+            sum.shadow += t.shadow;
+            sum.busy += t.busy;
+        }
+        return sum;
+    }
+    void reset() {
+        std::fill(threads.begin(), threads.end(), Counts());
+    }
+};
+
+struct RenderSettings {
+    int max_bounces = 10;
+    unsigned features = SHADE_ALL;
+    const ShadowMaps *shadow_maps = nullptr;    // Look shadows up here instead of tracing them
+    const SphereBVH *bvh = nullptr;             // Traverse this instead of testing every ball
+    const InstanceBVH *instances = nullptr;     // Instanced balls, traced in addition to the plain ones
+    const TileList *primary_list = nullptr;     // Plain balls to test for primary rays, bounces test the scene
+    const TileList *shadow_lists = nullptr;     // Plain balls to test for shadows of primary hits, one list per light
+    RenderCounters *counters = nullptr;         // Count the rays here
+    const VisibilityHit *primary_hit = nullptr; // Plain ball hit of the primary ray, already known
+    const SphereLOD *lod = nullptr;             // Plain balls with proxies for small clusters, used instead of bvh
+};
+
+inline bool checkShadow(const Scene &scene, const Light &light, const Vec3 &pos, const Ball &ball){
+    //Look for a shadow made by other balls
+    const auto& balls = scene.getBalls();
+    for(const auto& b: balls){
+        float distance;
+        Vec3 dir = light.getPos() - pos;
+
+        
+        /* //Optimization Huom: ota huomioon säteen lähtöpiste!
+        float radius = b.getRadius();
+        Vec3 center = ball.getPos();
+        Vec3 cent = b.getPos();
+        //Decrease amount of the balls by checking the coordinates
+        if(dir.y > 0 && (cent.y + radius - center.y < 0)) 
+            continue; //The ball is below the point and sun is up
+        if(dir.y < 0 && (cent.y - radius - center.y > 0)) 
+            continue; //The ball is on top of the point and sun is down
+        if(dir.x > 0 && (cent.x + radius - center.x < 0)) 
+            continue;
+        if(dir.x < 0 && (cent.x - radius - center.x > 0)) 
+            continue;
+        if(dir.z > 0 && (cent.z + radius - center.z < 0)) 
+            continue;
+        if(dir.z < 0 && (cent.z - radius - center.z > 0)) 
+            continue;
+        //Optimization ends 
+        */
+
+        //A ray from the ball to the light
+        if(b.intersect(Ray(pos, dir), distance)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Phong illumination model
+inline Vec3 shadePhong(const Vec3 &ball_color, float diffuce, float specular) {
+    return ball_color + ball_color*fmax(diffuce,0.0f) + ball_color*fmax(powf(specular,15), 0.0f);
+}
+
+// Shadow test against the balls of a tile's occluder list
+inline bool checkShadowList(const Scene &scene, const Light &light, const Vec3 &pos, const TileList &list) {
+    const auto& balls = scene.getBalls();
+    Ray ray = Ray(pos, light.getPos() - pos);
+    for(int i = 0; i < list.count; i++) {
+        float distance;
+        if(balls[list.balls[i]].intersect(ray, distance))
+            return true;
+    }
+    return false;
+}
+
+// Shadow test against light number index. Only primary hits use settings.shadow_lists.
+inline bool inShadow(const Scene &scene, int index, const Vec3 &pos, const Ball &ball, const RenderSettings &settings, bool primary = false) {
+    const Light &light = scene.getLights()[index];
+    if(settings.counters != nullptr)
+        settings.counters->local().shadow++;
+    if(settings.shadow_maps != nullptr)
+        return settings.shadow_maps->occluded(index, light.getPos(), pos);
+    if(settings.instances != nullptr && settings.instances->anyHit(Ray(pos, light.getPos() - pos)))
+        return true;
+    if(primary && settings.shadow_lists != nullptr)
+        return checkShadowList(scene, light, pos, settings.shadow_lists[index]);
+    if(settings.lod != nullptr)
+        return settings.lod->anyHit(Ray(pos, light.getPos() - pos), (pos - scene.getCamera().getPos()).getLength());
+    if(settings.bvh != nullptr)
+        return settings.bvh->anyHit(Ray(pos, light.getPos() - pos));
+    return checkShadow(scene, light, pos, ball);
+}
+
+inline void computeBrightness(const Ray &ray, const Scene &scene, const Ray &normal_ray, const Ball &ball, float &specular, float& diffuce, const RenderSettings &settings, bool primary = false) {
+    Vec3 normal     = normal_ray.getDir();
+    Vec3 pos        = normal_ray.getPos();
+    Vec3 dir        = ray.getDir();
+    Vec3 mirrored   = ball.getMirrored(dir, pos);
+    
+    diffuce = 0.0f;
+    specular = 0.0f;
+    
+    const auto& lights = scene.getLights();
+    for(int i = 0; i < (int)lights.size(); i++) {
+        const Light &light = lights[i];
+        // Shadow
+        if((settings.features & SHADE_SHADOWS) && inShadow(scene, i, pos, ball, settings, primary)) continue;
+
+        // Diffuce light
+        Vec3 light_dir = light.getPos() - pos;
+        light_dir.normalize();
+        diffuce =+ normal.dotProduct(light_dir);
+
+        // Specular light
+        if(settings.features & SHADE_SPECULAR)
+            specular =+ mirrored.dotProduct(light_dir);
+    }
+}
+
+// Closest ball of a tile list. The list is sorted front to back, so the
+// search stops at the first ball that cannot be closer than the best hit.
+inline int closestInList(const Ray &ray, const Scene &scene, const TileList &list, float &closest_distance) {
+    const auto& balls = scene.getBalls();
+    int closest = -1;
+    closest_distance = -1;
+    for(int i = 0; i < list.count; i++) {
+        if(closest >= 0 && list.near[i] > closest_distance)
+            break;
+        float distance;
+        if(balls[list.balls[i]].intersect(ray, distance)) {
+            if(distance < closest_distance || closest_distance < 0) {
+                closest_distance = distance;
+                closest = list.balls[i];
+            }
+        }
+    }
+    return closest;
+}
+
+inline const Vec3 trace(const Ray &ray, const Scene &scene, int bounces, const RenderSettings &settings = RenderSettings(), int *hit_ball = nullptr) {
+    Ball ball;
+    Ray normal_ray;
+    if(settings.counters != nullptr)
+        (bounces == 0 ? settings.counters->local().primary : settings.counters->local().secondary)++;
+
+    // Find closest intersecting ball
+    float closest_distance = -1;
+    int closest = -1;
+    const auto& balls = scene.getBalls();
+    if(bounces == 0 && settings.primary_hit != nullptr) {
+        closest = settings.primary_hit->ball;
+        if(closest >= 0) {
+            closest_distance = settings.primary_hit->distance;
+            ball = balls[closest];
+            Vec3 point = closest_distance*(ray.getDir()) + ray.getPos();
+            normal_ray = Ray(point, ball.getNormal(point));
+        }
+    }
+    else if(bounces == 0 && settings.primary_list != nullptr) {
+        closest = closestInList(ray, scene, *settings.primary_list, closest_distance);
+        if(closest >= 0) {
+            ball = balls[closest];
+            Vec3 point = closest_distance*(ray.getDir()) + ray.getPos();
+            normal_ray = Ray(point, ball.getNormal(point));
+        }
+    }
+    else if(settings.lod != nullptr) {
+        // Reflections widen the cone at least as much as the path so far
+        float start = (ray.getPos() - scene.getCamera().getPos()).getLength();
+        const Ball *hit = settings.lod->closestHit(ray, start, closest_distance, closest);
+        if(hit != nullptr) {
+            ball = *hit;
+            Vec3 point = closest_distance*(ray.getDir()) + ray.getPos();
+            normal_ray = Ray(point, ball.getNormal(point));
+        }
+    }
+    else if(settings.bvh != nullptr) {
+        // The scene may have no Ball records after SphereBVH::adopt()
+        closest = settings.bvh->closestHit(ray, closest_distance);
+        if(closest >= 0) {
+            ball = scene.getBall(closest);
+            Vec3 point = closest_distance*(ray.getDir()) + ray.getPos();
+            normal_ray = Ray(point, ball.getNormal(point));
+        }
+    }
+    else for(int i = 0; i < (int)balls.size(); i++) {
+        const Ball &b = balls[i];
+        float distance;
+        if(b.intersect(ray, distance)) {
+            if(distance < closest_distance || closest_distance < 0) {
+                closest_distance = distance;
+                closest = i;
+                ball = b;
+                Vec3 point = distance*(ray.getDir()) + ray.getPos();
+                normal_ray = Ray(point, ball.getNormal(point));
+            }
+        }
+    }
+    if(settings.instances != nullptr) {
+        float distance;
+        int hit = settings.instances->closestHit(ray, distance);
+        if(hit >= 0 && (distance < closest_distance || closest_distance < 0)) {
+            closest_distance = distance;
+            closest = hit;
+            ball = scene.getBall(hit);
+            Vec3 point = distance*(ray.getDir()) + ray.getPos();
+            normal_ray = Ray(point, ball.getNormal(point));
+        }
+    }
+    if(hit_ball != nullptr)
+        *hit_ball = closest;
+
+    // No ball was found -> Draw background
+    if(closest_distance < 0) {
+        return computeBackground(ray, scene);
+    }
+
+    float specular, diffuce;
+    computeBrightness(ray, scene, normal_ray, ball, specular, diffuce, settings, bounces == 0);
+    // Draw color of the point
+    const Vec3 ball_color = 0.25f*(ball.getMaterial().getColor());
+
+    Vec3 pixel = shadePhong(ball_color, diffuce, specular);
+
+    if(bounces < settings.max_bounces) {
+        bounces++;
+        Ray new_ray = Ray(normal_ray.getPos(), (ball.getMirrored(ray.getDir(), normal_ray.getPos())));
+        pixel = 0.3f*pixel + 0.6f*trace(new_ray, scene, bounces, settings);
+    }
+    return pixel;
+}
+
+// Index of the closest ball hit by the ray, -1 if none. With hit the plain
+// balls are not searched again. With lod, lod_ball is set to the plain ball
+// or proxy that was hit.
+inline int closestBall(const Ray &ray, const Scene &scene, float &closest_distance, const SphereBVH *bvh = nullptr,
+                       const InstanceBVH *instances = nullptr, const TileList *list = nullptr, const VisibilityHit *hit = nullptr,
+                       const SphereLOD *lod = nullptr, const Ball **lod_ball = nullptr) {
+    int closest = -1;
+    closest_distance = -1;
+    if(lod_ball != nullptr)
+        *lod_ball = nullptr;
+    if(hit != nullptr) {
+        closest = hit->ball;
+        closest_distance = hit->ball >= 0 ? hit->distance : -1;
+    } else if(list != nullptr) {
+        closest = closestInList(ray, scene, *list, closest_distance);
+    } else if(lod != nullptr) {
+        float start = (ray.getPos() - scene.getCamera().getPos()).getLength();
+        const Ball *ball = lod->closestHit(ray, start, closest_distance, closest);
+        if(lod_ball != nullptr)
+            *lod_ball = ball;
+    } else if(bvh != nullptr) {
+        closest = bvh->closestHit(ray, closest_distance);
+    } else {
+        const auto& balls = scene.getBalls();
+        for(int i = 0; i < (int)balls.size(); i++) {
+            float distance;
+            if(balls[i].intersect(ray, distance)) {
+                if(distance < closest_distance || closest_distance < 0) {
+                    closest_distance = distance;
+                    closest = i;
+                }
+            }
+        }
+    }
+    if(instances != nullptr) {
+        float distance;
+        int hit = instances->closestHit(ray, distance);
+        if(hit >= 0 && (distance < closest_distance || closest_distance < 0)) {
+            closest_distance = distance;
+            closest = hit;
+            if(lod_ball != nullptr)
+                *lod_ball = nullptr;
+        }
+    }
+    return closest;
+}
+
+// x^N with the multiplications unrolled at compile time
+template<int N>
+constexpr float ipow(float x) {
+    if constexpr (N == 0) {
+        return 1.0f;
+    } else if constexpr (N % 2 == 1) {
+        return x * ipow<N - 1>(x);
+    } else {
+        const float half = ipow<N / 2>(x);
+        return half * half;
+    }
+}
+
+template<typename F, size_t... I>
+inline void staticForImpl(F &&f, std::index_sequence<I...>) {
+    (f(std::integral_constant<size_t, I>()), ...);
+}
+
+// Calls f(0) ... f(N-1) with the index as a compile time constant
+template<size_t N, typename F>
+inline void staticFor(F &&f) {
+    staticForImpl(f, std::make_index_sequence<N>());
+}
+
+// Same shading as trace(), but with the bounce depth, light count and
+// shading features fixed at compile time. The bounce recursion and the
+// light loop are fully unrolled. Only a Primary ray uses settings.primary_list,
+// settings.primary_hit and settings.shadow_lists.
+template<int Bounces, int Lights, unsigned Features, bool Primary = true>
+const Vec3 traceStatic(const Ray &ray, const Scene &scene, const RenderSettings &settings, int *hit_ball = nullptr) {
+    if(settings.counters != nullptr)
+        (Primary ? settings.counters->local().primary : settings.counters->local().secondary)++;
+
+    // Find closest intersecting ball
+    float closest_distance;
+    const Ball *lod_ball;
+    int closest = closestBall(ray, scene, closest_distance, settings.bvh, settings.instances, Primary ? settings.primary_list : nullptr,
+                              Primary ? settings.primary_hit : nullptr, settings.lod, &lod_ball);
+    if(hit_ball != nullptr)
+        *hit_ball = closest;
+
+    // No ball was found -> Draw background
+    if(closest < 0) {
+        return computeBackground(ray, scene);
+    }
+    const Ball ball = lod_ball != nullptr ? *lod_ball : scene.getBall(closest);
+
+    Vec3 point = closest_distance*(ray.getDir()) + ray.getPos();
+    Vec3 normal = ball.getNormal(point);
+    Vec3 mirrored = ball.getMirrored(ray.getDir(), point);
+
+    float specular = 0.0f;
+    float diffuce = 0.0f;
+    const Light *lights = scene.getLights().data();
+    staticFor<Lights>([&](auto i) {
+        const Light &light = lights[i];
+        if constexpr ((Features & SHADE_SHADOWS) != 0) {
+            if(inShadow(scene, i, point, ball, settings, Primary)) return;
+        }
+        Vec3 light_dir = light.getPos() - point;
+        light_dir.normalize();
+        diffuce = normal.dotProduct(light_dir);
+        if constexpr ((Features & SHADE_SPECULAR) != 0) {
+            specular = mirrored.dotProduct(light_dir);
+        }
+    });
+
+    const Vec3 ball_color = 0.25f*(ball.getMaterial().getColor());
+    Vec3 pixel = ball_color + ball_color*fmax(diffuce,0.0f);
+    if constexpr ((Features & SHADE_SPECULAR) != 0) {
+        pixel = pixel + ball_color*fmax(ipow<15>(specular), 0.0f);
+    }
+
+    if constexpr (Bounces > 0) {
+        Ray new_ray = Ray(point, mirrored);
+        pixel = 0.3f*pixel + 0.6f*traceStatic<Bounces - 1, Lights, Features, false>(new_ray, scene, settings);
+    }
+    return pixel;
+}
+
+// Traces a primary ray. If hit_ball is given, it receives the index of the ball hit first.
+typedef const Vec3 (*TraceFn)(const Ray &ray, const Scene &scene, const RenderSettings &settings, int *hit_ball);
+
+template<int Bounces, int Lights, unsigned Features>
+const Vec3 traceStaticEntry(const Ray &ray, const Scene &scene, const RenderSettings &settings, int *hit_ball) {
+    return traceStatic<Bounces, Lights, Features>(ray, scene, settings, hit_ball);
+}
+
+inline const Vec3 traceGeneric(const Ray &ray, const Scene &scene, const RenderSettings &settings, int *hit_ball) {
+    return trace(ray, scene, 0, settings, hit_ball);
+}
+
+// Configurations that get a specialised pipeline. Anything else uses traceGeneric().
+constexpr int STATIC_BOUNCES[] = {0, 1, 2, 3, 5, 10};
+constexpr int STATIC_BOUNCE_COUNT = sizeof(STATIC_BOUNCES) / sizeof(STATIC_BOUNCES[0]);
+constexpr int STATIC_MAX_LIGHTS = 4;
+constexpr int STATIC_FEATURE_COUNT = SHADE_ALL + 1;
+
+template<size_t I>
+constexpr TraceFn makeTraceEntry() {
+    constexpr int bounces = STATIC_BOUNCES[I / (STATIC_MAX_LIGHTS * STATIC_FEATURE_COUNT)];
+    constexpr int lights = (I / STATIC_FEATURE_COUNT) % STATIC_MAX_LIGHTS + 1;
+    constexpr unsigned features = I % STATIC_FEATURE_COUNT;
+    return &traceStaticEntry<bounces, lights, features>;
+}
+
+template<size_t... I>
+constexpr std::array<TraceFn, sizeof...(I)> makeTraceTable(std::index_sequence<I...>) {
+    return {{ makeTraceEntry<I>()... }};
+}
+
+const std::array<TraceFn, STATIC_BOUNCE_COUNT * STATIC_MAX_LIGHTS * STATIC_FEATURE_COUNT> trace_table =
+    makeTraceTable(std::make_index_sequence<STATIC_BOUNCE_COUNT * STATIC_MAX_LIGHTS * STATIC_FEATURE_COUNT>());
+
+// Picks the specialised pipeline matching the scene and settings
+inline TraceFn selectTrace(const Scene &scene, const RenderSettings &settings) {
+    int lights = scene.getLights().size();
+    if(lights < 1 || lights > STATIC_MAX_LIGHTS || settings.features > SHADE_ALL)
+        return traceGeneric;
+
+    for(int i = 0; i < STATIC_BOUNCE_COUNT; i++) {
+        if(STATIC_BOUNCES[i] == settings.max_bounces) {
+            int index = (i * STATIC_MAX_LIGHTS + (lights - 1)) * STATIC_FEATURE_COUNT + settings.features;
+            return trace_table[index];
+        }
+    }
+    return traceGeneric;
+}
+
+inline uint32_t packColor(const Vec3 &c) {
+    return (uint8_t)(c.x*255.0f) << 16 | (uint8_t)(c.y*255.0f) << 8 | (uint8_t)(c.z*255.0f);
+}
+
+// Bump allocator for per-frame scratch memory. Everything allocated
+// during a frame is released at once by reset().
+class FrameArena {
+private:
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<size_t> block_sizes;
+    size_t offset;
+    size_t total;
+public:
+    FrameArena() : offset(0), total(0) {}
+
+    template<typename T>
+    T *allocate(size_t count) {
+        size_t bytes = (count*sizeof(T) + 63) & ~(size_t)63;
+        if(blocks.empty() || offset + bytes > block_sizes.back()) {
+            size_t size = std::max(bytes, (size_t)1 << 20);
+            blocks.emplace_back(new char[size + 64]);
+            block_sizes.push_back(size);
+            offset = 0;
+        }
+        uintptr_t base = ((uintptr_t)blocks.back().get() + 63) & ~(uintptr_t)63;
+        T *ptr = (T*)(base + offset);
+        offset += bytes;
+        total += bytes;
+        return ptr;
+    }
+    void reset() {
+        // Merge the blocks so that the next frame fits in one
+        if(blocks.size() > 1) {
+            size_t size = total;
+            blocks.clear();
+            block_sizes.clear();
+            blocks.emplace_back(new char[size + 64]);
+            block_sizes.push_back(size);
+        }
+        offset = 0;
+        total = 0;
+    }
+};
+
+// Structure of arrays ray buffer for the wavefront renderer
+struct RayQueue {
+    float *ox, *oy, *oz;
+    float *dx, *dy, *dz;
+    int *parent;    // Pixel for primary rays, index in the previous queue otherwise
+    int count;
+
+    void allocate(FrameArena &arena, int n) {
+        ox = arena.allocate<float>(n); oy = arena.allocate<float>(n); oz = arena.allocate<float>(n);
+        dx = arena.allocate<float>(n); dy = arena.allocate<float>(n); dz = arena.allocate<float>(n);
+        parent = arena.allocate<int>(n);
+        count = n;
+    }
+    void set(int i, const Vec3 &pos, const Vec3 &dir, int p) {
+        ox[i] = pos.x; oy[i] = pos.y; oz[i] = pos.z;
+        dx[i] = dir.x; dy[i] = dir.y; dz[i] = dir.z;
+        parent[i] = p;
+    }
+    Ray get(int i) const {
+        return Ray(Vec3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i]));
+    }
+};
+
+enum WavefrontStage {
+    STAGE_GENERATE,
+    STAGE_EXTEND,
+    STAGE_SHADOW,
+    STAGE_SHADE,
+    STAGE_REFLECT,
+    STAGE_SORT,
+    STAGE_COUNT
+};
+
+const char *const stage_names[STAGE_COUNT] = {"generate", "extend", "shadow", "shade", "reflect", "sort"};
+
+// Spreads the low 10 bits of v so that there are 5 zero bits between each
+inline uint64_t spreadBits6(uint32_t v) {
+    uint64_t spread = 0;
+    for(int i = 0; i < 10; i++) {
+        spread |= (uint64_t)((v >> i) & 1) << (i*6);
+    }
+    return spread;
+}
+
+inline uint32_t quantize10(float value, float min, float scale) {
+    float q = (value - min)*scale;
+    return (uint32_t)std::min(std::max(q, 0.0f), 1023.0f);
+}
+
+// Sort key that groups rays going the same way from nearby origins:
+// direction octant on top, then a 6D Morton code of origin and direction.
+inline uint64_t coherenceKey(const Vec3 &pos, const Vec3 &dir, const Vec3 &min, const Vec3 &scale) {
+    uint64_t octant = (dir.x < 0 ? 4 : 0) | (dir.y < 0 ? 2 : 0) | (dir.z < 0 ? 1 : 0);
+    uint64_t morton =
+        spreadBits6(quantize10(pos.x, min.x, scale.x)) << 5 |
+        spreadBits6(quantize10(pos.y, min.y, scale.y)) << 4 |
+        spreadBits6(quantize10(pos.z, min.z, scale.z)) << 3 |
+        spreadBits6(quantize10(dir.x, -1.0f, 511.5f)) << 2 |
+        spreadBits6(quantize10(dir.y, -1.0f, 511.5f)) << 1 |
+        spreadBits6(quantize10(dir.z, -1.0f, 511.5f));
+    return octant << 60 | morton;
+}
+
+// Renders a frame one stage at a time over whole ray queues instead of
+// tracing every pixel recursively. Produces the same image as trace().
+class WavefrontRenderer {
+private:
+    FrameArena arena;
+    double stage_time[STAGE_COUNT];
+    int frames;
+    int sort_batch;
+
+    // Per bounce depth buffers, kept until the colours are composed
+    struct Level {
+        RayQueue rays;
+        int *ball;      // Closest ball, -1 on miss
+        float *distance;
+        int *child;     // Reflected ray in the next level, -1 if none
+        Vec3 *color;
+    };
+
+    double stageBegin() {
+        return getSeconds();
+    }
+    void stageEnd(WavefrontStage stage, double begin) {
+        stage_time[stage] += getSeconds() - begin;
+    }
+
+    void generate(RayQueue &queue, const Camera &camera, int w, int h) {
+        Vec3 cam_pos = camera.getPos();
+        float z, cosalpha, sinalpha;
+        cameraBasis(camera, h, z, cosalpha, sinalpha);
+
+        queue.allocate(arena, w*h);
+#pragma omp parallel for schedule(static)
+        for(int y = 0; y < h; y++) {
+            for(int x = 0; x < w; x++) {
+                int i = y*w + x;
+                queue.set(i, cam_pos, primaryRayDir(x, y, w, h, z, cosalpha, sinalpha), i);
+            }
+        }
+    }
+
+    // Reorders the queue by coherenceKey() within batches of sort_batch rays.
+    // The caller times it as STAGE_SORT, outside the other stages.
+    void sortQueue(RayQueue &queue) {
+        if(sort_batch <= 0 || queue.count < 2) return;
+
+        int n = queue.count;
+        std::pair<uint64_t, int> *keys = arena.allocate<std::pair<uint64_t, int>>(n);
+        RayQueue sorted;
+        sorted.allocate(arena, n);
+        int batches = (n + sort_batch - 1) / sort_batch;
+
+#pragma omp parallel for schedule(dynamic)
+        for(int batch = 0; batch < batches; batch++) {
+            int first = batch*sort_batch;
+            int last = std::min(first + sort_batch, n);
+
+            Vec3 min = Vec3(INFINITY);
+            Vec3 max = Vec3(-INFINITY);
+            for(int i = first; i < last; i++) {
+                min = Vec3(fminf(min.x, queue.ox[i]), fminf(min.y, queue.oy[i]), fminf(min.z, queue.oz[i]));
+                max = Vec3(fmaxf(max.x, queue.ox[i]), fmaxf(max.y, queue.oy[i]), fmaxf(max.z, queue.oz[i]));
+            }
+            Vec3 extent = max - min;
+            Vec3 scale = Vec3(extent.x > 0 ? 1023.0f/extent.x : 0.0f,
+                              extent.y > 0 ? 1023.0f/extent.y : 0.0f,
+                              extent.z > 0 ? 1023.0f/extent.z : 0.0f);
+
+            for(int i = first; i < last; i++) {
+                Vec3 pos = Vec3(queue.ox[i], queue.oy[i], queue.oz[i]);
+                Vec3 dir = Vec3(queue.dx[i], queue.dy[i], queue.dz[i]);
+                keys[i] = std::make_pair(coherenceKey(pos, dir, min, scale), i);
+            }
+            std::sort(keys + first, keys + last);
+
+            for(int i = first; i < last; i++) {
+                int from = keys[i].second;
+                sorted.ox[i] = queue.ox[from]; sorted.oy[i] = queue.oy[from]; sorted.oz[i] = queue.oz[from];
+                sorted.dx[i] = queue.dx[from]; sorted.dy[i] = queue.dy[from]; sorted.dz[i] = queue.dz[from];
+                sorted.parent[i] = queue.parent[from];
+            }
+        }
+        queue = sorted;
+    }
+
+    void extend(Level &level, const Scene &scene, const RenderSettings &settings) {
+        const RayQueue &rays = level.rays;
+        level.ball = arena.allocate<int>(rays.count);
+        level.distance = arena.allocate<float>(rays.count);
+#pragma omp parallel for schedule(static)
+        for(int i = 0; i < rays.count; i++) {
+            level.ball[i] = closestBall(rays.get(i), scene, level.distance[i], settings.bvh, settings.instances);
+        }
+    }
+
+    // Shadow map lookup for every (hit point, light) pair. Returns one flag per pair.
+    uint8_t *shadowMapLookup(const Vec3 *points, int hit_count, const Scene &scene, const RenderSettings &settings) {
+        const auto& lights = scene.getLights();
+        int light_count = lights.size();
+        uint8_t *occluded = arena.allocate<uint8_t>(hit_count*light_count);
+#pragma omp parallel for schedule(static)
+        for(int h = 0; h < hit_count; h++) {
+            for(int l = 0; l < light_count; l++) {
+                occluded[h*light_count + l] = settings.shadow_maps->occluded(l, lights[l].getPos(), points[h]);
+            }
+        }
+        return occluded;
+    }
+
+    // A shadow ray for every (hit point, light) pair, the pair index as parent
+    RayQueue shadowRays(const Vec3 *points, int hit_count, const Scene &scene) {
+        const auto& lights = scene.getLights();
+        int light_count = lights.size();
+        RayQueue shadow_rays;
+        shadow_rays.allocate(arena, hit_count*light_count);
+#pragma omp parallel for schedule(static)
+        for(int h = 0; h < hit_count; h++) {
+            for(int l = 0; l < light_count; l++) {
+                Vec3 dir = lights[l].getPos() - points[h];
+                shadow_rays.set(h*light_count + l, points[h], dir, h*light_count + l);
+            }
+        }
+        return shadow_rays;
+    }
+
+    // Any hit test for every shadow ray. Returns one flag per (hit point, light) pair.
+    uint8_t *shadow(const RayQueue &shadow_rays, const Scene &scene, const RenderSettings &settings) {
+        const auto& balls = scene.getBalls();
+        int ball_count = balls.size();
+
+        uint8_t *occluded = arena.allocate<uint8_t>(shadow_rays.count);
+#pragma omp parallel for schedule(static)
+        for(int i = 0; i < shadow_rays.count; i++) {
+            Ray ray = shadow_rays.get(i);
+            uint8_t hit = 0;
+            if(settings.instances != nullptr && settings.instances->anyHit(ray))
+                hit = 1;
+            else if(settings.bvh != nullptr)
+                hit = settings.bvh->anyHit(ray);
+            else for(int b = 0; b < ball_count; b++) {
+                float distance;
+                if(balls[b].intersect(ray, distance)) {
+                    hit = 1;
+                    break;
+                }
+            }
+            occluded[shadow_rays.parent[i]] = hit;
+        }
+        return occluded;
+    }
+
+    void shade(Level &level, const Vec3 *points, const int *hits, int hit_count, const uint8_t *occluded, const Scene &scene, const RenderSettings &settings) {
+        const RayQueue &rays = level.rays;
+        const auto& lights = scene.getLights();
+        int light_count = lights.size();
+        level.color = arena.allocate<Vec3>(rays.count);
+
+        // Background for the rays that missed
+#pragma omp parallel for schedule(static)
+        for(int i = 0; i < rays.count; i++) {
+            if(level.ball[i] < 0)
+                level.color[i] = computeBackground(rays.get(i), scene);
+        }
+
+#pragma omp parallel for schedule(static)
+        for(int h = 0; h < hit_count; h++) {
+            int i = hits[h];
+            const Ball ball = scene.getBall(level.ball[i]);
+            Vec3 pos = points[h];
+            Vec3 normal = ball.getNormal(pos);
+            Vec3 mirrored = ball.getMirrored(Vec3(rays.dx[i], rays.dy[i], rays.dz[i]), pos);
+
+            float diffuce = 0.0f;
+            float specular = 0.0f;
+            for(int l = 0; l < light_count; l++) {
+                if(occluded != nullptr && occluded[h*light_count + l]) continue;
+                Vec3 light_dir = lights[l].getPos() - pos;
+                light_dir.normalize();
+                diffuce = normal.dotProduct(light_dir);
+                if(settings.features & SHADE_SPECULAR)
+                    specular = mirrored.dotProduct(light_dir);
+            }
+            const Vec3 ball_color = 0.25f*(ball.getMaterial().getColor());
+            level.color[i] = shadePhong(ball_color, diffuce, specular);
+        }
+    }
+
+    // Reflected rays of the hits into the next level, linked with linkChildren()
+    // once they are sorted
+    void reflect(Level &level, Level &next, const Vec3 *points, const int *hits, int hit_count, const Scene &scene) {
+        const RayQueue &rays = level.rays;
+        level.child = arena.allocate<int>(rays.count);
+        next.rays.allocate(arena, hit_count);
+#pragma omp parallel for schedule(static)
+        for(int i = 0; i < rays.count; i++) {
+            level.child[i] = -1;
+        }
+#pragma omp parallel for schedule(static)
+        for(int h = 0; h < hit_count; h++) {
+            int i = hits[h];
+            const Ball ball = scene.getBall(level.ball[i]);
+            Vec3 mirrored = ball.getMirrored(Vec3(rays.dx[i], rays.dy[i], rays.dz[i]), points[h]);
+            next.rays.set(h, points[h], mirrored, i);
+        }
+    }
+    void linkChildren(Level &level, const Level &next) {
+#pragma omp parallel for schedule(static)
+        for(int h = 0; h < next.rays.count; h++) {
+            level.child[next.rays.parent[h]] = h;
+        }
+    }
+
+public:
+    WavefrontRenderer() : sort_batch(0) {
+        resetStats();
+    }
+
+    // Batch size for sorting secondary and shadow rays, 0 keeps them in pixel order
+    void setSortBatch(int batch) {
+        sort_batch = batch;
+    }
+
+    // ball_ids, if given, receives the primary ball of every pixel
+    void render(const Scene &scene, const RenderSettings &settings, int w, int h, uint32_t *pixels, int *ball_ids = nullptr) {
+        arena.reset();
+        std::vector<Level> levels(settings.max_bounces + 1);
+
+        double begin = stageBegin();
+        generate(levels[0].rays, scene.getCamera(), w, h);
+        stageEnd(STAGE_GENERATE, begin);
+
+        int depth = 0;
+        for(; depth <= settings.max_bounces; depth++) {
+            Level &level = levels[depth];
+            const RayQueue &rays = level.rays;
+
+            begin = stageBegin();
+            extend(level, scene, settings);
+
+            // Compact the rays that hit something
+            int *hits = arena.allocate<int>(rays.count);
+            int hit_count = 0;
+            for(int i = 0; i < rays.count; i++) {
+                if(level.ball[i] >= 0)
+                    hits[hit_count++] = i;
+            }
+            Vec3 *points = arena.allocate<Vec3>(hit_count);
+#pragma omp parallel for schedule(static)
+            for(int j = 0; j < hit_count; j++) {
+                int i = hits[j];
+                points[j] = level.distance[i]*Vec3(rays.dx[i], rays.dy[i], rays.dz[i]) + Vec3(rays.ox[i], rays.oy[i], rays.oz[i]);
+            }
+            stageEnd(STAGE_EXTEND, begin);
+
+            // The sort of the shadow rays is timed apart, so no time counts twice
+            uint8_t *occluded = nullptr;
+            if((settings.features & SHADE_SHADOWS) && settings.shadow_maps != nullptr) {
+                begin = stageBegin();
+                occluded = shadowMapLookup(points, hit_count, scene, settings);
+                stageEnd(STAGE_SHADOW, begin);
+            } else if(settings.features & SHADE_SHADOWS) {
+                begin = stageBegin();
+                RayQueue shadow_rays = shadowRays(points, hit_count, scene);
+                stageEnd(STAGE_SHADOW, begin);
+                begin = stageBegin();
+                sortQueue(shadow_rays);
+                stageEnd(STAGE_SORT, begin);
+                begin = stageBegin();
+                occluded = shadow(shadow_rays, scene, settings);
+                stageEnd(STAGE_SHADOW, begin);
+            }
+
+            begin = stageBegin();
+            shade(level, points, hits, hit_count, occluded, scene, settings);
+            stageEnd(STAGE_SHADE, begin);
+
+            level.child = nullptr;
+            if(depth == settings.max_bounces || hit_count == 0)
+                break;
+
+            begin = stageBegin();
+            reflect(level, levels[depth + 1], points, hits, hit_count, scene);
+            stageEnd(STAGE_REFLECT, begin);
+            begin = stageBegin();
+            sortQueue(levels[depth + 1].rays);
+            stageEnd(STAGE_SORT, begin);
+            begin = stageBegin();
+            linkChildren(level, levels[depth + 1]);
+            stageEnd(STAGE_REFLECT, begin);
+        }
+
+        // Compose the bounces back to front like the recursion in trace() does
+        begin = stageBegin();
+        for(int d = std::min(depth, settings.max_bounces) - 1; d >= 0; d--) {
+            Level &level = levels[d];
+            const Vec3 *next_color = levels[d + 1].color;
+#pragma omp parallel for schedule(static)
+            for(int i = 0; i < level.rays.count; i++) {
+                int child = level.child[i];
+                if(child >= 0)
+                    level.color[i] = 0.3f*level.color[i] + 0.6f*next_color[child];
+            }
+        }
+
+        const Level &primary = levels[0];
+#pragma omp parallel for schedule(static)
+        for(int i = 0; i < primary.rays.count; i++) {
+            pixels[primary.rays.parent[i]] = packColor(primary.color[i]);
+            if(ball_ids != nullptr)
+                ball_ids[primary.rays.parent[i]] = primary.ball[i];
+        }
+        stageEnd(STAGE_SHADE, begin);
+        frames++;
+    }
+
+    // Average time of a stage per frame in milliseconds
+    double getStageTime(WavefrontStage stage) const {
+        return frames > 0 ? stage_time[stage]*1000.0/frames : 0.0;
+    }
+
+    void printStats() const {
+        if(frames == 0) return;
+        std::cout << "Stages (ms/frame):";
+        for(int i = 0; i < STAGE_COUNT; i++) {
+            std::cout << " " << stage_names[i] << " " << stage_time[i]*1000.0/frames;
+        }
+        std::cout << std::endl;
+    }
+    void resetStats() {
+        for(int i = 0; i < STAGE_COUNT; i++) {
+            stage_time[i] = 0.0;
+        }
+        frames = 0;
+    }
+};
+
+struct AntiAliasSettings {
+    int samples = 4;            // Stratified samples for an edge pixel
+    float threshold = 0.1f;     // Colour difference that counts as an edge
+    float budget = 0.25f;       // Extra samples per frame as a fraction of the pixel count
+};
+
+// Adds stratified subpixel samples to pixels on silhouette and shadow
+// edges. Edges are found from the single sample frame by comparing the
+// primary ball index and colour of neighbouring pixels.
+class AdaptiveAntiAliaser {
+private:
+    AntiAliasSettings settings;
+    std::vector<std::pair<float, int>> edges;
+    long long frames;
+    long long pixels;
+    long long supersampled;
+    long long samples;
+
+    static float colorDifference(uint32_t a, uint32_t b) {
+        int dr = abs((int)((a >> 16) & 0xff) - (int)((b >> 16) & 0xff));
+        int dg = abs((int)((a >> 8) & 0xff) - (int)((b >> 8) & 0xff));
+        int db = abs((int)(a & 0xff) - (int)(b & 0xff));
+        return std::max(dr, std::max(dg, db))*(1.0f/255.0f);
+    }
+
+public:
+    AdaptiveAntiAliaser(const AntiAliasSettings &settings) : settings(settings) {
+        resetStats();
+    }
+
+    // Refines the single sample frame in pixels_out. ball_ids holds the primary ball of every pixel.
+    void apply(const Scene &scene, TraceFn trace_fn, const RenderSettings &render_settings, int w, int h, const int *ball_ids, uint32_t *pixels_out) {
+        const Camera &camera = scene.getCamera();
+        Vec3 cam_pos = camera.getPos();
+        float z, cosalpha, sinalpha;
+        cameraBasis(camera, h, z, cosalpha, sinalpha);
+
+        // Find edge pixels and how strong the edge is
+        edges.clear();
+        for(int y = 0; y < h; y++) {
+            for(int x = 0; x < w; x++) {
+                int i = y*w + x;
+                float contrast = 0.0f;
+                bool silhouette = false;
+                const int nx[4] = {x - 1, x + 1, x, x};
+                const int ny[4] = {y, y, y - 1, y + 1};
+                for(int n = 0; n < 4; n++) {
+                    if(nx[n] < 0 || nx[n] >= w || ny[n] < 0 || ny[n] >= h) continue;
+                    int j = ny[n]*w + nx[n];
+                    if(ball_ids[j] != ball_ids[i]) silhouette = true;
+                    contrast = std::max(contrast, colorDifference(pixels_out[i], pixels_out[j]));
+                }
+                if(silhouette || contrast > settings.threshold)
+                    edges.push_back(std::make_pair(silhouette ? 1.0f + contrast : contrast, i));
+            }
+        }
+
+        // Keep the strongest edges that fit into the sample budget
+        int samples_per_pixel = std::max(settings.samples, 1);
+        size_t max_pixels = (size_t)(settings.budget*w*h/samples_per_pixel);
+        if(edges.size() > max_pixels) {
+            std::nth_element(edges.begin(), edges.begin() + max_pixels, edges.end(),
+                [](const std::pair<float, int> &a, const std::pair<float, int> &b) { return a.first > b.first; });
+            edges.resize(max_pixels);
+        }
+
+        // Stratified jittered samples on a grid x grid layout
+        int grid = (int)ceilf(sqrtf((float)samples_per_pixel));
+        int edge_count = edges.size();
+        uint32_t frame_seed = hashRandom((uint32_t)frames);
+#pragma omp parallel for schedule(dynamic, 64)
+        for(int e = 0; e < edge_count; e++) {
+            int i = edges[e].second;
+            int x = i % w;
+            int y = i / w;
+            Vec3 sum = Vec3(0.0f);
+            for(int s = 0; s < samples_per_pixel; s++) {
+                uint32_t seed = hashRandom(frame_seed ^ (uint32_t)i*9781u ^ (uint32_t)s*6271u);
+                float jx = ((s % grid) + hashFloat(seed))/grid;
+                float jy = ((s / grid) + hashFloat(seed + 1))/grid;
+                Ray ray = Ray(cam_pos, primaryRayDir(x + jx, y + jy, w, h, z, cosalpha, sinalpha));
+                sum = sum + trace_fn(ray, scene, render_settings, nullptr);
+            }
+            pixels_out[i] = packColor((1.0f/samples_per_pixel)*sum);
+        }
+
+        frames++;
+        pixels += (long long)w*h;
+        supersampled += edge_count;
+        samples += (long long)edge_count*samples_per_pixel;
+    }
+
+    // Primary samples traced relative to a single sample frame
+    double getSampleRatio() const {
+        return pixels > 0 ? (double)(pixels + samples)/pixels : 1.0;
+    }
+    double getSupersampledFraction() const {
+        return pixels > 0 ? (double)supersampled/pixels : 0.0;
+    }
+
+    void printStats() const {
+        std::cout << "AA: " << getSupersampledFraction()*100.0 << "% pixels supersampled, "
+                  << getSampleRatio() << "x primary samples" << std::endl;
+    }
+    void resetStats() {
+        frames = 0;
+        pixels = 0;
+        supersampled = 0;
+        samples = 0;
+    }
+};
+
+// Averages jittered primary samples over frames while the scene stays unchanged
+class FrameAccumulator {
+private:
+    std::vector<Vec3> sum;
+    int count;
+    int max_samples;
+public:
+    FrameAccumulator(int max_samples) : count(0), max_samples(max_samples) {}
+
+    // Starts over from a freshly rendered frame
+    void reset(const uint32_t *pixels, int n) {
+        sum.resize(n);
+        for(int i = 0; i < n; i++) {
+            uint32_t c = pixels[i];
+            sum[i] = Vec3(((c >> 16) & 0xff)/255.0f, ((c >> 8) & 0xff)/255.0f, (c & 0xff)/255.0f);
+        }
+        count = 1;
+    }
+    bool converged() const {
+        return count >= max_samples;
+    }
+    int getSampleCount() const {
+        return count;
+    }
+
+    void addSample(const Scene &scene, TraceFn trace_fn, const RenderSettings &settings, int w, int h, uint32_t *pixels) {
+        const Camera &camera = scene.getCamera();
+        Vec3 cam_pos = camera.getPos();
+        float z, cosalpha, sinalpha;
+        cameraBasis(camera, h, z, cosalpha, sinalpha);
+        uint32_t frame_seed = hashRandom((uint32_t)count);
+        float scale = 1.0f/(count + 1);
+
+#pragma omp parallel for schedule(guided)
+        for(int y = 0; y < h; y++) {
+            for(int x = 0; x < w; x++) {
+                int i = y*w + x;
+                uint32_t seed = hashRandom(frame_seed ^ (uint32_t)i*9781u);
+                Ray ray = Ray(cam_pos, primaryRayDir(x + hashFloat(seed), y + hashFloat(seed + 1), w, h, z, cosalpha, sinalpha));
+                sum[i] = sum[i] + trace_fn(ray, scene, settings, nullptr);
+                pixels[i] = packColor(scale*sum[i]);
+            }
+        }
+        count++;
+    }
+};
+
+// Traces half of the pixels every frame in an alternating checkerboard.
+// The other half was traced in the previous frame and is reused when the
+// primary ball and depth seen there still agree with the traced
+// neighbours; otherwise it is interpolated from the neighbours.
+class CheckerboardRenderer {
+private:
+    std::vector<uint32_t> previous;
+    std::vector<int> ids, previous_ids;
+    std::vector<float> depths, previous_depths;
+    int parity;
+    bool has_previous;
+    uint64_t camera_version;
+    long long temporal;
+    long long spatial;
+
+public:
+    CheckerboardRenderer() : parity(0), has_previous(false), camera_version(0) {
+        resetStats();
+    }
+
+    // Drops the history, for example after a resize
+    void reset() {
+        has_previous = false;
+    }
+
+    void render(const std::vector<Ray> &rays, const Scene &scene, TraceFn trace_fn, const RenderSettings &settings, int w, int h, uint32_t *pixels, int *ball_ids = nullptr) {
+        int n = w*h;
+        ids.resize(n);
+        depths.resize(n);
+        if((int)previous.size() != n || scene.getCameraVersion() != camera_version)
+            has_previous = false;
+
+#pragma omp parallel for schedule(guided)
+        for(int y = 0; y < h; y++) {
+            for(int x = (y + parity) & 1; x < w; x += 2) {
+                int i = y*w + x;
+                pixels[i] = packColor(trace_fn(rays[i], scene, settings, &ids[i]));
+                depths[i] = 0.0f;
+                if(ids[i] >= 0)
+                    scene.getBall(ids[i]).intersect(rays[i], depths[i]);
+            }
+        }
+
+        long long frame_temporal = 0;
+        long long frame_spatial = 0;
+#pragma omp parallel for schedule(static) reduction(+:frame_temporal, frame_spatial)
+        for(int y = 0; y < h; y++) {
+            for(int x = (y + parity + 1) & 1; x < w; x += 2) {
+                int i = y*w + x;
+                const int nx[4] = {x - 1, x + 1, x, x};
+                const int ny[4] = {y, y, y - 1, y + 1};
+                int neighbours[4];
+                int count = 0;
+                for(int k = 0; k < 4; k++) {
+                    if(nx[k] >= 0 && nx[k] < w && ny[k] >= 0 && ny[k] < h)
+                        neighbours[count++] = ny[k]*w + nx[k];
+                }
+                // A one pixel wide image has nothing to reconstruct from
+                if(count == 0) {
+                    pixels[i] = packColor(trace_fn(rays[i], scene, settings, &ids[i]));
+                    depths[i] = 0.0f;
+                    if(ids[i] >= 0)
+                        scene.getBall(ids[i]).intersect(rays[i], depths[i]);
+                    continue;
+                }
+
+                // Reuse the last traced value if the traced neighbours still see the same
+                // ball at a similar depth
+                if(has_previous) {
+                    int id = previous_ids[i];
+                    float depth = previous_depths[i];
+                    int agree = 0;
+                    for(int k = 0; k < count; k++) {
+                        int j = neighbours[k];
+                        if(ids[j] == id && (id < 0 || fabsf(depths[j] - depth) <= 0.05f*depth))
+                            agree++;
+                    }
+                    if(agree*2 >= count) {
+                        pixels[i] = previous[i];
+                        ids[i] = id;
+                        depths[i] = depth;
+                        frame_temporal++;
+                        continue;
+                    }
+                }
+
+                // Average the neighbours that see the most common ball
+                int id = ids[neighbours[0]];
+                int best = 0;
+                for(int k = 0; k < count; k++) {
+                    int votes = 0;
+                    for(int m = 0; m < count; m++) {
+                        if(ids[neighbours[m]] == ids[neighbours[k]]) votes++;
+                    }
+                    if(votes > best) {
+                        best = votes;
+                        id = ids[neighbours[k]];
+                    }
+                }
+                int sum[3] = {0, 0, 0};
+                float depth = 0.0f;
+                for(int k = 0; k < count; k++) {
+                    int j = neighbours[k];
+                    if(ids[j] != id) continue;
+                    sum[0] += (pixels[j] >> 16) & 0xff;
+                    sum[1] += (pixels[j] >> 8) & 0xff;
+                    sum[2] += pixels[j] & 0xff;
+                    depth += depths[j];
+                }
+                pixels[i] = (uint32_t)(sum[0]/best) << 16 | (uint32_t)(sum[1]/best) << 8 | (uint32_t)(sum[2]/best);
+                ids[i] = id;
+                depths[i] = depth/best;
+                frame_spatial++;
+            }
+        }
+        temporal += frame_temporal;
+        spatial += frame_spatial;
+
+        if(ball_ids != nullptr)
+            std::copy(ids.begin(), ids.end(), ball_ids);
+        previous.assign(pixels, pixels + n);
+        previous_ids.swap(ids);
+        previous_depths.swap(depths);
+        camera_version = scene.getCameraVersion();
+        has_previous = true;
+        parity ^= 1;
+    }
+
+    // Share of the reconstructed pixels that were reused from the previous frame
+    double getTemporalFraction() const {
+        return temporal + spatial > 0 ? (double)temporal/(temporal + spatial) : 0.0;
+    }
+    void printStats() const {
+        std::cout << "Checkerboard: " << getTemporalFraction()*100.0 << "% of missing pixels reused" << std::endl;
+    }
+    void resetStats() {
+        temporal = 0;
+        spatial = 0;
+    }
+};
+
+enum DeadlineOrder {
+    DEADLINE_CENTER,    // Tiles near the image centre first
+    DEADLINE_CHANGED    // Tiles that changed most when last traced first
+};
+
+// Renders the tiles of a frame in priority order until a time budget runs
+// out. Tiles that are already up to date for the scene are skipped, and
+// tiles left over keep the previous frame, or a coarse pass of one ray per
+// 4x4 pixels when the previous frame is from another camera. Tiles wait
+// longer the further they are from the front, so each gets its turn.
+class DeadlineRenderer {
+private:
+    int tile_size;
+    DeadlineOrder order;
+    std::vector<uint32_t> previous;
+    std::vector<uint64_t> tile_versions;    // Scene version every tile was last traced for
+    std::vector<int> ages;                  // Frames since every tile was last traced
+    std::vector<float> changes;             // Mean channel change of every tile when last traced
+    std::vector<std::pair<float, int>> queue;
+    bool has_previous;
+    uint64_t camera_version;
+    long long frames, tiles_done, tiles_total, late_frames;
+    double min_done;
+
+    float priority(int t, int tiles_x, int tiles_y) const {
+        if(order == DEADLINE_CHANGED)
+            return std::min(changes[t]/32.0f, 1.0f);
+        float dx = (t % tiles_x + 0.5f)/tiles_x - 0.5f;
+        float dy = (t / tiles_x + 0.5f)/tiles_y - 0.5f;
+        return 1.0f - sqrtf(2.0f*(dx*dx + dy*dy));
+    }
+
+public:
+    DeadlineRenderer(int tile_size = 16, DeadlineOrder order = DEADLINE_CENTER) :
+        tile_size(tile_size), order(order), has_previous(false), camera_version(0) {
+        resetStats();
+    }
+
+    // Renders until budget seconds have passed since the call, returns true
+    // when every tile is up to date
+    bool render(const std::vector<Ray> &rays, const Scene &scene, TraceFn trace_fn, const RenderSettings &settings, int w, int h, uint32_t *pixels, double budget) {
+        double deadline = getSeconds() + budget;
+        int n = w*h;
+        int tiles_x = (w + tile_size - 1) / tile_size;
+        int tiles_y = (h + tile_size - 1) / tile_size;
+        int tiles = tiles_x*tiles_y;
+        if((int)previous.size() != n || (int)tile_versions.size() != tiles || scene.getCameraVersion() != camera_version) {
+            has_previous = false;
+            tile_versions.assign(tiles, -1);
+            ages.assign(tiles, 0);
+            changes.assign(tiles, 0.0f);
+        }
+
+        // Something to show for the tiles that do not make it
+        if(has_previous) {
+            std::copy(previous.begin(), previous.end(), pixels);
+        } else {
+#pragma omp parallel for schedule(guided)
+            for(int y = 0; y < h; y += 4) {
+                for(int x = 0; x < w; x += 4) {
+                    int cx = std::min(x + 2, w - 1);
+                    int cy = std::min(y + 2, h - 1);
+                    uint32_t color = packColor(trace_fn(rays[cy*w + cx], scene, settings, nullptr));
+                    for(int by = y; by < std::min(y + 4, h); by++) {
+                        std::fill(pixels + by*w + x, pixels + by*w + std::min(x + 4, w), color);
+                    }
+                }
+            }
+        }
+
+        // Out of date tiles, the longest waiting and most important first
+        queue.clear();
+        for(int t = 0; t < tiles; t++) {
+            if(tile_versions[t] != scene.getVersion())
+                queue.push_back({-(ages[t]*0.25f + priority(t, tiles_x, tiles_y)), t});
+        }
+        std::sort(queue.begin(), queue.end());
+
+        int done = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:done)
+        for(int q = 0; q < (int)queue.size(); q++) {
+            if(getSeconds() >= deadline)
+                continue;
+            int t = queue[q].second;
+            int x0 = (t % tiles_x)*tile_size;
+            int y0 = (t / tiles_x)*tile_size;
+            long long change = 0;
+            for(int y = y0; y < std::min(y0 + tile_size, h); y++) {
+                for(int x = x0; x < std::min(x0 + tile_size, w); x++) {
+                    int i = y*w + x;
+                    uint32_t color = packColor(trace_fn(rays[i], scene, settings, nullptr));
+                    for(int shift = 0; shift <= 16; shift += 8) {
+                        change += abs((int)((color >> shift) & 0xff) - (int)((pixels[i] >> shift) & 0xff));
+                    }
+                    pixels[i] = color;
+                }
+            }
+            int count = (std::min(x0 + tile_size, w) - x0)*(std::min(y0 + tile_size, h) - y0);
+            changes[t] = (float)change/(3*count);
+            tile_versions[t] = scene.getVersion();
+            ages[t] = -1;
+            done++;
+        }
+        for(int t = 0; t < tiles; t++) {
+            ages[t]++;
+        }
+
+        previous.assign(pixels, pixels + n);
+        camera_version = scene.getCameraVersion();
+        has_previous = true;
+
+        // Tiles already up to date count as done
+        double fraction = queue.empty() ? 1.0 : (double)(tiles - (int)queue.size() + done)/tiles;
+        frames++;
+        tiles_done += tiles - queue.size() + done;
+        tiles_total += tiles;
+        min_done = std::min(min_done, fraction);
+        if(done < (int)queue.size())
+            late_frames++;
+        return done == (int)queue.size();
+    }
+
+    // Drops the history, for example after a resize
+    void reset() {
+        has_previous = false;
+        previous.clear();
+        tile_versions.clear();
+    }
+
+    double getCompletedFraction() const {
+        return tiles_total > 0 ? (double)tiles_done/tiles_total : 1.0;
+    }
+    void printStats() const {
+        std::cout << "Deadline: " << getCompletedFraction()*100.0 << "% of tiles per frame (min " << min_done*100.0 << "%), "
+                  << late_frames << "/" << frames << " frames out of time" << std::endl;
+    }
+    void resetStats() {
+        frames = 0;
+        tiles_done = 0;
+        tiles_total = 0;
+        late_frames = 0;
+        min_done = 1.0;
+    }
+};
+
+// Shading of a primary hit when the light that lights it is already known,
+// as trace() does it, with the bounces traced by trace()
+inline Vec3 shadePrimary(const Ray &ray, const Scene &scene, const RenderSettings &settings, const Ball &ball, const Vec3 &point, int light) {
+    Vec3 normal = ball.getNormal(point);
+    Vec3 mirrored = ball.getMirrored(ray.getDir(), point);
+    float diffuce = 0.0f;
+    float specular = 0.0f;
+    if(light >= 0) {
+        Vec3 light_dir = scene.getLights()[light].getPos() - point;
+        light_dir.normalize();
+        diffuce = normal.dotProduct(light_dir);
+        if(settings.features & SHADE_SPECULAR)
+            specular = mirrored.dotProduct(light_dir);
+    }
+    const Vec3 ball_color = 0.25f*(ball.getMaterial().getColor());
+    Vec3 pixel = shadePhong(ball_color, diffuce, specular);
+    if(settings.max_bounces > 0) {
+        Ray new_ray = Ray(point, mirrored);
+        pixel = 0.3f*pixel + 0.6f*trace(new_ray, scene, 1, settings);
+    }
+    return pixel;
+}
+
+// Keeps the world position, ball and lighting light of every pixel hit.
+// When only the camera moved, the hits of the previous frame are projected
+// into the new view. A pixel that sees the same ball at about the same
+// depth as the hit projected onto it reuses its light instead of tracing
+// shadow rays. Hits at the edge of a shadow or a ball are not reused.
+// Specular light and bounces depend on the view and are always computed.
+class ReprojectionCache {
+private:
+    struct Hit {
+        Vec3 pos;
+        int ball;
+        int light;
+        bool edge;
+    };
+    struct Projected {
+        float depth;
+        int ball;
+        int light;
+    };
+    std::vector<Hit> hits, previous;
+    std::vector<Projected> projected;
+    bool has_previous;
+    int previous_w, previous_h;
+    uint64_t balls_version, lights_version;
+    unsigned features;
+    float tolerance;
+    long long frames, reused, lit;
+    double last_ratio;
+
+    // Scatters the previous hits to the pixels of the new camera, nearest first
+    void project(const Scene &scene, int w, int h) {
+        const Camera &camera = scene.getCamera();
+        const Vec3 cam_pos = camera.getPos();
+        float z, cosalpha, sinalpha;
+        cameraBasis(camera, h, z, cosalpha, sinalpha);
+        projected.assign(w*h, {INFINITY, -1, -1});
+        for(const Hit &hit : previous) {
+            if(hit.ball < 0 || hit.edge) continue;
+            Vec3 d = hit.pos - cam_pos;
+            float cx = d.x*cosalpha - d.z*sinalpha;
+            float cz = d.x*sinalpha + d.z*cosalpha;
+            if(cz <= 0.0f) continue;
+            int x = (int)floorf(w*0.5f + z*cx/cz);
+            int y = (int)floorf(h*0.5f - z*d.y/cz);
+            if(x < 0 || x >= w || y < 0 || y >= h) continue;
+            Projected &p = projected[y*w + x];
+            float depth = d.getLength();
+            if(depth < p.depth)
+                p = {depth, hit.ball, hit.light};
+        }
+    }
+
+public:
+    ReprojectionCache(float tolerance = 0.01f) : has_previous(false), previous_w(0), previous_h(0), balls_version(0),
+        lights_version(0), features(0), tolerance(tolerance) {
+        resetStats();
+    }
+
+    void render(const std::vector<Ray> &rays, const Scene &scene, const RenderSettings &settings, int w, int h, uint32_t *pixels, int *ball_ids = nullptr) {
+        int n = w*h;
+        bool reuse = has_previous && previous_w == w && previous_h == h && scene.getBallsVersion() == balls_version
+                     && scene.getLightsVersion() == lights_version && settings.features == features && settings.shadow_maps == nullptr;
+        if(reuse)
+            project(scene, w, h);
+        hits.resize(n);
+
+        long long frame_reused = 0;
+        long long frame_lit = 0;
+#pragma omp parallel for schedule(guided) reduction(+:frame_reused, frame_lit)
+        for(int y = 0; y < h; y++) {
+            for(int x = 0; x < w; x++) {
+                int i = y*w + x;
+                const Ray &ray = rays[i];
+                if(settings.counters != nullptr)
+                    settings.counters->local().primary++;
+                float distance;
+                int closest = closestBall(ray, scene, distance, settings.bvh, settings.instances);
+                if(ball_ids != nullptr)
+                    ball_ids[i] = closest;
+                if(closest < 0) {
+                    hits[i] = {Vec3(), -1, -1, false};
+                    pixels[i] = packColor(computeBackground(ray, scene));
+                    continue;
+                }
+                const Ball ball = scene.getBall(closest);
+                Vec3 point = distance*(ray.getDir()) + ray.getPos();
+
+                // The last light not in shadow lights the point, like in computeBrightness()
+                int light = -1;
+                if(reuse && projected[i].ball == closest && fabsf(projected[i].depth - distance) <= tolerance*distance) {
+                    light = projected[i].light;
+                    frame_reused++;
+                } else if(settings.features & SHADE_SHADOWS) {
+                    for(int l = (int)scene.getLights().size() - 1; l >= 0 && light < 0; l--) {
+                        if(!inShadow(scene, l, point, ball, settings, true))
+                            light = l;
+                    }
+                } else {
+                    light = (int)scene.getLights().size() - 1;
+                }
+                frame_lit++;
+                hits[i] = {point, closest, light, false};
+                pixels[i] = packColor(shadePrimary(ray, scene, settings, ball, point, light));
+            }
+        }
+
+        // Mark the hits next to another ball or light, they are not reused
+#pragma omp parallel for schedule(static)
+        for(int y = 0; y < h; y++) {
+            for(int x = 0; x < w; x++) {
+                Hit &hit = hits[y*w + x];
+                const int nx[4] = {x - 1, x + 1, x, x};
+                const int ny[4] = {y, y, y - 1, y + 1};
+                for(int k = 0; k < 4; k++) {
+                    if(nx[k] < 0 || nx[k] >= w || ny[k] < 0 || ny[k] >= h) continue;
+                    const Hit &other = hits[ny[k]*w + nx[k]];
+                    if(other.ball != hit.ball || other.light != hit.light)
+                        hit.edge = true;
+                }
+            }
+        }
+
+        previous.swap(hits);
+        previous_w = w;
+        previous_h = h;
+        balls_version = scene.getBallsVersion();
+        lights_version = scene.getLightsVersion();
+        features = settings.features;
+        has_previous = settings.shadow_maps == nullptr;
+
+        frames++;
+        reused += frame_reused;
+        lit += frame_lit;
+        last_ratio = frame_lit > 0 ? (double)frame_reused/frame_lit : 0.0;
+    }
+
+    // Drops the history, for example after a resize
+    void reset() {
+        has_previous = false;
+    }
+
+    // Share of the lit pixels of the last frame that reused their light
+    double getReuseRatio() const {
+        return last_ratio;
+    }
+    double getAverageReuseRatio() const {
+        return lit > 0 ? (double)reused/lit : 0.0;
+    }
+    void printStats() const {
+        std::cout << "Reprojection: " << getAverageReuseRatio()*100.0 << "% of lit pixels reused over " << frames
+                  << " frames, last frame " << last_ratio*100.0 << "%" << std::endl;
+    }
+    void resetStats() {
+        frames = 0;
+        reused = 0;
+        lit = 0;
+        last_ratio = 0.0;
+    }
+};
+
+// Out-of-core sphere storage. The spheres are split into the cells of a
+// uniform grid and written to a file chunk by chunk, so a renderer only
+// has to keep the chunks its rays currently reach in memory.
+struct ChunkFileHeader {
+    char magic[4];          // "RAYC"
+    uint32_t version;
+    uint32_t chunk_count;
+    uint32_t reserved;
+    uint64_t sphere_count;
+};
+
+struct ChunkInfo {
+    float min[3], max[3];   // Bounds of the spheres, not of the grid cell
+    uint64_t offset;        // File offset of the first ChunkSphere
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct ChunkSphere {
+    SphereRecord sphere;
+    float r, g, b;
+};
+
+// Writes source(0) ... source(count - 1) into grid^3 chunks between min and max.
+// The source is read twice, first to size the chunks and then to fill them,
+// so the balls never need to be in memory at the same time.
+template<typename Source>
+bool writeChunkFile(const std::string &path, uint64_t count, Source source, const Vec3 &min, const Vec3 &max, int grid) {
+    int cells = grid*grid*grid;
+    auto cellOf = [&](const Vec3 &p) {
+        const float v[3] = {(p.x - min.x)/(max.x - min.x), (p.y - min.y)/(max.y - min.y), (p.z - min.z)/(max.z - min.z)};
+        int c[3];
+        for(int a = 0; a < 3; a++) {
+            c[a] = std::min(grid - 1, std::max(0, (int)(v[a]*grid)));
+        }
+        return (c[2]*grid + c[1])*grid + c[0];
+    };
+
+    // First pass: sphere count and bounds of every cell
+    std::vector<ChunkInfo> cell_info(cells);
+    for(ChunkInfo &info : cell_info) {
+        info = {{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}, 0, 0, 0};
+    }
+    for(uint64_t i = 0; i < count; i++) {
+        Ball ball = source(i);
+        const Vec3 &p = ball.getPos();
+        float r = ball.getRadius();
+        const float c[3] = {p.x, p.y, p.z};
+        ChunkInfo &info = cell_info[cellOf(p)];
+        for(int a = 0; a < 3; a++) {
+            info.min[a] = fminf(info.min[a], c[a] - r);
+            info.max[a] = fmaxf(info.max[a], c[a] + r);
+        }
+        info.count++;
+    }
+
+    // Empty cells get no chunk
+    std::vector<int> chunk_of_cell(cells, -1);
+    std::vector<ChunkInfo> chunks;
+    uint64_t offset = sizeof(ChunkFileHeader);
+    for(int c = 0; c < cells; c++) {
+        if(cell_info[c].count == 0) continue;
+        chunk_of_cell[c] = chunks.size();
+        chunks.push_back(cell_info[c]);
+        offset += sizeof(ChunkInfo);
+    }
+    for(ChunkInfo &info : chunks) {
+        info.offset = offset;
+        offset += info.count*sizeof(ChunkSphere);
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if(!file) return false;
+    ChunkFileHeader header = {{'R', 'A', 'Y', 'C'}, 1, (uint32_t)chunks.size(), 0, count};
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)chunks.data(), chunks.size()*sizeof(ChunkInfo));
+
+    // Second pass: buffer the spheres per chunk and write them out in blocks
+    const size_t BLOCK = 256;
+    std::vector<std::vector<ChunkSphere>> buffers(chunks.size());
+    std::vector<uint64_t> written(chunks.size(), 0);
+    auto flush = [&](int c) {
+        file.seekp(chunks[c].offset + written[c]*sizeof(ChunkSphere));
+        file.write((const char*)buffers[c].data(), buffers[c].size()*sizeof(ChunkSphere));
+        written[c] += buffers[c].size();
+        buffers[c].clear();
+    };
+    for(uint64_t i = 0; i < count; i++) {
+        Ball ball = source(i);
+        const Vec3 &p = ball.getPos();
+        const Vec3 &color = ball.getMaterial().getColor();
+        int c = chunk_of_cell[cellOf(p)];
+        buffers[c].push_back({{p.x, p.y, p.z, ball.getRadius()}, color.x, color.y, color.z});
+        if(buffers[c].size() == BLOCK)
+            flush(c);
+    }
+    for(int c = 0; c < (int)chunks.size(); c++) {
+        if(!buffers[c].empty())
+            flush(c);
+    }
+    return file.good();
+}
+
+// Reads the chunks of a chunk file on demand and keeps the least recently
+// used ones resident up to a byte budget. A chunk larger than the budget
+// is still loaded, after everything else has been evicted.
+class ChunkStore {
+public:
+    struct Chunk {
+        std::vector<Ball> balls;
+        SphereBVH bvh;
+        size_t bytes;
+        std::list<int>::iterator lru;
+    };
+
+private:
+    // Binary tree over the chunk bounds, leaves have chunk >= 0
+    struct TreeNode {
+        float min[3], max[3];
+        int left, right;
+        int chunk;
+    };
+
+    std::ifstream file;
+    std::vector<ChunkInfo> chunks;
+    std::vector<TreeNode> tree;
+    std::vector<std::unique_ptr<Chunk>> resident;
+    std::list<int> lru;         // Most recently used first
+    uint64_t sphere_count;
+    size_t budget;
+    size_t resident_bytes;
+    uint64_t faults;
+    uint64_t evictions;
+    uint64_t bytes_read;
+
+    int buildTree(std::vector<int> &index, int first, int count) {
+        TreeNode node = {{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}, -1, -1, -1};
+        for(int i = first; i < first + count; i++) {
+            for(int a = 0; a < 3; a++) {
+                node.min[a] = fminf(node.min[a], chunks[index[i]].min[a]);
+                node.max[a] = fmaxf(node.max[a], chunks[index[i]].max[a]);
+            }
+        }
+        int id = tree.size();
+        tree.push_back(node);
+        if(count == 1) {
+            tree[id].chunk = index[first];
+            return id;
+        }
+
+        // Median split along the longest axis
+        int axis = 0;
+        for(int a = 1; a < 3; a++) {
+            if(node.max[a] - node.min[a] > node.max[axis] - node.min[axis]) axis = a;
+        }
+        int half = count / 2;
+        std::nth_element(index.begin() + first, index.begin() + first + half, index.begin() + first + count, [&](int l, int r) {
+            return chunks[l].min[axis] + chunks[l].max[axis] < chunks[r].min[axis] + chunks[r].max[axis];
+        });
+        int left = buildTree(index, first, half);
+        int right = buildTree(index, first + half, count - half);
+        tree[id].left = left;
+        tree[id].right = right;
+        return id;
+    }
+
+    void evict(int chunk) {
+        resident_bytes -= resident[chunk]->bytes;
+        lru.erase(resident[chunk]->lru);
+        resident[chunk].reset();
+        evictions++;
+    }
+
+public:
+    ChunkStore(size_t budget) : sphere_count(0), budget(budget), resident_bytes(0) {
+        resetStats();
+    }
+
+    bool open(const std::string &path) {
+        file.open(path, std::ios::binary);
+        ChunkFileHeader header;
+        if(!file.read((char*)&header, sizeof(header)) || std::string(header.magic, 4) != "RAYC" || header.version != 1)
+            return false;
+        chunks.resize(header.chunk_count);
+        if(!file.read((char*)chunks.data(), chunks.size()*sizeof(ChunkInfo)))
+            return false;
+        sphere_count = header.sphere_count;
+        resident.clear();
+        resident.resize(chunks.size());
+        lru.clear();
+        resident_bytes = 0;
+
+        tree.clear();
+        std::vector<int> index(chunks.size());
+        for(int i = 0; i < (int)index.size(); i++) {
+            index[i] = i;
+        }
+        if(!chunks.empty())
+            buildTree(index, 0, chunks.size());
+        return true;
+    }
+
+    // Chunks whose bounds the ray crosses as (entry distance, chunk), nearest first
+    void crossedChunks(const Ray &ray, std::vector<std::pair<float, int>> &crossed) const {
+        crossed.clear();
+        if(tree.empty()) return;
+        Vec3 dir = ray.getDir();
+        dir.normalize();
+        const Vec3 pos = ray.getPos();
+        const float o[3] = {pos.x, pos.y, pos.z};
+        const float inv[3] = {1.0f/dir.x, 1.0f/dir.y, 1.0f/dir.z};
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while(top > 0) {
+            const TreeNode &node = tree[stack[--top]];
+            float near = 0.0f, far = INFINITY;
+            for(int a = 0; a < 3; a++) {
+                float t0 = (node.min[a] - o[a])*inv[a];
+                float t1 = (node.max[a] - o[a])*inv[a];
+                near = fmaxf(near, fminf(t0, t1));
+                far = fminf(far, fmaxf(t0, t1));
+            }
+            if(near > far) continue;
+            if(node.chunk >= 0) {
+                crossed.push_back(std::make_pair(near, node.chunk));
+            } else {
+                stack[top++] = node.left;
+                stack[top++] = node.right;
+            }
+        }
+        std::sort(crossed.begin(), crossed.end());
+    }
+
+    bool isResident(int chunk) const {
+        return resident[chunk] != nullptr;
+    }
+
+    // Makes the chunk resident, reading it from the file if needed. The
+    // reference stays valid until the next call.
+    const Chunk &acquire(int chunk) {
+        if(resident[chunk] != nullptr) {
+            lru.splice(lru.begin(), lru, resident[chunk]->lru);
+            return *resident[chunk];
+        }
+
+        const ChunkInfo &info = chunks[chunk];
+        std::vector<ChunkSphere> records(info.count);
+        file.clear();
+        file.seekg(info.offset);
+        file.read((char*)records.data(), records.size()*sizeof(ChunkSphere));
+        faults++;
+        bytes_read += records.size()*sizeof(ChunkSphere);
+
+        std::unique_ptr<Chunk> data(new Chunk());
+        data->balls.reserve(records.size());
+        for(const ChunkSphere &s : records) {
+            data->balls.push_back(Ball(Vec3(s.sphere.x, s.sphere.y, s.sphere.z), Material(Vec3(s.r, s.g, s.b), 1.0f), s.sphere.radius));
+        }
+        data->bvh.build(data->balls);
+        data->bytes = data->balls.size()*sizeof(Ball) + data->bvh.getNodeBytes() + data->bvh.getSphereBytes();
+
+        while(!lru.empty() && resident_bytes + data->bytes > budget) {
+            evict(lru.back());
+        }
+        lru.push_front(chunk);
+        data->lru = lru.begin();
+        resident_bytes += data->bytes;
+        resident[chunk] = std::move(data);
+        return *resident[chunk];
+    }
+
+    int getChunkCount() const {
+        return chunks.size();
+    }
+    uint64_t getSphereCount() const {
+        return sphere_count;
+    }
+    size_t getBudget() const {
+        return budget;
+    }
+    size_t getResidentBytes() const {
+        return resident_bytes;
+    }
+    uint64_t getFaults() const {
+        return faults;
+    }
+    uint64_t getEvictions() const {
+        return evictions;
+    }
+    uint64_t getBytesRead() const {
+        return bytes_read;
+    }
+    void resetStats() {
+        faults = 0;
+        evictions = 0;
+        bytes_read = 0;
+    }
+};
+
+// Nearest hit of a ray against a chunk store, distance < 0 on miss
+struct ChunkHit {
+    float distance;
+    Ball ball;
+};
+
+// Breadth first renderer for a ChunkStore. Every bounce depth is traced as
+// one batch, and within a batch the rays are grouped by the chunk they wait
+// on so every chunk is read at most a few times per batch instead of once
+// per ray.
+class OutOfCoreRenderer {
+private:
+    int frames;
+    uint64_t chunk_visits;
+    double time;
+
+    // Closest hits (any = false) or any hits (any = true) for all rays.
+    // Each ray walks its crossed chunks near to far; the store serves the
+    // chunk with the most waiting rays, preferring chunks already resident.
+    void query(ChunkStore &store, const std::vector<Ray> &rays, bool any, std::vector<ChunkHit> &hits) {
+        int n = rays.size();
+        hits.resize(n);
+        std::vector<std::vector<std::pair<float, int>>> crossed(n);
+#pragma omp parallel for schedule(dynamic, 256)
+        for(int i = 0; i < n; i++) {
+            store.crossedChunks(rays[i], crossed[i]);
+            hits[i].distance = -1;
+        }
+
+        std::vector<int> cursor(n, 0);
+        std::vector<std::vector<int>> waiting(store.getChunkCount());
+        for(int i = 0; i < n; i++) {
+            if(!crossed[i].empty())
+                waiting[crossed[i][0].second].push_back(i);
+        }
+
+        std::vector<int> batch, next;
+        while(true) {
+            int chunk = -1;
+            bool chunk_resident = false;
+            for(int c = 0; c < (int)waiting.size(); c++) {
+                if(waiting[c].empty()) continue;
+                bool r = store.isResident(c);
+                if(chunk < 0 || (r && !chunk_resident) || (r == chunk_resident && waiting[c].size() > waiting[chunk].size())) {
+                    chunk = c;
+                    chunk_resident = r;
+                }
+            }
+            if(chunk < 0) break;
+
+            batch.clear();
+            batch.swap(waiting[chunk]);
+            const ChunkStore::Chunk &data = store.acquire(chunk);
+            chunk_visits++;
+            next.resize(batch.size());
+#pragma omp parallel for schedule(static)
+            for(int j = 0; j < (int)batch.size(); j++) {
+                int i = batch[j];
+                ChunkHit &hit = hits[i];
+                next[j] = -1;
+                if(any) {
+                    if(data.bvh.anyHit(rays[i])) {
+                        hit.distance = 0.0f;
+                        continue;
+                    }
+                } else {
+                    float distance;
+                    int b = data.bvh.closestHit(rays[i], distance);
+                    if(b >= 0 && (hit.distance < 0 || distance < hit.distance)) {
+                        hit.distance = distance;
+                        hit.ball = data.balls[b];
+                    }
+                }
+
+                // Move on to the next chunk that could still hold a closer hit
+                int k = ++cursor[i];
+                if(k < (int)crossed[i].size() && (hit.distance < 0 || crossed[i][k].first < hit.distance))
+                    next[j] = crossed[i][k].second;
+            }
+            for(int j = 0; j < (int)batch.size(); j++) {
+                if(next[j] >= 0)
+                    waiting[next[j]].push_back(batch[j]);
+            }
+        }
+    }
+
+    struct Level {
+        std::vector<Ray> rays;
+        std::vector<ChunkHit> hits;
+        std::vector<Vec3> color;
+        std::vector<int> child;     // Reflected ray in the next level, -1 if none
+    };
+
+public:
+    OutOfCoreRenderer() {
+        resetStats();
+    }
+
+    // Shades like trace(), with the balls coming from the store instead of the scene
+    void render(const std::vector<Ray> &primary, const Scene &scene, ChunkStore &store, const RenderSettings &settings, int w, int h, uint32_t *pixels) {
+        double begin = getSeconds();
+        const auto& lights = scene.getLights();
+        int light_count = lights.size();
+        std::vector<Level> levels(settings.max_bounces + 1);
+        levels[0].rays = primary;
+
+        int depth = 0;
+        for(; depth <= settings.max_bounces; depth++) {
+            Level &level = levels[depth];
+            query(store, level.rays, false, level.hits);
+
+            std::vector<int> hits;
+            for(int i = 0; i < (int)level.rays.size(); i++) {
+                if(level.hits[i].distance >= 0)
+                    hits.push_back(i);
+            }
+            int hit_count = hits.size();
+            std::vector<Vec3> points(hit_count);
+            for(int j = 0; j < hit_count; j++) {
+                const Ray &ray = level.rays[hits[j]];
+                points[j] = level.hits[hits[j]].distance*ray.getDir() + ray.getPos();
+            }
+
+            std::vector<ChunkHit> occluded;
+            if(settings.features & SHADE_SHADOWS) {
+                std::vector<Ray> shadow_rays(hit_count*light_count);
+                for(int j = 0; j < hit_count; j++) {
+                    for(int l = 0; l < light_count; l++) {
+                        shadow_rays[j*light_count + l] = Ray(points[j], lights[l].getPos() - points[j]);
+                    }
+                }
+                query(store, shadow_rays, true, occluded);
+            }
+
+            level.color.resize(level.rays.size());
+#pragma omp parallel for schedule(static)
+            for(int i = 0; i < (int)level.rays.size(); i++) {
+                if(level.hits[i].distance < 0)
+                    level.color[i] = computeBackground(level.rays[i], scene);
+            }
+#pragma omp parallel for schedule(static)
+            for(int j = 0; j < hit_count; j++) {
+                int i = hits[j];
+                const Ball &ball = level.hits[i].ball;
+                Vec3 pos = points[j];
+                Vec3 normal = ball.getNormal(pos);
+                Vec3 mirrored = ball.getMirrored(level.rays[i].getDir(), pos);
+
+                float diffuce = 0.0f;
+                float specular = 0.0f;
+                for(int l = 0; l < light_count; l++) {
+                    if(!occluded.empty() && occluded[j*light_count + l].distance >= 0) continue;
+                    Vec3 light_dir = lights[l].getPos() - pos;
+                    light_dir.normalize();
+                    diffuce = normal.dotProduct(light_dir);
+                    if(settings.features & SHADE_SPECULAR)
+                        specular = mirrored.dotProduct(light_dir);
+                }
+                const Vec3 ball_color = 0.25f*(ball.getMaterial().getColor());
+                level.color[i] = shadePhong(ball_color, diffuce, specular);
+            }
+
+            if(depth == settings.max_bounces || hit_count == 0)
+                break;
+
+            Level &next_level = levels[depth + 1];
+            level.child.assign(level.rays.size(), -1);
+            next_level.rays.resize(hit_count);
+            for(int j = 0; j < hit_count; j++) {
+                int i = hits[j];
+                next_level.rays[j] = Ray(points[j], level.hits[i].ball.getMirrored(level.rays[i].getDir(), points[j]));
+                level.child[i] = j;
+            }
+        }
+
+        // Compose the bounces back to front like the recursion in trace() does
+        for(int d = std::min(depth, settings.max_bounces) - 1; d >= 0; d--) {
+            Level &level = levels[d];
+            const std::vector<Vec3> &next_color = levels[d + 1].color;
+            for(int i = 0; i < (int)level.rays.size(); i++) {
+                if(level.child[i] >= 0)
+                    level.color[i] = 0.3f*level.color[i] + 0.6f*next_color[level.child[i]];
+            }
+        }
+        for(int i = 0; i < w*h; i++) {
+            pixels[i] = packColor(levels[0].color[i]);
+        }
+        time += getSeconds() - begin;
+        frames++;
+    }
+
+    // Chunk faults and IO per frame since the last resetStats()
+    void printStats(const ChunkStore &store) const {
+        if(frames == 0) return;
+        std::cout << "Out of core: " << (double)store.getFaults()/frames << " faults/frame, "
+                  << store.getBytesRead()/(1024.0*1024.0)/frames << " MB read/frame, "
+                  << (double)store.getEvictions()/frames << " evictions/frame, "
+                  << (double)chunk_visits/frames << " chunk visits/frame, "
+                  << time*1000.0/frames << " ms/frame, "
+                  << store.getResidentBytes()/(1024.0*1024.0) << " of " << store.getBudget()/(1024.0*1024.0) << " MB resident" << std::endl;
+    }
+    void resetStats(ChunkStore *store = nullptr) {
+        frames = 0;
+        chunk_visits = 0;
+        time = 0.0;
+        if(store != nullptr)
+            store->resetStats();
+    }
+};
+
+// Per screen tile lists of the balls that primary rays of the tile can hit.
+// A ball is listed when its bounding sphere touches the frustum through the
+// tile edges, so the lists are conservative.
+class TileCuller {
+private:
+    int tile_size;
+    bool shadow_lists;
+    int tiles_x, tiles_y;
+    std::vector<uint32_t> balls;
+    std::vector<float> near;
+    std::vector<int> first;     // Start of every tile in balls and near, plus the end
+
+public:
+    TileCuller(int tile_size = 16, bool shadow_lists = false) : tile_size(tile_size), shadow_lists(shadow_lists), tiles_x(0), tiles_y(0) {}
+
+    void build(const Scene &scene, int w, int h) {
+        build(scene, scene.getCamera(), w, h);
+    }
+
+    void build(const Scene &scene, const Camera &camera, int w, int h) {
+        const Vec3 cam_pos = camera.getPos();
+        float z, cosalpha, sinalpha;
+        cameraBasis(camera, h, z, cosalpha, sinalpha);
+        const auto& scene_balls = scene.getBalls();
+        tiles_x = (w + tile_size - 1) / tile_size;
+        tiles_y = (h + tile_size - 1) / tile_size;
+        int tiles = tiles_x*tiles_y;
+
+        std::vector<std::vector<std::pair<float, uint32_t>>> lists(tiles);
+#pragma omp parallel for schedule(dynamic)
+        for(int t = 0; t < tiles; t++) {
+            float x0 = (t % tiles_x)*tile_size;
+            float y0 = (t / tiles_x)*tile_size;
+            float x1 = std::min(x0 + tile_size, (float)w);
+            float y1 = std::min(y0 + tile_size, (float)h);
+            const Vec3 corners[4] = {
+                primaryRayDir(x0, y0, w, h, z, cosalpha, sinalpha), primaryRayDir(x1, y0, w, h, z, cosalpha, sinalpha),
+                primaryRayDir(x1, y1, w, h, z, cosalpha, sinalpha), primaryRayDir(x0, y1, w, h, z, cosalpha, sinalpha)};
+            Vec3 center = primaryRayDir(0.5f*(x0 + x1), 0.5f*(y0 + y1), w, h, z, cosalpha, sinalpha);
+
+            // Side planes through the camera, normals pointing into the frustum
+            Vec3 planes[4];
+            for(int i = 0; i < 4; i++) {
+                planes[i] = corners[i].crossProduct(corners[(i + 1) % 4]);
+                planes[i].normalize();
+                if(planes[i].dotProduct(center) < 0)
+                    planes[i] = -planes[i];
+            }
+
+            std::vector<std::pair<float, uint32_t>> &list = lists[t];
+            for(uint32_t b = 0; b < scene_balls.size(); b++) {
+                Vec3 offset = scene_balls[b].getPos() - cam_pos;
+                float radius = scene_balls[b].getRadius();
+                bool inside = true;
+                for(int i = 0; i < 4 && inside; i++) {
+                    inside = planes[i].dotProduct(offset) >= -radius;
+                }
+                if(inside)
+                    list.push_back(std::make_pair(offset.getLength() - radius, b));
+            }
+            std::sort(list.begin(), list.end());
+        }
+
+        balls.clear();
+        near.clear();
+        first.resize(tiles + 1);
+        for(int t = 0; t < tiles; t++) {
+            first[t] = balls.size();
+            for(const auto& entry : lists[t]) {
+                near.push_back(entry.first);
+                balls.push_back(entry.second);
+            }
+        }
+        first[tiles] = balls.size();
+    }
+
+    // Primary hits of the tile at pixel (x0, y0) among its listed balls,
+    // row by row
+    void getHits(const std::vector<Ray> &rays, const Scene &scene, int w, int h, int x0, int y0, std::vector<VisibilityHit> &hits) const {
+        TileList list = getList(x0, y0);
+        hits.clear();
+        for(int y = y0; y < std::min(y0 + tile_size, h); y++) {
+            for(int x = x0; x < std::min(x0 + tile_size, w); x++) {
+                float distance;
+                int ball = closestInList(rays[y*w + x], scene, list, distance);
+                hits.push_back({ball, distance});
+            }
+        }
+    }
+
+    // Bounds of the hit points from getHits(), false if every ray of the tile misses
+    bool getHitBounds(const std::vector<Ray> &rays, const std::vector<VisibilityHit> &hits, int w, int h, int x0, int y0, Vec3 &min, Vec3 &max) const {
+        int row = std::min(x0 + tile_size, w) - x0;
+        min = Vec3(INFINITY);
+        max = Vec3(-INFINITY);
+        for(int y = y0; y < std::min(y0 + tile_size, h); y++) {
+            for(int x = x0; x < x0 + row; x++) {
+                const VisibilityHit &hit = hits[(y - y0)*row + x - x0];
+                if(hit.ball < 0) continue;
+                const Ray &ray = rays[y*w + x];
+                Vec3 p = hit.distance*ray.getDir() + ray.getPos();
+                min = Vec3(fminf(min.x, p.x), fminf(min.y, p.y), fminf(min.z, p.z));
+                max = Vec3(fmaxf(max.x, p.x), fmaxf(max.y, p.y), fmaxf(max.z, p.z));
+            }
+        }
+        return min.x <= max.x;
+    }
+
+    // Occluder lists for the shadow rays from the box [min, max] of a tile's
+    // primary hit points to every light. balls receives the list contents.
+    // Shadow rays do not stop at the light, so a ball is listed when it
+    // touches either the capsule around the segments from the box to the
+    // light, or the cone in which those rays continue past the light.
+    void buildShadowLists(const Scene &scene, const Vec3 &min, const Vec3 &max, std::vector<uint32_t> &balls, std::vector<TileList> &lists) const {
+        const auto& scene_balls = scene.getBalls();
+        const auto& lights = scene.getLights();
+        Vec3 center = 0.5f*(min + max);
+        float spread = 0.5f*(max - min).getLength();
+
+        std::vector<int> first(lights.size() + 1);
+        balls.clear();
+        for(int l = 0; l < (int)lights.size(); l++) {
+            first[l] = balls.size();
+            const Vec3 &light_pos = lights[l].getPos();
+            Vec3 axis = light_pos - center;
+            float length = axis.getLength();
+            axis = axis*(1.0f/length);
+            float cone = spread >= length ? (float)M_PI : asinf(spread/length);
+
+            for(uint32_t b = 0; b < scene_balls.size(); b++) {
+                const Vec3 &c = scene_balls[b].getPos();
+                float r = scene_balls[b].getRadius();
+
+                // Capsule from the box to the light
+                float t = std::min(std::max((c - center).dotProduct(axis), 0.0f), length);
+                bool listed = (c - (center + axis*t)).getLength() <= r + spread;
+
+                // Cone past the light
+                if(!listed) {
+                    Vec3 v = c - light_pos;
+                    float distance = v.getLength();
+                    listed = distance <= r || acosf(std::min(1.0f, std::max(-1.0f, v.dotProduct(axis)/distance))) <= cone + asinf(r/distance);
+                }
+                if(listed)
+                    balls.push_back(b);
+            }
+        }
+        first[lights.size()] = balls.size();
+
+        lists.resize(lights.size());
+        for(int l = 0; l < (int)lights.size(); l++) {
+            lists[l] = {balls.data() + first[l], nullptr, first[l + 1] - first[l]};
+        }
+    }
+
+    bool getShadowLists() const {
+        return shadow_lists;
+    }
+    int getTileSize() const {
+        return tile_size;
+    }
+    int getTileCount() const {
+        return tiles_x*tiles_y;
+    }
+    // List of the tile containing pixel (x, y)
+    TileList getList(int x, int y) const {
+        int t = (y / tile_size)*tiles_x + x / tile_size;
+        return {balls.data() + first[t], near.data() + first[t], first[t + 1] - first[t]};
+    }
+    // Average list length over the tiles
+    double getAverageLength() const {
+        return tiles_x*tiles_y > 0 ? (double)balls.size()/(tiles_x*tiles_y) : 0.0;
+    }
+};
+
+// Resolves primary visibility without tracing: every plain ball is projected
+// to the bounding box of its screen ellipse and put in the screen bins it
+// touches. Each bin then splats its balls in index order with a per pixel
+// analytic depth test, so the visibility buffer equals what a linear search
+// along the primary rays finds. render() shades from the buffer; bounces,
+// shadows and instanced balls are traced as usual.
+class SphereRasterizer {
+private:
+    int bin_size;
+    int bins_x, bins_y;
+    std::vector<VisibilityHit> hits;
+    std::vector<int> first;     // Start of every bin in entries, plus the end
+    std::vector<uint32_t> entries;
+    std::vector<int> bounds;    // Pixel box x0, y0, x1, y1 of every ball, empty if x0 > x1
+
+    // Inclusive pixel range whose centres can see the interval [low, high]
+    // of a screen axis, widened by a pixel for rounding
+    static void pixelRange(float low, float high, int size, int &first, int &last) {
+        // tanf() near the edge of the view can be far outside int. Two pixels
+        // of margin keep a range that ends off screen empty.
+        low = fminf(fmaxf(low, -2.0f), size + 2.0f);
+        high = fminf(fmaxf(high, -2.0f), size + 2.0f);
+        first = std::max(0, (int)floorf(low - 0.5f) - 1);
+        last = std::min(size - 1, (int)ceilf(high - 0.5f) + 1);
+    }
+
+public:
+    SphereRasterizer(int bin_size = 32) : bin_size(bin_size), bins_x(0), bins_y(0) {}
+
+    void rasterize(const std::vector<Ray> &rays, const Scene &scene, int w, int h) {
+        const Camera &camera = scene.getCamera();
+        const Vec3 cam_pos = camera.getPos();
+        float z, cosalpha, sinalpha;
+        cameraBasis(camera, h, z, cosalpha, sinalpha);
+        const auto& balls = scene.getBalls();
+        int count = balls.size();
+        bins_x = (w + bin_size - 1) / bin_size;
+        bins_y = (h + bin_size - 1) / bin_size;
+        int bins = bins_x*bins_y;
+
+        // Screen boxes. Camera space is the world rotated back by the camera
+        // angle, where the ray through (sx, sy) goes along (sx - w/2, h/2 - sy, z).
+        bounds.resize(4*count);
+#pragma omp parallel for schedule(static)
+        for(int b = 0; b < count; b++) {
+            Vec3 d = balls[b].getPos() - cam_pos;
+            float r = balls[b].getRadius();
+            float cx = d.x*cosalpha - d.z*sinalpha;
+            float cy = d.y;
+            float cz = d.x*sinalpha + d.z*cosalpha;
+            int *box = &bounds[4*b];
+            if(cz + r <= 0.0f) {
+                // Behind the camera
+                box[0] = 1;
+                box[2] = 0;
+                continue;
+            }
+            if(cz - r <= 0.0f) {
+                // Reaches beside or behind the camera, may cover any pixel
+                box[0] = 0;
+                box[1] = 0;
+                box[2] = w - 1;
+                box[3] = h - 1;
+                continue;
+            }
+            // Tangent lines from the camera in the xz and yz planes
+            float ax = atan2f(cx, cz);
+            float ay = atan2f(cy, cz);
+            float sx = asinf(r/sqrtf(cx*cx + cz*cz));
+            float sy = asinf(r/sqrtf(cy*cy + cz*cz));
+            pixelRange(w*0.5f + z*tanf(ax - sx), w*0.5f + z*tanf(ax + sx), w, box[0], box[2]);
+            pixelRange(h*0.5f - z*tanf(ay + sy), h*0.5f - z*tanf(ay - sy), h, box[1], box[3]);
+        }
+
+        // Bins, balls in index order within each
+        first.assign(bins + 1, 0);
+        for(int b = 0; b < count; b++) {
+            const int *box = &bounds[4*b];
+            if(box[0] > box[2] || box[1] > box[3]) continue;
+            for(int by = box[1] / bin_size; by <= box[3] / bin_size; by++) {
+                for(int bx = box[0] / bin_size; bx <= box[2] / bin_size; bx++) {
+                    first[by*bins_x + bx + 1]++;
+                }
+            }
+        }
+        for(int i = 0; i < bins; i++) {
+            first[i + 1] += first[i];
+        }
+        entries.resize(first[bins]);
+        std::vector<int> fill(first.begin(), first.end() - 1);
+        for(int b = 0; b < count; b++) {
+            const int *box = &bounds[4*b];
+            if(box[0] > box[2] || box[1] > box[3]) continue;
+            for(int by = box[1] / bin_size; by <= box[3] / bin_size; by++) {
+                for(int bx = box[0] / bin_size; bx <= box[2] / bin_size; bx++) {
+                    entries[fill[by*bins_x + bx]++] = b;
+                }
+            }
+        }
+
+        // Splat every bin. A ball replaces the stored hit only when strictly
+        // closer, so ties go to the lower index like in a linear search.
+        hits.resize(w*h);
+#pragma omp parallel for schedule(dynamic)
+        for(int bin = 0; bin < bins; bin++) {
+            int x0 = (bin % bins_x)*bin_size;
+            int y0 = (bin / bins_x)*bin_size;
+            int x1 = std::min(x0 + bin_size, w);
+            int y1 = std::min(y0 + bin_size, h);
+            for(int y = y0; y < y1; y++) {
+                for(int x = x0; x < x1; x++) {
+                    hits[y*w + x] = {-1, -1.0f};
+                }
+            }
+            for(int e = first[bin]; e < first[bin + 1]; e++) {
+                int b = entries[e];
+                const int *box = &bounds[4*b];
+                for(int y = std::max(y0, box[1]); y <= std::min(y1 - 1, box[3]); y++) {
+                    for(int x = std::max(x0, box[0]); x <= std::min(x1 - 1, box[2]); x++) {
+                        VisibilityHit &hit = hits[y*w + x];
+                        float distance;
+                        if(balls[b].intersect(rays[y*w + x], distance) && (distance < hit.distance || hit.ball < 0))
+                            hit = {b, distance};
+                    }
+                }
+            }
+        }
+    }
+
+    // Rasterizes, then shades every pixel from its visibility hit
+    void render(const std::vector<Ray> &rays, const Scene &scene, TraceFn trace_fn, const RenderSettings &settings, int w, int h, uint32_t *pixels, int *ball_ids = nullptr) {
+        rasterize(rays, scene, w, h);
+#pragma omp parallel for schedule(guided)
+        for(int y = 0; y < h; y++) {
+            RenderSettings pixel_settings = settings;
+            for(int x = 0; x < w; x++) {
+                int i = y*w + x;
+                pixel_settings.primary_hit = &hits[i];
+                pixels[i] = packColor(trace_fn(rays[i], scene, pixel_settings, ball_ids != nullptr ? &ball_ids[i] : nullptr));
+            }
+        }
+    }
+
+    const std::vector<VisibilityHit> &getHits() const {
+        return hits;
+    }
+    // Mean number of balls splatted per bin
+    double getAverageBin() const {
+        return bins_x*bins_y > 0 ? (double)entries.size()/(bins_x*bins_y) : 0.0;
+    }
+};
+
+// Traces one sample per pixel. ball_ids, if given, receives the primary ball of every pixel.
+// With tiles, primary rays only test the balls listed for their tile.
+inline void renderFrame(const std::vector<Ray> &rays, const Scene &scene, TraceFn trace_fn, const RenderSettings &settings, int w, int h, uint32_t *pixels, int *ball_ids = nullptr, const TileCuller *tiles = nullptr) {
+    if(tiles != nullptr) {
+        int size = tiles->getTileSize();
+        int tiles_x = (w + size - 1) / size;
+#pragma omp parallel
+        {
+            double begin = getSeconds();
+#pragma omp for schedule(dynamic) nowait
+            for(int t = 0; t < tiles->getTileCount(); t++) {
+                int x0 = (t % tiles_x)*size;
+                int y0 = (t / tiles_x)*size;
+                int x1 = std::min(x0 + size, w);
+                int y1 = std::min(y0 + size, h);
+                std::vector<VisibilityHit> hits;
+                tiles->getHits(rays, scene, w, h, x0, y0, hits);
+                RenderSettings tile_settings = settings;
+
+                // Shadow occluder lists from the bounds of the tile's primary hits
+                std::vector<uint32_t> shadow_balls;
+                std::vector<TileList> shadow_lists;
+                Vec3 min, max;
+                if(tiles->getShadowLists() && (settings.features & SHADE_SHADOWS) && settings.shadow_maps == nullptr
+                   && tiles->getHitBounds(rays, hits, w, h, x0, y0, min, max)) {
+                    tiles->buildShadowLists(scene, min, max, shadow_balls, shadow_lists);
+                    tile_settings.shadow_lists = shadow_lists.data();
+                }
+                for(int y = y0; y < y1; y++) {
+                    for(int x = x0; x < x1; x++) {
+                        int i = y*w + x;
+                        tile_settings.primary_hit = &hits[(y - y0)*(x1 - x0) + x - x0];
+                        pixels[i] = packColor(trace_fn(rays[i], scene, tile_settings, ball_ids != nullptr ? &ball_ids[i] : nullptr));
+                    }
+                }
+            }
+            if(settings.counters != nullptr)
+                settings.counters->local().busy += getSeconds() - begin;
+        }
+        return;
+    }
+#pragma omp parallel
+    {
+        double begin = getSeconds();
+#pragma omp for schedule(guided) nowait
+        for(int x = 0; x < w; x++) {
+            for(int y = 0; y < h; y++) {
+                int i = y*w + x;
+                pixels[i] = packColor(trace_fn(rays[i], scene, settings, ball_ids != nullptr ? &ball_ids[i] : nullptr));
+            }
+        }
+        if(settings.counters != nullptr)
+            settings.counters->local().busy += getSeconds() - begin;
+    }
+}
+
+// Pixel rectangle [x, x + w) x [y, y + h)
+struct RenderRect {
+    int x, y, w, h;
+};
+
+// One render call: the rectangle rect of a width x height image of scene
+// seen from camera. pixels holds the whole image with stride values per row,
+// only the pixels inside rect are written.
+struct RenderContext {
+    const Scene *scene;
+    Camera camera;
+    int width, height;
+    RenderRect rect;
+    uint32_t *pixels;
+    int stride;
+
+    RenderContext(const Scene &scene, const Camera &camera, int width, int height, uint32_t *pixels) :
+        scene(&scene), camera(camera), width(width), height(height), rect({0, 0, width, height}), pixels(pixels), stride(width) {}
+};
+
+// Renders contexts with fixed settings. All state is kept in the object,
+// so any number of Renderers can work on different scenes at the same
+// time. A single Renderer renders one context at a time.
+class Renderer {
+private:
+    RenderSettings settings;
+    bool use_bvh;
+    SphereBVH bvh;
+    InstanceBVH instance_bvh;
+    uint64_t accel_scene;       // Scene::getId() and balls version the trees were built for, 0 for none
+    uint64_t accel_version;
+    std::vector<TileCuller> view_tiles;     // Per view state of renderViews()
+    std::vector<std::vector<Ray>> view_rays;
+
+    // Settings with the acceleration trees of scene, rebuilt when the balls changed
+    RenderSettings prepare(const Scene &scene) {
+        RenderSettings frame_settings = settings;
+        bool instanced = !scene.getInstances().empty();
+        if((use_bvh || instanced) && (accel_scene != scene.getId() || accel_version != scene.getBallsVersion())) {
+            if(use_bvh)
+                bvh.build(scene.getBalls());
+            if(instanced)
+                instance_bvh.build(scene);
+            accel_scene = scene.getId();
+            accel_version = scene.getBallsVersion();
+        }
+        if(use_bvh)
+            frame_settings.bvh = &bvh;
+        if(instanced)
+            frame_settings.instances = &instance_bvh;
+        return frame_settings;
+    }
+
+    // Views that can share tiles: same image size and nearby cameras looking
+    // the same way, like the two eyes of a stereo pair
+    static bool closeViews(const RenderContext &a, const RenderContext &b) {
+        const Camera &ca = a.camera;
+        const Camera &cb = b.camera;
+        Vec3 da = ca.getDir();
+        Vec3 db = cb.getDir();
+        da.normalize();
+        db.normalize();
+        return a.width == b.width && a.height == b.height && ca.getFov() == cb.getFov()
+            && da.dotProduct(db) > 0.99f && (ca.getPos() - cb.getPos()).getLength() < 1.0f;
+    }
+
+public:
+    Renderer(const RenderSettings &settings = RenderSettings(), bool use_bvh = false, BVHLayout layout = BVH_COMPACT) :
+        settings(settings), use_bvh(use_bvh), bvh(layout), instance_bvh(layout), accel_scene(0), accel_version(0) {}
+
+    void render(const RenderContext &context) {
+        const Scene &scene = *context.scene;
+        RenderSettings frame_settings = prepare(scene);
+        TraceFn trace_fn = selectTrace(scene, frame_settings);
+
+        Vec3 cam_pos = context.camera.getPos();
+        float z, cosalpha, sinalpha;
+        cameraBasis(context.camera, context.height, z, cosalpha, sinalpha);
+        const RenderRect &rect = context.rect;
+#pragma omp parallel for schedule(guided)
+        for(int y = rect.y; y < rect.y + rect.h; y++) {
+            for(int x = rect.x; x < rect.x + rect.w; x++) {
+                Ray ray = Ray(cam_pos, primaryRayDir(x, y, context.width, context.height, z, cosalpha, sinalpha));
+                context.pixels[y*context.stride + x] = packColor(trace_fn(ray, scene, frame_settings, nullptr));
+            }
+        }
+    }
+
+    // Renders several views of the same scene, e.g. a stereo pair and
+    // monitoring views. The trees and trace function are set up once, and
+    // the tiles of all views run in one parallel loop, interleaved so that
+    // every view is worked on while the scene is in cache. Close views trace
+    // a tile together: its shadow occluder lists are built once from the hit
+    // points of all of them. Gives the same pixels as render(). Returns
+    // false without rendering if the views are not all of one scene.
+    bool renderViews(const std::vector<RenderContext> &views) {
+        if(views.empty())
+            return true;
+        for(const auto& view : views) {
+            if(view.scene != views[0].scene)
+                return false;
+        }
+        const Scene &scene = *views[0].scene;
+        RenderSettings frame_settings = prepare(scene);
+        TraceFn trace_fn = selectTrace(scene, frame_settings);
+        bool shadow_lists = (frame_settings.features & SHADE_SHADOWS) && frame_settings.shadow_maps == nullptr;
+
+        int n = views.size();
+        view_tiles.resize(n, TileCuller(16, shadow_lists));
+        view_rays.resize(n);
+        for(int v = 0; v < n; v++) {
+            const RenderContext &view = views[v];
+            computeRays(view_rays[v], view.width, view.height, view.camera);
+            view_tiles[v] = TileCuller(16, shadow_lists);
+            view_tiles[v].build(scene, view.camera, view.width, view.height);
+        }
+
+        // Groups of close views, led by their first view
+        std::vector<std::vector<int>> groups;
+        for(int v = 0; v < n; v++) {
+            auto group = std::find_if(groups.begin(), groups.end(), [&](const std::vector<int> &g) {
+                return closeViews(views[g[0]], views[v]);
+            });
+            if(group == groups.end())
+                groups.push_back({v});
+            else
+                group->push_back(v);
+        }
+
+        // Tile t of every group before tile t + 1 of any
+        std::vector<std::pair<int, int>> work;
+        for(int t = 0; ; t++) {
+            size_t before = work.size();
+            for(int g = 0; g < (int)groups.size(); g++) {
+                if(t < view_tiles[groups[g][0]].getTileCount())
+                    work.push_back({g, t});
+            }
+            if(work.size() == before)
+                break;
+        }
+
+#pragma omp parallel for schedule(dynamic)
+        for(int i = 0; i < (int)work.size(); i++) {
+            const std::vector<int> &group = groups[work[i].first];
+            const RenderContext &first = views[group[0]];
+            int size = view_tiles[group[0]].getTileSize();
+            int tiles_x = (first.width + size - 1) / size;
+            int x0 = (work[i].second % tiles_x)*size;
+            int y0 = (work[i].second / tiles_x)*size;
+
+            // Primary hits of the tile in every view of the group
+            std::vector<std::vector<VisibilityHit>> hits(group.size());
+            for(int g = 0; g < (int)group.size(); g++)
+                view_tiles[group[g]].getHits(view_rays[group[g]], scene, first.width, first.height, x0, y0, hits[g]);
+
+            // Shadow occluder lists from the hit points of the tile in every view of the group
+            RenderSettings tile_settings = frame_settings;
+            std::vector<uint32_t> shadow_balls;
+            std::vector<TileList> tile_shadow_lists;
+            if(shadow_lists) {
+                Vec3 min = Vec3(INFINITY);
+                Vec3 max = Vec3(-INFINITY);
+                for(int g = 0; g < (int)group.size(); g++) {
+                    Vec3 view_min, view_max;
+                    if(view_tiles[group[g]].getHitBounds(view_rays[group[g]], hits[g], first.width, first.height, x0, y0, view_min, view_max)) {
+                        min = Vec3(fminf(min.x, view_min.x), fminf(min.y, view_min.y), fminf(min.z, view_min.z));
+                        max = Vec3(fmaxf(max.x, view_max.x), fmaxf(max.y, view_max.y), fmaxf(max.z, view_max.z));
+                    }
+                }
+                if(min.x <= max.x) {
+                    view_tiles[group[0]].buildShadowLists(scene, min, max, shadow_balls, tile_shadow_lists);
+                    tile_settings.shadow_lists = tile_shadow_lists.data();
+                }
+            }
+
+            int row = std::min(x0 + size, first.width) - x0;
+            for(int g = 0; g < (int)group.size(); g++) {
+                int v = group[g];
+                const RenderContext &view = views[v];
+                const RenderRect &rect = view.rect;
+                for(int y = std::max(y0, rect.y); y < std::min(y0 + size, rect.y + rect.h); y++) {
+                    for(int x = std::max(x0, rect.x); x < std::min(x0 + size, rect.x + rect.w); x++) {
+                        tile_settings.primary_hit = &hits[g][(y - y0)*row + x - x0];
+                        view.pixels[y*view.stride + x] = packColor(trace_fn(view_rays[v][y*view.width + x], scene, tile_settings, nullptr));
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    const RenderSettings &getSettings() const {
+        return settings;
+    }
+    void setSettings(const RenderSettings &new_settings) {
+        settings = new_settings;
+    }
+};
+
+// One scene of a batch: setupScene(balls, seed, instances) rendered at
+// frame of its light animation into a w x h image
+struct BatchJob {
+    uint32_t seed;
+    int balls;
+    int instances;
+    int frame;
+    int w, h;
+    uint32_t *pixels;
+};
+
+// Renders many small independent scenes. Every thread sets up and renders
+// whole jobs, since the pixels of one small image do not spread well over
+// many threads. When no job is left to start, the idle threads steal tiles
+// from the jobs still running, so the end of the batch is not left to a
+// few threads.
+class BatchRenderer {
+private:
+    struct JobState {
+        Scene scene;
+        RenderSettings settings;
+        TraceFn trace_fn;
+        SphereBVH bvh;
+        InstanceBVH instance_bvh;
+        float z, cosalpha, sinalpha;
+        int tiles_x, tile_count;
+        std::atomic<int> next_tile;
+        std::atomic<int> done_tiles;
+        double begin;
+
+        JobState(const Scene &scene) : scene(scene), next_tile(0), done_tiles(0) {}
+    };
+
+    RenderSettings settings;
+    bool use_bvh;
+    int tile_size;
+    std::vector<double> latencies;
+    double seconds;
+    long long stolen_tiles;
+
+    // Renders tiles of a job until none is left to take
+    int renderTiles(const BatchJob &job, JobState &state, std::vector<double> &done) {
+        int rendered = 0;
+        Vec3 cam_pos = state.scene.getCamera().getPos();
+        while(true) {
+            int t = state.next_tile.fetch_add(1);
+            if(t >= state.tile_count)
+                return rendered;
+            int x0 = (t % state.tiles_x)*tile_size;
+            int y0 = (t / state.tiles_x)*tile_size;
+            for(int y = y0; y < std::min(y0 + tile_size, job.h); y++) {
+                for(int x = x0; x < std::min(x0 + tile_size, job.w); x++) {
+                    Ray ray = Ray(cam_pos, primaryRayDir(x, y, job.w, job.h, state.z, state.cosalpha, state.sinalpha));
+                    job.pixels[y*job.w + x] = packColor(state.trace_fn(ray, state.scene, state.settings, nullptr));
+                }
+            }
+            rendered++;
+            // The thread finishing the last tile records the latency
+            if(state.done_tiles.fetch_add(1) + 1 == state.tile_count)
+                done.push_back(getSeconds() - state.begin);
+        }
+    }
+
+public:
+    BatchRenderer(const RenderSettings &settings = RenderSettings(), bool use_bvh = false, int tile_size = 16) :
+        settings(settings), use_bvh(use_bvh), tile_size(tile_size), seconds(0.0), stolen_tiles(0) {}
+
+    void render(const std::vector<BatchJob> &jobs) {
+        int n = jobs.size();
+        // Each slot of states is written only by the thread owning the job.
+        // Helpers see a job through published once its setup is done
+        std::vector<std::unique_ptr<JobState>> states(n);
+        std::vector<std::atomic<JobState*>> published(n);
+        for(auto &p : published)
+            p.store(nullptr, std::memory_order_relaxed);
+        std::atomic<int> next_job(0);
+        latencies.clear();
+        stolen_tiles = 0;
+        long long stolen = 0;
+        double begin = getSeconds();
+
+#pragma omp parallel reduction(+:stolen)
+        {
+            std::vector<double> done;
+            while(true) {
+                int j = next_job.fetch_add(1);
+                if(j < n) {
+                    // Set up and render a whole job
+                    const BatchJob &job = jobs[j];
+                    double job_begin = getSeconds();
+                    std::unique_ptr<JobState> state(new JobState(setupScene(job.balls, job.seed, job.instances).atFrame(job.frame)));
+                    state->begin = job_begin;
+                    state->settings = settings;
+                    if(use_bvh) {
+                        state->bvh.build(state->scene.getBalls());
+                        state->settings.bvh = &state->bvh;
+                    }
+                    if(!state->scene.getInstances().empty()) {
+                        state->instance_bvh.build(state->scene);
+                        state->settings.instances = &state->instance_bvh;
+                    }
+                    state->trace_fn = selectTrace(state->scene, state->settings);
+                    cameraBasis(state->scene.getCamera(), job.h, state->z, state->cosalpha, state->sinalpha);
+                    state->tiles_x = (job.w + tile_size - 1) / tile_size;
+                    state->tile_count = state->tiles_x*((job.h + tile_size - 1) / tile_size);
+                    JobState *own = state.get();
+                    states[j] = std::move(state);
+                    published[j].store(own, std::memory_order_release);
+                    renderTiles(job, *own, done);
+                    continue;
+                }
+
+                // Nothing left to start, help the jobs still running
+                int helped = 0;
+                for(int k = 0; k < std::min(n, next_job.load()); k++) {
+                    JobState *state = published[k].load(std::memory_order_acquire);
+                    if(state == nullptr || state->next_tile.load() >= state->tile_count)
+                        continue;
+                    helped += renderTiles(jobs[k], *state, done);
+                }
+                stolen += helped;
+                if(helped == 0)
+                    break;
+            }
+#pragma omp critical
+            latencies.insert(latencies.end(), done.begin(), done.end());
+        }
+        stolen_tiles = stolen;
+        seconds = getSeconds() - begin;
+        std::sort(latencies.begin(), latencies.end());
+    }
+
+    // Job latency in seconds at quantile q of the last batch, from setup to the last tile
+    double getLatency(double q) const {
+        if(latencies.empty())
+            return 0.0;
+        return latencies[std::min((size_t)(q*latencies.size()), latencies.size() - 1)];
+    }
+    double getJobsPerSecond() const {
+        return seconds > 0.0 ? latencies.size()/seconds : 0.0;
+    }
+    void printStats() const {
+        std::cerr << "Batch: " << latencies.size() << " jobs in " << seconds << " s, " << getJobsPerSecond() << " jobs/s, latency p50 "
+                  << getLatency(0.5)*1000.0 << " ms, p90 " << getLatency(0.9)*1000.0 << " ms, p99 " << getLatency(0.99)*1000.0
+                  << " ms, max " << getLatency(1.0)*1000.0 << " ms, " << stolen_tiles << " tiles stolen" << std::endl;
+    }
+};
+
+#endif
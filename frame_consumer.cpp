@@ -0,0 +1,124 @@
+/*
+ * Reference consumer for the shared memory frame ring
+ *
+ * Reads the frames that "ray --shm NAME" publishes and prints once a
+ * second how many arrived, were skipped or were overwritten while being
+ * read, the latency from publishing to reading and a checksum of the last
+ * frame. With --y4m the frames are also written as a Y4M stream.
+ *
+ * Usage: frame_consumer [NAME] [--frames N] [--y4m FILE]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "FrameRing.h"
+
+int main(int argc, char* argv[]) {
+    std::string name = "/ray";
+    long long max_frames = -1;
+    std::string y4m_path;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--frames" && i + 1 < argc)
+            max_frames = atoll(argv[++i]);
+        else if(arg == "--y4m" && i + 1 < argc)
+            y4m_path = argv[++i];
+        else
+            name = arg;
+    }
+
+    // Wait for the producer to appear
+    FrameRing ring;
+    for(int tries = 0; !ring.open(name); tries++) {
+        if(tries == 100) {
+            std::cerr << "Could not open " << name << std::endl;
+            return -1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    int w = ring.getWidth();
+    int h = ring.getHeight();
+    std::cerr << "Reading " << w << "x" << h << " frames from " << name << ", " << ring.getSlotCount() << " slots" << std::endl;
+
+    FILE *out = nullptr;
+    std::vector<uint8_t> planes;
+    if(!y4m_path.empty()) {
+        out = fopen(y4m_path.c_str(), "wb");
+        if(out == nullptr) {
+            std::cerr << "Could not open " << y4m_path << std::endl;
+            return -1;
+        }
+        fprintf(out, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444\n", w, h);
+        planes.resize(3*w*h);
+    }
+
+    int64_t last = -1;
+    long long received = 0, skipped = 0, torn = 0, total = 0;
+    double latency = 0.0, max_latency = 0.0;
+    uint64_t checksum = 0;
+    uint64_t report = frameRingTime();
+    while(max_frames < 0 || total < max_frames) {
+        int64_t frame = ring.waitFrame(last, 2000);
+        if(frame < 0) {
+            std::cerr << "No frames for 2 s, stopping" << std::endl;
+            break;
+        }
+        if(last >= 0)
+            skipped += frame - last - 1;
+        last = frame;
+
+        // Read the frame in place, then check that it was not overwritten meanwhile
+        const uint32_t *pixels = ring.getFrame(frame);
+        uint64_t sum = 0;
+        uint64_t time_ns = 0;
+        if(pixels != nullptr) {
+            for(int i = 0; i < w*h; i++) {
+                sum = sum*31 + pixels[i];
+            }
+            // Same BT.601 conversion as the renderer's own Y4M output
+            int n = w*h;
+            for(int i = 0; out != nullptr && i < n; i++) {
+                float r = (pixels[i] >> 16) & 0xff;
+                float g = (pixels[i] >> 8) & 0xff;
+                float b = pixels[i] & 0xff;
+                planes[i]       = (uint8_t)(16.5f + 0.2568f*r + 0.5041f*g + 0.0979f*b);
+                planes[n + i]   = (uint8_t)(128.5f - 0.1482f*r - 0.2910f*g + 0.4392f*b);
+                planes[2*n + i] = (uint8_t)(128.5f + 0.4392f*r - 0.3678f*g - 0.0714f*b);
+            }
+            time_ns = ring.getFrameTime(frame);
+        }
+        if(pixels == nullptr || !ring.frameIntact(frame)) {
+            torn++;
+            continue;
+        }
+        if(out != nullptr) {
+            fputs("FRAME\n", out);
+            fwrite(planes.data(), 1, planes.size(), out);
+        }
+
+        double frame_latency = (frameRingTime() - time_ns)*1e-6;
+        latency += frame_latency;
+        max_latency = std::max(max_latency, frame_latency);
+        checksum = sum;
+        received++;
+        total++;
+
+        uint64_t now = frameRingTime();
+        if(now - report >= 1000000000ull) {
+            std::cerr << "frame " << frame << ": " << received << " read, " << skipped << " skipped, " << torn << " torn, latency "
+                      << latency/received << " ms avg " << max_latency << " ms max, checksum " << std::hex << checksum << std::dec << std::endl;
+            report = now;
+            received = skipped = torn = 0;
+            latency = max_latency = 0.0;
+        }
+    }
+    if(received > 0)
+        std::cerr << "frame " << last << ": " << received << " read, " << skipped << " skipped, " << torn << " torn, latency "
+                  << latency/received << " ms avg " << max_latency << " ms max, checksum " << std::hex << checksum << std::dec << std::endl;
+    if(out != nullptr)
+        fclose(out);
+    return 0;
+}
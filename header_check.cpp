@@ -0,0 +1,8 @@
+/*
+ * Second translation unit for the microbench build
+ *
+ * Raytracer.h is header-only. Linking this file next to microbench.cpp
+ * fails with multiple definitions if a header function loses its inline.
+ */
+
+#include "Raytracer.h"
@@ -1,584 +1,1401 @@
-#include <cmath>
-#include <ctime>
 #include <iostream>
 #include <vector>
-#include <cstdlib>
-#include <chrono>
-#include <omp.h>
+#include <string>
+#include <cstdio>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 #include "AE2D.h"
+#include "Raytracer.h"
+#include "FrameRing.h"
+#include "Hud.h"
 
-class Vec3 {
-public:
-    float x, y, z;
+uint64_t getTime() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
-    Vec3() : x(0), y(0), z(0) {}
-    Vec3(float xyz) : x(xyz), y(xyz), z(xyz) {}
-    Vec3(float x, float y, float z) : x(x), y(y), z(z) {}
+// Peak signal to noise ratio between two packed images in dB
+double computePSNR(const uint32_t *a, const uint32_t *b, int n) {
+    double error = 0.0;
+    for(int i = 0; i < n; i++) {
+        for(int shift = 0; shift <= 16; shift += 8) {
+            double d = (double)((a[i] >> shift) & 0xff) - (double)((b[i] >> shift) & 0xff);
+            error += d*d;
+        }
+    }
+    double mse = error/(3.0*n);
+    return mse > 0.0 ? 10.0*log10(255.0*255.0/mse) : INFINITY;
+}
 
-    float getLength() const {
-        return sqrtf((x * x) + (y * y) + (z * z));
+// Compares secondary and shadow ray traversal with and without coherence sorting
+void benchmarkCoherence(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    const int batches[] = {0, 256, 1024, 4096, 16384, 65536, w*h};
+    std::vector<uint32_t> pixels(w*h);
+    double unsorted = 0.0;
+
+    std::cout << "Coherence sorting, " << w << "x" << h << ", " << scene.getBalls().size() << " balls" << std::endl;
+    for(int batch : batches) {
+        if(batch > w*h) continue;
+        WavefrontRenderer renderer;
+        renderer.setSortBatch(batch);
+        renderer.render(scene, settings, w, h, pixels.data());
+        renderer.resetStats();
+        double begin = getSeconds();
+        for(int i = 0; i < frames; i++) {
+            renderer.render(scene, settings, w, h, pixels.data());
+        }
+        double frame_time = (getSeconds() - begin)*1000.0/frames;
+
+        // The stages do not overlap, so together they should make up the frame
+        double traversal = renderer.getStageTime(STAGE_EXTEND) + renderer.getStageTime(STAGE_SHADOW);
+        double sort = renderer.getStageTime(STAGE_SORT);
+        double stages = 0.0;
+        for(int s = 0; s < STAGE_COUNT; s++) {
+            stages += renderer.getStageTime((WavefrontStage)s);
+        }
+        if(batch == 0)
+            unsorted = traversal;
+        std::cout << "  batch " << (batch == 0 ? std::string("unsorted") : std::to_string(batch))
+                  << ": traversal " << traversal << " ms, sort " << sort << " ms"
+                  << ", speedup " << unsorted/traversal << "x (" << unsorted/(traversal + sort) << "x with sort)"
+                  << ", stages " << stages << " of " << frame_time << " ms" << std::endl;
     }
-    void normalize() {
-        float s = 1.0f / getLength();
-        x = x * s;
-        y = y * s;
-        z = z * s;
+}
+
+// Frame time of shadow map lookups against traced shadow rays
+void benchmarkShadowMaps(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    std::vector<uint32_t> exact(w*h);
+    std::vector<uint32_t> pixels(w*h);
+    TraceFn trace_fn = selectTrace(scene, settings);
+
+    double begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        renderFrame(rays, scene, trace_fn, settings, w, h, exact.data());
     }
-    const float dotProduct(const Vec3 &other) const {
-        return other.x*x + other.y*y + other.z*z;
+    double exact_time = (getSeconds() - begin)*1000.0/frames;
+
+    std::cout << "Shadow maps, " << w << "x" << h << ", traced shadows " << exact_time << " ms" << std::endl;
+    const int resolutions[] = {256, 512, 1024, 2048};
+    for(int resolution : resolutions) {
+        ShadowMaps shadow_maps(resolution, 0.05f);
+        RenderSettings map_settings = settings;
+        map_settings.shadow_maps = &shadow_maps;
+
+        // Static lights: the maps are built once
+        shadow_maps.update(scene);
+        begin = getSeconds();
+        for(int i = 0; i < frames; i++) {
+            renderFrame(rays, scene, trace_fn, map_settings, w, h, pixels.data());
+        }
+        double static_time = (getSeconds() - begin)*1000.0/frames;
+
+        int different = 0;
+        for(int i = 0; i < w*h; i++) {
+            if(pixels[i] != exact[i]) different++;
+        }
+
+        // Moving lights: the maps are rebuilt every frame
+        Scene animated = scene;
+        begin = getSeconds();
+        for(int i = 0; i < frames; i++) {
+            animated.update();
+            shadow_maps.update(animated);
+            renderFrame(rays, animated, trace_fn, map_settings, w, h, pixels.data());
+        }
+        double animated_time = (getSeconds() - begin)*1000.0/frames;
+
+        std::cout << "  " << resolution << "^2 x 6: static " << static_time << " ms (" << exact_time/static_time << "x)"
+                  << ", moving light " << animated_time << " ms (" << exact_time/animated_time << "x)"
+                  << ", " << different*100.0/(w*h) << "% pixels differ" << std::endl;
     }
+}
 
-    Vec3 operator+ (const Vec3 &other) const {
-        return Vec3(this->x + other.x, this->y + other.y, this->z + other.z);
+// Checkerboard throughput and quality against full frames over an animated sequence
+void benchmarkCheckerboard(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    std::vector<uint32_t> full(w*h);
+    std::vector<uint32_t> pixels(w*h);
+    TraceFn trace_fn = selectTrace(scene, settings);
+    CheckerboardRenderer checkerboard;
+
+    Scene animated = scene;
+    double full_time = 0.0;
+    double checkerboard_time = 0.0;
+    double psnr = 0.0;
+    double min_psnr = INFINITY;
+    for(int i = 0; i < frames + 1; i++) {
+        double begin = getSeconds();
+        renderFrame(rays, animated, trace_fn, settings, w, h, full.data());
+        double middle = getSeconds();
+        checkerboard.render(rays, animated, trace_fn, settings, w, h, pixels.data());
+        double end = getSeconds();
+
+        // The first frame has no history yet
+        if(i > 0) {
+            full_time += middle - begin;
+            checkerboard_time += end - middle;
+            double frame_psnr = computePSNR(full.data(), pixels.data(), w*h);
+            psnr += frame_psnr;
+            min_psnr = std::min(min_psnr, frame_psnr);
+        }
+        animated.update();
     }
-    Vec3 operator- (const Vec3 &other) const {
-        return Vec3(this->x - other.x, this->y - other.y, this->z - other.z);
+
+    std::cout << "Checkerboard, " << w << "x" << h << ": full " << full_time*1000.0/frames << " ms, checkerboard "
+              << checkerboard_time*1000.0/frames << " ms (" << full_time/checkerboard_time << "x), PSNR "
+              << psnr/frames << " dB (min " << min_psnr << " dB), " << checkerboard.getTemporalFraction()*100.0
+              << "% of missing pixels reused" << std::endl;
+}
+
+// Share of tiles finished and image quality of the deadline renderer with
+// budgets of a fraction of the full frame time, on an animated scene
+void benchmarkDeadline(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    std::vector<uint32_t> full(w*h);
+    std::vector<uint32_t> pixels(w*h);
+    TraceFn trace_fn = selectTrace(scene, settings);
+
+    double begin = getSeconds();
+    renderFrame(rays, scene, trace_fn, settings, w, h, full.data());
+    double full_time = getSeconds() - begin;
+    std::cout << "Deadline, " << w << "x" << h << ", full frame " << full_time*1000.0 << " ms" << std::endl;
+
+    const float budgets[] = {0.25f, 0.5f, 0.75f};
+    const DeadlineOrder orders[] = {DEADLINE_CENTER, DEADLINE_CHANGED};
+    for(DeadlineOrder order : orders) {
+        for(float budget : budgets) {
+            DeadlineRenderer deadline(16, order);
+            Scene animated = scene;
+            double psnr = 0.0;
+            double min_psnr = INFINITY;
+            double time = 0.0;
+            for(int i = 0; i < frames; i++) {
+                begin = getSeconds();
+                deadline.render(rays, animated, trace_fn, settings, w, h, pixels.data(), full_time*budget);
+                time += getSeconds() - begin;
+                renderFrame(rays, animated, trace_fn, settings, w, h, full.data());
+                double frame_psnr = computePSNR(full.data(), pixels.data(), w*h);
+                psnr += frame_psnr;
+                min_psnr = std::min(min_psnr, frame_psnr);
+                animated.update();
+            }
+            std::cout << "  " << (order == DEADLINE_CENTER ? "centre" : "changed") << " first, budget " << budget*100.0f << "%: "
+                      << time*1000.0/frames << " ms, " << deadline.getCompletedFraction()*100.0 << "% of tiles, PSNR "
+                      << psnr/frames << " dB (min " << min_psnr << " dB)" << std::endl;
+        }
     }
-    Vec3 operator* (float scale) const {
-        return Vec3(this->x * scale, this->y * scale, this->z * scale);
+}
+
+// Frame time, share of reused lighting and quality of the reprojection
+// cache against full frames, with the camera turning and moving forward
+void benchmarkReprojection(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Ray> rays;
+    std::vector<uint32_t> full(w*h), pixels(w*h);
+    TraceFn trace_fn = selectTrace(scene, settings);
+    ReprojectionCache cache;
+
+    Scene moving = scene;
+    double full_time = 0.0;
+    double cache_time = 0.0;
+    double psnr = 0.0;
+    double min_psnr = INFINITY;
+    int mismatches = 0;
+    for(int i = 0; i < frames + 1; i++) {
+        computeRays(rays, w, h, moving.getCamera());
+        double begin = getSeconds();
+        renderFrame(rays, moving, trace_fn, settings, w, h, full.data());
+        double middle = getSeconds();
+        cache.render(rays, moving, settings, w, h, pixels.data());
+        double end = getSeconds();
+
+        // The first frame has no history yet
+        if(i > 0) {
+            full_time += middle - begin;
+            cache_time += end - middle;
+            double frame_psnr = computePSNR(full.data(), pixels.data(), w*h);
+            psnr += std::min(frame_psnr, 99.0);
+            min_psnr = std::min(min_psnr, frame_psnr);
+            for(int p = 0; p < w*h; p++) {
+                mismatches += full[p] != pixels[p];
+            }
+        }
+        Camera camera = moving.getCamera();
+        camera.move(Vec3(0.0f, 0.0f, 0.05f));
+        moving.setCamera(Camera(camera.getPos() + Vec3(0.0f, 0.0f, 0.05f), camera.getDir(), camera.getFov()));
     }
-    Vec3 operator- () const {
-        return Vec3(-this->x, -this->y, -this->z);
+
+    std::cout << "Reprojection, " << w << "x" << h << ": full " << full_time*1000.0/frames << " ms, reprojected "
+              << cache_time*1000.0/frames << " ms (" << full_time/cache_time << "x), " << cache.getAverageReuseRatio()*100.0
+              << "% of lit pixels reused, PSNR " << psnr/frames << " dB (min " << min_psnr << " dB), "
+              << mismatches*100.0/((double)frames*w*h) << "% pixels differ" << std::endl;
+}
+
+// Frame time of rasterised primary visibility against tracing the primary rays
+void benchmarkRaster(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    std::vector<uint32_t> reference(w*h), pixels(w*h);
+    TraceFn trace_fn = selectTrace(scene, settings);
+    SphereRasterizer rasterizer;
+
+    double begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        renderFrame(rays, scene, trace_fn, settings, w, h, reference.data());
     }
-    friend Vec3 operator* (float scale, const Vec3 &other) {
-        return Vec3(other.x * scale, other.y * scale, other.z * scale);
+    double full = (getSeconds() - begin)*1000.0/frames;
+
+    double raster = 0.0;
+    begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        double raster_begin = getSeconds();
+        rasterizer.rasterize(rays, scene, w, h);
+        raster += getSeconds() - raster_begin;
+        rasterizer.render(rays, scene, trace_fn, settings, w, h, pixels.data());
     }
-    Vec3 copy() const {
-        return *this;
+    // render() rasterizes again, take that out of the frame time
+    double time = (getSeconds() - begin - raster)*1000.0/frames;
+
+    int mismatches = 0;
+    for(int i = 0; i < w*h; i++) {
+        mismatches += pixels[i] != reference[i];
     }
-};
+    std::cout << "Raster visibility, " << w << "x" << h << ", " << scene.getBalls().size() << " balls: traced " << full << " ms, hybrid "
+              << time << " ms (" << full/time << "x), visibility pass " << raster*1000.0/frames << " ms, "
+              << rasterizer.getAverageBin() << " balls/bin, " << mismatches << " pixels differ" << std::endl;
+}
 
-class Ray {
-private:
-    Vec3 pos;
-    Vec3 dir;
-public:
-    Ray() : pos(Vec3()), dir(Vec3()) {}
-    Ray(Vec3 pos, Vec3 dir) : pos(pos), dir(dir) {}
+// Frame time with and without per tile lists for the primary rays
+void benchmarkTileCulling(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    std::vector<uint32_t> reference(w*h), pixels(w*h);
+    TraceFn trace_fn = selectTrace(scene, settings);
 
-    const Vec3 getPos() const{
-        return pos;
+    double begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        renderFrame(rays, scene, trace_fn, settings, w, h, reference.data());
     }
-    const Vec3 getDir() const{
-        return dir;
+    double full = (getSeconds() - begin)*1000.0/frames;
+
+    std::cout << "Tile culling, " << w << "x" << h << ", " << scene.getBalls().size() << " balls, full " << full << " ms" << std::endl;
+    const int sizes[] = {8, 16, 32};
+    for(int size : sizes) {
+        TileCuller tiles(size);
+        double cull = 0.0;
+        begin = getSeconds();
+        for(int i = 0; i < frames; i++) {
+            double cull_begin = getSeconds();
+            tiles.build(scene, w, h);
+            cull += getSeconds() - cull_begin;
+            renderFrame(rays, scene, trace_fn, settings, w, h, pixels.data(), nullptr, &tiles);
+        }
+        double time = (getSeconds() - begin)*1000.0/frames;
+        int mismatches = 0;
+        for(int i = 0; i < w*h; i++) {
+            mismatches += pixels[i] != reference[i];
+        }
+        std::cout << "  " << size << "x" << size << " tiles: " << tiles.getAverageLength() << " balls/tile, pre-pass "
+                  << cull*1000.0/frames << " ms, frame " << time << " ms (" << full/time << "x), "
+                  << mismatches << " pixels differ" << std::endl;
     }
-    void setPos(const Vec3 pos) {
-        this->pos = pos;
+
+    // Per light shadow occluder lists on top of the 16x16 primary lists
+    TileCuller tiles(16, true);
+    tiles.build(scene, w, h);
+    begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        tiles.build(scene, w, h);
+        renderFrame(rays, scene, trace_fn, settings, w, h, pixels.data(), nullptr, &tiles);
     }
-    void setDir(const Vec3 dir) {
-        this->dir = dir;
+    double time = (getSeconds() - begin)*1000.0/frames;
+    int mismatches = 0;
+    for(int i = 0; i < w*h; i++) {
+        mismatches += pixels[i] != reference[i];
     }
-};
 
-class Material {
-private:
-    Vec3 color;
-    float roughness;
-public:
-    Material(Vec3 color, float roughness) : color(color), roughness(roughness) {}
+    // Average shadow list length over the tiles
+    std::vector<uint32_t> shadow_balls;
+    std::vector<TileList> shadow_lists;
+    std::vector<VisibilityHit> hits;
+    double total = 0.0;
+    int count = 0;
+    for(int y = 0; y < h; y += 16) {
+        for(int x = 0; x < w; x += 16) {
+            Vec3 min, max;
+            tiles.getHits(rays, scene, w, h, x, y, hits);
+            if(!tiles.getHitBounds(rays, hits, w, h, x, y, min, max)) continue;
+            tiles.buildShadowLists(scene, min, max, shadow_balls, shadow_lists);
+            for(const auto& l : shadow_lists) {
+                total += l.count;
+                count++;
+            }
+        }
+    }
+    std::cout << "  16x16 tiles with shadow lists: " << (count > 0 ? total/count : 0.0) << " occluders/light/tile, frame "
+              << time << " ms (" << full/time << "x), " << mismatches << " pixels differ" << std::endl;
+}
 
-    Material() : color(Vec3()), roughness(0) {}
+// A stereo pair around camera plus two monitoring views: one turned to the
+// side and one from above. The camera can only turn around the y axis, so
+// the upper view looks the same way as the eyes.
+std::vector<Camera> monitorViews(const Camera &camera) {
+    Vec3 dir = camera.getDir();
+    Vec3 right = Vec3(dir.z, 0.0f, -dir.x);
+    right.normalize();
+    return {Camera(camera.getPos() - right*0.1f, dir, camera.getFov()),
+            Camera(camera.getPos() + right*0.1f, dir, camera.getFov()),
+            Camera(camera.getPos(), right, camera.getFov()),
+            Camera(camera.getPos() + Vec3(0.0f, 3.0f, 0.0f), dir, camera.getFov())};
+}
 
-    float getRoughness() {
-        return roughness;
+// Four monitorViews() one by one against a single renderViews() call
+void benchmarkViews(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Camera> cameras = monitorViews(scene.getCamera());
+    int n = cameras.size();
+    std::vector<std::vector<uint32_t>> reference(n, std::vector<uint32_t>(w*h)), pixels(n, std::vector<uint32_t>(w*h));
+    std::vector<RenderContext> views, reference_views;
+    for(int v = 0; v < n; v++) {
+        reference_views.push_back(RenderContext(scene, cameras[v], w, h, reference[v].data()));
+        views.push_back(RenderContext(scene, cameras[v], w, h, pixels[v].data()));
     }
-    const Vec3 &getColor() const{
-        return color;
+    Renderer renderer(settings);
+
+    double begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        for(const auto& view : reference_views) {
+            renderer.render(view);
+        }
     }
-};
+    double separate = (getSeconds() - begin)*1000.0/frames;
 
-class Ball {
-private:
-    Vec3 pos;
-    Material material;
-    float radius;
-public:
-    Ball(Vec3 pos, Material material, float radius) :
-        pos(pos), material(material), radius(radius) {}
-
-    Ball() : pos(Vec3()), material(Material()), radius(0) {}
-    
-    const Vec3 &getPos() const{
-        return pos;
-    }
-    const float getRadius() const{
-        return radius;
-    }
-    const Material &getMaterial() const{
-        return material;
-    }
-    const bool intersect(const Ray &in, float &distance) const {
-        Vec3 L = in.getPos() - pos;
-        Vec3 dir = in.getDir().copy();
-        dir.normalize();
-        float a = dir.dotProduct(dir);
-        float b = 2.0*dir.dotProduct(L);
-        float c = L.dotProduct(L) - radius*radius;
-
-        float discriminant = b*b - 4*a*c;
-        if(discriminant <= 0.0f) return false;
-
-        float root = sqrt(discriminant);
-        float t0 = (-b + root)/(2*a);
-        float t1 = (-b - root)/(2*a);
-        float t = (t0 < t1) ? t0 : t1;
-
-        if(t<0) return false;
-        distance = t;
-        return true;
-    }
-    const Vec3 getNormal(const Vec3 &point) const{
-        Vec3 normal = point - pos;
-        normal.normalize();
-        return normal;
-    }
-    const Vec3 getMirrored(const Vec3 &dir, const Vec3 &point) const {
-        Vec3 in = (-1)*(dir.copy());
-        in.normalize();
-        Vec3 normal = this->getNormal(point);
-        Vec3 projection = normal.dotProduct(in)*normal;
-        Vec3 mirrored = projection + projection - in;
-        return mirrored;
+    begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        renderer.renderViews(views);
     }
-};
+    double batched = (getSeconds() - begin)*1000.0/frames;
 
-class Light {
-private:
-    Vec3 pos;
-    Vec3 color;
-    float brightness;
-public:
-    Light(Vec3 pos) :
-        pos(pos), color(Vec3(1.0f)), brightness(1.0f) {}
-    Light(Vec3 pos, Vec3 color, float brightness) :
-        pos(pos), color(color), brightness(brightness) {}
-
-    const Vec3 &getPos() const{
-        return pos;
-    }
-    const Vec3 &getColor() const{
-        return color;
-    }
-    void rotate() {
-        // Rotation matrix
-        float cosalpha = cosf(0.03f);
-        float sinalpha = sinf(0.03f);
-        float temp_x = pos.x;
-        float temp_z = pos.z;
-        pos.x = temp_x*cosalpha + temp_z*sinalpha;
-        pos.z = -temp_x*sinalpha + temp_z*cosalpha;
+    // The stereo pair alone
+    std::vector<RenderContext> stereo(views.begin(), views.begin() + 2);
+    begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        renderer.renderViews(stereo);
     }
-};
+    double pair = (getSeconds() - begin)*1000.0/frames;
+    begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        renderer.render(reference_views[0]);
+        renderer.render(reference_views[1]);
+    }
+    double pair_separate = (getSeconds() - begin)*1000.0/frames;
 
-class Camera {
-private:
-    Vec3 pos;
-    Vec3 dir;
-    float fov;
-public:
-    Camera(Vec3 pos, Vec3 dir, float fov) :
-        pos(pos), dir(dir), fov(fov) {}
-
-    const Vec3 &getPos() const{
-        return pos;
-    }
-    const Vec3 &getDir() const {
-        return dir;
-    }
-    const float getFov() const {
-        return fov;
-    }
-    void move(Vec3 amount) {
-        float cosalpha = cosf(0.006f);
-        float sinalpha = sinf(0.006f);
-
-        // Rotate direction
-        float temp_x = dir.x;
-        float temp_z = dir.z;
-        dir.x = temp_x*cosalpha + temp_z*sinalpha;
-        dir.z = -temp_x*sinalpha + temp_z*cosalpha;
-
-        cosalpha = cosf(-0.006f);
-        sinalpha = sinf(-0.006f);
-
-        //Rotate position around y-axis
-        /*
-        temp_x = pos.x;
-        temp_z = pos.z;
-        pos.x = temp_x*cosalpha + temp_z*sinalpha;
-        pos.z = -temp_x*sinalpha + temp_z*cosalpha;
-        */
-        return;
+    int mismatches = 0;
+    for(int v = 0; v < n; v++) {
+        for(int i = 0; i < w*h; i++) {
+            mismatches += pixels[v][i] != reference[v][i];
+        }
     }
-};
+    std::cout << "Multi-view, " << n << " views of " << w << "x" << h << ", " << scene.getBalls().size() << " balls" << std::endl;
+    std::cout << "  one by one " << separate << " ms, batched " << batched << " ms (" << separate/batched << "x)" << std::endl;
+    std::cout << "  stereo pair one by one " << pair_separate << " ms, batched " << pair << " ms (" << pair_separate/pair << "x)" << std::endl;
+    std::cout << "  " << mismatches << " pixels differ" << std::endl;
+}
 
-class Scene {
-private:
-    std::vector<Ball> balls;
-    std::vector<Light> lights;
-    Camera camera;
-public:
-    Scene(Camera camera) : camera(camera) {}
+// Jobs per second of many small scenes rendered one after another with
+// pixel parallel frames against BatchRenderer
+void benchmarkBatch(const RenderSettings &settings, int balls, uint32_t seed, int w, int h, int count) {
+    std::vector<BatchJob> jobs;
+    std::vector<uint32_t> images((size_t)count*w*h), reference((size_t)count*w*h);
+    for(int i = 0; i < count; i++) {
+        jobs.push_back({seed + i, balls + i % 8, 0, i % 30, w, h, images.data() + (size_t)i*w*h});
+    }
+    RenderSettings job_settings = settings;
+    job_settings.bvh = nullptr;
+    job_settings.instances = nullptr;
+    job_settings.lod = nullptr;
 
-    const std::vector<Ball> &getBalls() const {
-        return balls;
+    std::vector<double> latencies;
+    std::vector<Ray> rays;
+    double begin = getSeconds();
+    for(const auto& job : jobs) {
+        double job_begin = getSeconds();
+        Scene scene = setupScene(job.balls, job.seed).atFrame(job.frame);
+        computeRays(rays, w, h, scene.getCamera());
+        renderFrame(rays, scene, selectTrace(scene, job_settings), job_settings, w, h, reference.data() + (job.pixels - images.data()));
+        latencies.push_back(getSeconds() - job_begin);
     }
-    void addBall(Ball ball) {
-        balls.push_back(ball);
+    double serial = getSeconds() - begin;
+    std::sort(latencies.begin(), latencies.end());
+
+    BatchRenderer batch(job_settings);
+    batch.render(jobs);
+    int mismatches = 0;
+    for(size_t i = 0; i < images.size(); i++) {
+        mismatches += images[i] != reference[i];
     }
-    const std::vector<Light> &getLights() const {
-        return lights;
+
+    std::cout << "Batch, " << count << " scenes of " << w << "x" << h << ", " << omp_get_max_threads() << " threads" << std::endl;
+    std::cout << "  frame by frame: " << count/serial << " jobs/s, latency p50 " << latencies[count/2]*1000.0
+              << " ms, p99 " << latencies[std::min(count - 1, count*99/100)]*1000.0 << " ms" << std::endl;
+    std::cout << "  batch: " << batch.getJobsPerSecond() << " jobs/s (" << batch.getJobsPerSecond()*serial/count << "x), latency p50 "
+              << batch.getLatency(0.5)*1000.0 << " ms, p99 " << batch.getLatency(0.99)*1000.0 << " ms, "
+              << mismatches << " pixels differ" << std::endl;
+}
+
+// Memory and closest hit speed of instancing against the same balls stored one by one
+void benchmarkInstances(const Scene &scene, int w, int h) {
+    if(scene.getInstances().empty()) {
+        std::cout << "Instancing: no instances, use --instances N" << std::endl;
+        return;
     }
-    void addLight(Light light) {
-        lights.push_back(light);
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    int n = rays.size();
+
+    // Flattened copy, numbered like Scene::getBall()
+    std::vector<Ball> flat;
+    for(int i = 0; i < scene.getBallCount(); i++) {
+        flat.push_back(scene.getBall(i));
     }
-    const Camera &getCamera() const {
-        return camera;
+    SphereBVH flat_bvh;
+    flat_bvh.build(flat);
+    SphereBVH bvh;
+    bvh.build(scene.getBalls());
+    InstanceBVH instance_bvh;
+    instance_bvh.build(scene);
+
+    size_t cluster_bytes = 0;
+    for(const auto& cluster : scene.getClusters()) {
+        cluster_bytes += cluster.size()*sizeof(Ball);
     }
-    void update() {
-        for(Light &light : lights) {
-            light.rotate();
-        }
-        //this->camera.move(Vec3(0.0f, 0.0f, 0.05f));
+    size_t flat_bytes = flat.size()*sizeof(Ball) + flat_bvh.getNodeBytes() + flat_bvh.getSphereBytes();
+    size_t instanced_bytes = scene.getBalls().size()*sizeof(Ball) + bvh.getNodeBytes() + bvh.getSphereBytes()
+                           + cluster_bytes + instance_bvh.getBytes();
+
+    std::vector<int> reference(n);
+    double begin = getSeconds();
+#pragma omp parallel for schedule(guided)
+    for(int i = 0; i < n; i++) {
+        float distance;
+        reference[i] = flat_bvh.closestHit(rays[i], distance);
     }
-};
+    double flat_time = getSeconds() - begin;
 
-const Scene setupScene(const int ballsmax) {
-    float fov = 45.0f;
-    Camera camera = Camera(Vec3(0.0f, 0.0f, -2.0f),Vec3(1.0f, 0.0f, 0.0f),fov);
-    Scene scene = Scene(camera);
-
-    // Create balls
-    float k = 1.0f / (static_cast <float> (RAND_MAX));
-    float x, y, z, r, g, b, radius;
-    for(int i = 0; i < ballsmax; i++) {
-        x = (static_cast <float> (rand()) * k * 20) - 10;
-        y = (static_cast <float> (rand()) * k * 12) - 7.5;
-        z = (static_cast <float> (rand()) * k * 20) - 10;
-        r = (static_cast <float> (rand()) * k);
-        g = (static_cast <float> (rand()) * k);
-        b = (static_cast <float> (rand()) * k);
-        radius = (static_cast <float> (rand()) * k * 3);
-
-        Vec3 color = Vec3(r, g, b);
-        Material material = Material(color, 1.0f);
-        Vec3 pos = Vec3(x, y, z);
-        Ball ball = Ball(pos,material,radius);
-        scene.addBall(ball);
-    }
-
-    // Red ball
-    Vec3 ball_color = Vec3(0.9f, 0.2f, 0.2f);
-    Material material = Material(ball_color, 1.0f);
-    Vec3 ball_pos = Vec3(4.0f, 1.0f, 8.0f);
-    Ball ball = Ball(ball_pos,material,1.0f);
-    scene.addBall(ball);
-
-    // Green ball
-    ball_color = Vec3(0.3f, 0.9f, 0.4f);
-    material = Material(ball_color, 1.0f);
-    ball_pos = Vec3(7.0f, 4.0f, 21.0f);
-    ball = Ball(ball_pos,material,10.0f);
-    scene.addBall(ball);
-
-    // Blue ball
-    ball_color = Vec3(0.2f, 0.2f, 0.9f);
-    material = Material(ball_color, 1.0f);
-    ball_pos = Vec3(50.0f, -1.0f, 00.0f);
-    ball = Ball(ball_pos,material,4.0f);
-    scene.addBall(ball);
-
-    // Light 1
-    Vec3 pos = Vec3(100.0f, 140.0f, 200.0f);
-    Vec3 color = Vec3(1.0f);
-    float brightness = 1.0f;
-    Light light = Light(pos, color, brightness);
-    scene.addLight(light);
-
-    return scene;
-}
+    int mismatches = 0;
+    begin = getSeconds();
+#pragma omp parallel for schedule(guided) reduction(+:mismatches)
+    for(int i = 0; i < n; i++) {
+        float distance;
+        if(closestBall(rays[i], scene, distance, &bvh, &instance_bvh) != reference[i]) mismatches++;
+    }
+    double instanced_time = getSeconds() - begin;
 
-float vectorAngle(float x, float y) {
-    if (x == 0) // special cases
-        return (y > 0)? 0.5f*M_PI
-            : (y == 0)? 0.0f
-            : 1.5f*M_PI;
-    else if (y == 0) // special cases
-        return (x >= 0)? 0.0f
-            : (float)M_PI;
-    float ret = atanf((float)y/x);
-    if (x < 0 && y < 0) // quadrant Ⅲ
-        ret = M_PI + ret;
-    else if (x < 0) // quadrant Ⅱ
-        ret = M_PI + ret; // it actually substracts
-    else if (y < 0) // quadrant Ⅳ
-        ret = 1.5f*M_PI + (0.5f*M_PI + ret); // it actually substracts
-    return ret;
+    std::cout << "Instancing, " << scene.getInstances().size() << " instances of " << scene.getClusters().size() << " clusters, "
+              << scene.getBallCount() << " balls in total" << std::endl;
+    std::cout << "  flat: " << flat_bytes/1024.0 << " KB, closest hit " << n/flat_time*1e-6 << " Mrays/s" << std::endl;
+    std::cout << "  instanced: " << instanced_bytes/1024.0 << " KB (" << (double)flat_bytes/instanced_bytes << "x smaller), closest hit "
+              << n/instanced_time*1e-6 << " Mrays/s, " << mismatches << " mismatches" << std::endl;
 }
 
-void computeRays(std::vector<Ray> &rays, int w, int h, Camera camera) {
-    float fov = camera.getFov();
-    Vec3 cam_dir = camera.getDir();
-    Vec3 cam_pos = camera.getPos();
-    float z = h/tanf(fov/180*M_PI)*0.5f;
-    rays.clear();
+// Memory and traversal speed of the tree layouts against testing every ball
+void benchmarkBVH(const Scene &scene, int w, int h) {
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    const auto& balls = scene.getBalls();
+    const Vec3 light_pos = scene.getLights().empty() ? Vec3(0.0f, 1000.0f, 0.0f) : scene.getLights()[0].getPos();
+    int n = rays.size();
+
+    // Primary hits give the shadow ray origins
+    std::vector<int> reference(n);
+    std::vector<Vec3> points;
+    {
+        SphereBVH bvh(BVH_WIDE);
+        bvh.build(balls);
+        for(int i = 0; i < n; i++) {
+            float distance;
+            reference[i] = bvh.closestHit(rays[i], distance);
+            if(reference[i] >= 0)
+                points.push_back(distance*rays[i].getDir() + rays[i].getPos());
+        }
+    }
 
-    float alpha = vectorAngle(cam_dir.x, cam_dir.z);  //(float)atanf(cam_dir.z/cam_dir.x);
-    float cosalpha = cosf(alpha);
-    float sinalpha = sinf(alpha);
+    std::cout << "BVH, " << balls.size() << " balls, " << n << " primary and " << points.size() << " shadow rays" << std::endl;
+    std::cout << "  sizeof(Ball) " << sizeof(Ball) << ", sizeof(SphereRecord) " << sizeof(SphereRecord)
+              << ", sizeof(WideNode) " << sizeof(WideNode) << ", sizeof(QuantizedNode) " << sizeof(QuantizedNode) << std::endl;
 
+    if(balls.size() <= 5000) {
+        double begin = getSeconds();
+        float distance;
+        long long hits = 0;
+        for(int i = 0; i < n; i++) {
+            hits += closestBall(rays[i], scene, distance) >= 0;
+        }
+        double time = getSeconds() - begin;
+        std::cout << "  linear: " << sizeof(Ball) << " bytes/sphere, closest hit " << n/time*1e-6 << " Mrays/s, "
+                  << hits << " hits" << std::endl;
+    }
 
-    for(int y = 0; y < h; y++) {
-        for(int x = 0; x < w; x++) {
-            Vec3 dir = Vec3((float)x+0.5f-w*0.5f, -((float)y+0.5f-h*0.5f), z);
-            dir.normalize();
+    // The adopted tree holds the only copy of the balls, in tree order
+    const BVHLayout layouts[] = {BVH_WIDE, BVH_COMPACT, BVH_COMPACT};
+    const char *const names[] = {"wide", "compact", "compact adopted"};
+    double base_closest = 0.0;
+    double base_any = 0.0;
+    for(int l = 0; l < 3; l++) {
+        SphereBVH bvh(layouts[l]);
+        Scene owner = scene;
+        double begin = getSeconds();
+        if(l == 2)
+            bvh.adopt(owner);
+        else
+            bvh.build(balls);
+        double build_time = getSeconds() - begin;
+
+        // Adopting renumbers the balls, so compare the balls themselves
+        int mismatches = 0;
+        begin = getSeconds();
+#pragma omp parallel for schedule(guided) reduction(+:mismatches)
+        for(int i = 0; i < n; i++) {
+            float distance;
+            int hit = bvh.closestHit(rays[i], distance);
+            if((hit < 0) != (reference[i] < 0) || (hit >= 0 && (owner.getBall(hit).getPos() - balls[reference[i]].getPos()).getLength() > 0.0f))
+                mismatches++;
+        }
+        double closest_time = getSeconds() - begin;
 
-            float temp_x = dir.x;
-            float temp_z = dir.z;
-            dir.x = temp_x*cosalpha + temp_z*sinalpha;
-            dir.z = -temp_x*sinalpha + temp_z*cosalpha;   
+        long long occluded = 0;
+        begin = getSeconds();
+#pragma omp parallel for schedule(guided) reduction(+:occluded)
+        for(int i = 0; i < (int)points.size(); i++) {
+            occluded += bvh.anyHit(Ray(points[i], light_pos - points[i]));
+        }
+        double any_time = getSeconds() - begin;
 
-            Ray ray = Ray(cam_pos,dir);
-            rays.push_back(ray);
+        if(l == 0) {
+            base_closest = closest_time;
+            base_any = any_time;
         }
+        // Ball records the scene still keeps count too
+        double per_sphere = (double)(owner.getBalls().size()*sizeof(Ball) + bvh.getNodeBytes() + bvh.getSphereBytes())/balls.size();
+        std::cout << "  " << names[l] << ": " << per_sphere << " bytes/sphere with the scene balls ("
+                  << (double)bvh.getNodeBytes()/balls.size() << " nodes, " << (double)bvh.getSphereBytes()/balls.size()
+                  << " tree spheres), build " << build_time*1000.0 << " ms"
+                  << ", closest hit " << n/closest_time*1e-6 << " Mrays/s (" << base_closest/closest_time << "x)"
+                  << ", any hit " << points.size()/any_time*1e-6 << " Mrays/s (" << base_any/any_time << "x)"
+                  << ", " << mismatches << " mismatches" << std::endl;
     }
 }
 
-void moveRays(std::vector<Ray> &rays, Camera camera) {
-    Vec3 cam_dir = camera.getDir();
-    Vec3 cam_pos = camera.getPos();
+// Frame time and quality of the level of detail proxies against exact
+// hits from the BVH, and the share of primary rays that end on a proxy
+void benchmarkLOD(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    std::vector<uint32_t> reference(w*h), pixels(w*h);
+
+    SphereBVH bvh(BVH_WIDE);
+    bvh.build(scene.getBalls());
+    RenderSettings exact = settings;
+    exact.bvh = &bvh;
+    exact.lod = nullptr;
+    TraceFn trace_fn = selectTrace(scene, exact);
+    double begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        renderFrame(rays, scene, trace_fn, exact, w, h, reference.data());
+    }
+    double exact_time = (getSeconds() - begin)*1000.0/frames;
 
-    //float alpha = vectorAngle(cam_dir.x, cam_dir.z);  //(float)atanf(cam_dir.z/cam_dir.x);
-    float alpha = 0.05f;
-    float cosalpha = cosf(alpha);
-    float sinalpha = sinf(alpha);
+    // Primary closest hits alone
+    begin = getSeconds();
+    int hits = 0;
+#pragma omp parallel for schedule(guided) reduction(+:hits)
+    for(int i = 0; i < w*h; i++) {
+        float distance;
+        hits += bvh.closestHit(rays[i], distance) >= 0;
+    }
+    double exact_hits = getSeconds() - begin;
+
+    SphereLOD lod;
+    begin = getSeconds();
+    lod.build(scene.getBalls());
+    double build_time = (getSeconds() - begin)*1000.0;
+    lod.setView(scene.getCamera(), h);
+    std::cout << "  " << scene.getBalls().size() << " balls: exact " << exact_time << " ms, primary hits "
+              << w*h/exact_hits*1e-6 << " Mrays/s, build " << build_time << " ms, " << lod.getNodeCount() << " nodes" << std::endl;
+
+    const float scales[] = {0.0f, 1.0f, 2.0f, 4.0f};
+    for(float scale : scales) {
+        lod.setScale(scale);
+        RenderSettings lod_settings = exact;
+        lod_settings.lod = &lod;
+        TraceFn lod_fn = selectTrace(scene, lod_settings);
+        begin = getSeconds();
+        for(int i = 0; i < frames; i++) {
+            renderFrame(rays, scene, lod_fn, lod_settings, w, h, pixels.data());
+        }
+        double time = (getSeconds() - begin)*1000.0/frames;
+
+        begin = getSeconds();
+        int proxies = 0;
+#pragma omp parallel for schedule(guided) reduction(+:proxies)
+        for(int i = 0; i < w*h; i++) {
+            float distance;
+            int index;
+            bool proxy = false;
+            if(lod.closestHit(rays[i], 0.0f, distance, index, &proxy) != nullptr && proxy)
+                proxies++;
+        }
+        double lod_hits = getSeconds() - begin;
+        std::cout << "    scale " << scale << ": " << time << " ms (" << exact_time/time << "x), primary hits "
+                  << w*h/lod_hits*1e-6 << " Mrays/s (" << exact_hits/lod_hits << "x), "
+                  << proxies*100.0/(w*h) << "% of primary rays on proxies, PSNR "
+                  << computePSNR(reference.data(), pixels.data(), w*h) << " dB" << std::endl;
+    }
+}
 
+// benchmarkLOD() on the scene, and on a cloud of count small balls far in
+// front of its camera, lit by its lights, with many balls to every pixel
+void benchmarkLOD(const Scene &scene, const RenderSettings &settings, int w, int h, int frames, uint32_t seed, int count) {
+    std::cout << "LOD, " << w << "x" << h << std::endl;
+    benchmarkLOD(scene, settings, w, h, frames);
 
-    for(int i = 0; i < rays.size(); i++) {
-        // Rotate
-        Ray ray = rays[i];
-        Vec3 dir = ray.getDir();
-        float temp_x = dir.x;
-        float temp_z = dir.z;
-        dir.x = temp_x*cosalpha + temp_z*sinalpha;
-        dir.z = -temp_x*sinalpha + temp_z*cosalpha;   
+    // An 80 x 40 x 20 box 100 units along the centre ray
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    const Ray &centre = rays[h/2*w + w/2];
+    Vec3 center = centre.getPos() + 100.0f*centre.getDir();
+    Scene cloud = Scene(scene.getCamera());
+    for(const Light &light : scene.getLights()) {
+        cloud.addLight(light);
+    }
+    for(int i = 0; i < count; i++) {
+        uint32_t base = hashRandom(seed ^ 0x85ebca6bu) + i*7;
+        Vec3 pos = center + Vec3(hashFloat(base)*80 - 40, hashFloat(base + 1)*40 - 20, hashFloat(base + 2)*20 - 10);
+        Vec3 color = Vec3(hashFloat(base + 3), hashFloat(base + 4), hashFloat(base + 5));
+        cloud.addBall(Ball(pos, Material(color, 1.0f), 0.02f + hashFloat(base + 6)*0.04f));
+    }
+    benchmarkLOD(cloud, settings, w, h, frames);
+}
 
-        rays[i].setPos(cam_pos);
-        rays[i].setDir(dir);// = Ray(cam_pos,dir);
+// Cost of edge anti-aliasing compared to a single sample frame
+void benchmarkAntiAlias(const Scene &scene, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    std::vector<uint32_t> pixels(w*h);
+    std::vector<int> ball_ids(w*h);
+    TraceFn trace_fn = selectTrace(scene, settings);
+
+    double begin = getSeconds();
+    for(int i = 0; i < frames; i++) {
+        renderFrame(rays, scene, trace_fn, settings, w, h, pixels.data());
+    }
+    double single = (getSeconds() - begin)*1000.0/frames;
+
+    std::cout << "Edge anti-aliasing, " << w << "x" << h << ", single sample " << single << " ms" << std::endl;
+    const int sample_counts[] = {4, 9, 16};
+    for(int samples : sample_counts) {
+        AntiAliasSettings aa_settings;
+        aa_settings.samples = samples;
+        AdaptiveAntiAliaser aa(aa_settings);
+        begin = getSeconds();
+        for(int i = 0; i < frames; i++) {
+            renderFrame(rays, scene, trace_fn, settings, w, h, pixels.data(), ball_ids.data());
+            aa.apply(scene, trace_fn, settings, w, h, ball_ids.data(), pixels.data());
+        }
+        double time = (getSeconds() - begin)*1000.0/frames;
+        std::cout << "  " << samples << " samples: " << aa.getSupersampledFraction()*100.0 << "% pixels supersampled, "
+                  << aa.getSampleRatio() << "x primary samples, " << time << " ms (" << time/single << "x)" << std::endl;
     }
 }
 
-std::vector<Vec3> computeRayDirs(int w, int h, Camera camera) {
-    std::vector<Vec3> ray_dirs;
-    float fov = camera.getFov();
-    Vec3 dir = camera.getDir();
-    float z = h/tanf(fov/180*M_PI)*0.5f;
+// Appends one frame to a Y4M stream as 8-bit BT.601 4:4:4 planes
+void writeY4MFrame(FILE *out, const uint32_t *pixels, int w, int h, std::vector<uint8_t> &planes) {
+    int n = w*h;
+    planes.resize(3*n);
+    for(int i = 0; i < n; i++) {
+        float r = (pixels[i] >> 16) & 0xff;
+        float g = (pixels[i] >> 8) & 0xff;
+        float b = pixels[i] & 0xff;
+        planes[i]       = (uint8_t)(16.5f + 0.2568f*r + 0.5041f*g + 0.0979f*b);
+        planes[n + i]   = (uint8_t)(128.5f - 0.1482f*r - 0.2910f*g + 0.4392f*b);
+        planes[2*n + i] = (uint8_t)(128.5f + 0.4392f*r - 0.3678f*g - 0.0714f*b);
+    }
+    fputs("FRAME\n", out);
+    fwrite(planes.data(), 1, planes.size(), out);
+}
 
-    for(int y = 0; y < h; y++) {
-        for(int x = 0; x < w; x++) {
-            Vec3 dir = Vec3((float)x+0.5f-w*0.5f, -((float)y+0.5f-h*0.5f), z);
-            dir.normalize();
+// Renders frames [first, last) of the light animation to a Y4M stream and/or
+// a shared memory frame ring. Only the frames in flight are kept in memory.
+// Small frames are rendered several at a time, one per thread, since a
+// single small frame keeps few threads busy.
+bool renderAnimation(const Scene &scene, const RenderSettings &settings, int w, int h, int first, int last, FILE *out, FrameRing *ring = nullptr) {
+    int threads = omp_get_max_threads();
+    bool frame_parallel = threads > 1 && w*h <= 256*256;
+    int group = frame_parallel ? threads : 1;
 
-            Vec3 ray_dir = dir;
-            ray_dirs.push_back(ray_dir);
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    TraceFn trace_fn = selectTrace(scene, settings);
+    std::vector<std::vector<uint32_t>> frames(group, std::vector<uint32_t>(w*h));
+    std::vector<uint8_t> planes;
+
+    if(out != nullptr)
+        fprintf(out, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444\n", w, h);
+    double begin = getSeconds();
+    for(int frame = first; frame < last; frame += group) {
+        int count = std::min(group, last - frame);
+        if(frame_parallel) {
+#pragma omp parallel for schedule(dynamic)
+            for(int i = 0; i < count; i++) {
+                renderFrame(rays, scene.atFrame(frame + i), trace_fn, settings, w, h, frames[i].data());
+            }
+        } else {
+            renderFrame(rays, scene.atFrame(frame), trace_fn, settings, w, h, frames[0].data());
         }
+        for(int i = 0; i < count; i++) {
+            if(out != nullptr)
+                writeY4MFrame(out, frames[i].data(), w, h, planes);
+            if(ring != nullptr)
+                ring->publish(frames[i].data());
+        }
+        if(out != nullptr && ferror(out))
+            return false;
     }
-    return ray_dirs;
+    if(out != nullptr)
+        fflush(out);
+    double time = getSeconds() - begin;
+    std::cerr << "Rendered " << last - first << " frames in " << time << " s ("
+              << (last - first)/time << " frames/s, " << (frame_parallel ? "frame" : "pixel") << " parallel)" << std::endl;
+    return true;
 }
 
-void rotateRayDirections(std::vector<Vec3> &ray_dirs, float theta) {
-    float cosalpha = cosf(theta);
-    float sinalpha = sinf(theta);
-    for(Vec3 &dir : ray_dirs) {
-        float temp_x = dir.x;
-        float temp_z = dir.z;
-        float x = temp_x*cosalpha + temp_z*sinalpha;
-        float z = -temp_x*sinalpha + temp_z*cosalpha;
-        float y = dir.y;
-        dir = Vec3(x, y, z);
+// Per frame chunk faults and IO of an animated out-of-core render
+void benchmarkOutOfCore(Scene scene, ChunkStore &store, const RenderSettings &settings, int w, int h, int frames) {
+    std::vector<Ray> rays;
+    computeRays(rays, w, h, scene.getCamera());
+    std::vector<uint32_t> pixels(w*h);
+    OutOfCoreRenderer renderer;
+
+    std::cout << "Out of core, " << w << "x" << h << ", " << store.getSphereCount() << " balls in "
+              << store.getChunkCount() << " chunks, budget " << store.getBudget()/(1024.0*1024.0) << " MB" << std::endl;
+    for(int i = 0; i < frames; i++) {
+        renderer.resetStats(&store);
+        renderer.render(rays, scene, store, settings, w, h, pixels.data());
+        std::cout << "  frame " << i << ": ";
+        renderer.printStats(store);
+        scene.update();
     }
 }
 
-Vec3 computeBackground(const Ray &ray, const Scene &scene) {
-    Vec3 bg = Vec3(0.05f);
-    Vec3 bg_light = Vec3(0.0f); 
-    Vec3 dir = ray.getDir().copy();
-    dir.normalize();
-    float dot = 0.0f;
-    
-    const auto& lights = scene.getLights();
-    for(const auto& light : lights) {
-        Vec3 light_dir = ray.getPos() - light.getPos();
-        light_dir.normalize();
-        float dot_product = light_dir.dotProduct(-dir);
-        if(dot_product > dot) 
-            dot = dot_product;
-    }
-
-    if(dot > 0.991f) {
-        dot = (dot - 0.991)*130;
-        dot = powf(dot,8);
-        bg_light = Vec3(fmin(dot,1.0f),fmin(dot,1.0f),fmin(dot,1.0f));
-    }
-    return Vec3(fmin(bg.x+bg_light.x, 1.0f));
-    
+// Keyboard knobs of the interactive mode: H overlay, B max bounces, S shadows,
+// R resolution scale and T thread count. Returns true if the image changes.
+bool handleKnobs(AE_Display *display, RenderSettings &settings, bool &show_hud, int &scale) {
+    bool changed = false;
+    if(display->keyPressed(SDLK_h)) {
+        show_hud = !show_hud;
+        changed = true;
+    }
+    if(display->keyPressed(SDLK_b)) {
+        // Next bounce count with a specialised pipeline
+        int next = STATIC_BOUNCES[0];
+        for(int bounces : STATIC_BOUNCES) {
+            if(bounces > settings.max_bounces) {
+                next = bounces;
+                break;
+            }
+        }
+        settings.max_bounces = next;
+        changed = true;
+    }
+    if(display->keyPressed(SDLK_s)) {
+        settings.features ^= SHADE_SHADOWS;
+        changed = true;
+    }
+    if(display->keyPressed(SDLK_r)) {
+        scale = scale >= 4 ? 1 : scale*2;
+        changed = true;
+    }
+    if(display->keyPressed(SDLK_t)) {
+        static const int max_threads = omp_get_max_threads();
+        int threads = omp_get_max_threads();
+        omp_set_num_threads(threads > 1 ? threads/2 : max_threads);
+        changed = true;
+    }
+    return changed;
 }
 
-bool checkShadow(const Scene &scene, const Light &light, const Vec3 &pos, Ball ball){
-    //Look for a shadow made by other balls
-    const auto& balls = scene.getBalls();
-    for(const auto& b: balls){
-        float distance;
-        Vec3 dir = light.getPos() - pos;
-
-        
-        /* //Optimization Huom: ota huomioon säteen lähtöpiste!
-        float radius = b.getRadius();
-        Vec3 center = ball.getPos();
-        Vec3 cent = b.getPos();
-        //Decrease amount of the balls by checking the coordinates
-        if(dir.y > 0 && (cent.y + radius - center.y < 0)) 
-            continue; //The ball is below the point and sun is up
-        if(dir.y < 0 && (cent.y - radius - center.y > 0)) 
-            continue; //The ball is on top of the point and sun is down
-        if(dir.x > 0 && (cent.x + radius - center.x < 0)) 
-            continue;
-        if(dir.x < 0 && (cent.x - radius - center.x > 0)) 
-            continue;
-        if(dir.z > 0 && (cent.z + radius - center.z < 0)) 
-            continue;
-        if(dir.z < 0 && (cent.z - radius - center.z > 0)) 
-            continue;
-        //Optimization ends 
-        */
-
-        //A ray from the ball to the light
-        if(b.intersect(Ray(pos, dir), distance)) {
-            return true;
-        }
-    }
-    return false;
-}
+// Overlay text, updated twice a second from the render counters
+class HudStats {
+private:
+    std::vector<std::string> lines;
+    double begin;
+    int frames;
+
+    static std::string format(const char *format, double a, double b = 0.0, double c = 0.0) {
+        char text[64];
+        snprintf(text, sizeof(text), format, a, b, c);
+        return text;
+    }
 
+public:
+    HudStats() : begin(getSeconds()), frames(0) {}
+
+    void update(RenderCounters &counters, const RenderSettings &settings, int w, int h, int scale, bool traced) {
+        frames += traced;
+        double time = getSeconds() - begin;
+        if(time < 0.5 && !lines.empty())
+            return;
+
+        RenderCounters::Counts counts = counters.total();
+        int threads = omp_get_max_threads();
+        long long rays = counts.primary + counts.secondary + counts.shadow;
+        lines.clear();
+        lines.push_back(frames > 0 ? format("FRAME %.1f MS  %.1f FPS", time*1000.0/frames, frames/time) : "FRAME -");
+        lines.push_back(format("RAYS %.2f M/S  SHADOW %.0f%%", rays/time*1e-6, rays > 0 ? 100.0*counts.shadow/rays : 0.0));
+        lines.push_back(format("BOUNCES %.2f PER PIXEL", counts.primary > 0 ? (double)counts.secondary/counts.primary : 0.0));
+        if(counts.busy > 0.0)
+            lines.push_back(format("THREADS %.0f/%.0f  BUSY %.0f%%", threads, omp_get_num_procs(), 100.0*counts.busy/(time*threads)));
+        else
+            lines.push_back(format("THREADS %.0f/%.0f", threads, omp_get_num_procs()));
+        lines.push_back(format("MAX BOUNCES %.0f  SHADOWS ", settings.max_bounces) + ((settings.features & SHADE_SHADOWS) ? "ON" : "OFF")
+                        + format("  %.0fX%.0f (1/%.0f)", w, h, scale));
+        lines.push_back("H HUD B BOUNCES S SHADOWS R SCALE T THREADS");
+
+        counters.reset();
+        begin = getSeconds();
+        frames = 0;
+    }
 
-void computeBrightness(const Ray &ray, const Scene &scene, const Ray &normal_ray, Ball ball, float &specular, float& diffuce) {
-    Vec3 normal     = normal_ray.getDir();
-    Vec3 pos        = normal_ray.getPos();
-    Vec3 dir        = ray.getDir();
-    Vec3 mirrored   = ball.getMirrored(dir, pos);
-    
-    diffuce = 0.0f;
-    specular = 0.0f;
-    
-    const auto& lights = scene.getLights();
-    for(const auto& light : lights) {
-        // Shadow
-        if(checkShadow(scene, light, pos, ball)) continue;
-
-        // Diffuce light
-        Vec3 light_dir = light.getPos() - pos;
-        light_dir.normalize();
-        diffuce =+ normal.dotProduct(light_dir);
-
-        // Specular light
-        specular =+ mirrored.dotProduct(light_dir);
+    const std::vector<std::string> &getLines() const {
+        return lines;
     }
-}
+};
 
-const Vec3 trace(const Ray &ray, const Scene &scene, int bounces) {
-    Ball ball;
-    Ray normal_ray;
+int main(int argc, char* argv[]) {
+    int width = 1280;
+    int height = 720;
 
-    // Find closest intersecting ball
-    float closest_distance = -1;
-    const auto& balls = scene.getBalls();
-    for(const auto& b : balls) {
-        float distance;
-        if(b.intersect(ray, distance)) {
-            if(distance < closest_distance || closest_distance < 0) {
-                closest_distance = distance;
-                ball = b;
-                Vec3 point = distance*(ray.getDir()) + ray.getPos();
-                normal_ray = Ray(point, ball.getNormal(point));
-            }
+    bool wavefront = false;
+    bool benchmark = false;
+    std::string benchmark_name = "all";
+    bool anti_alias = false;
+    bool checkerboard = false;
+    bool animate = true;
+    bool accumulate = true;
+    int accumulate_samples = 64;
+    AntiAliasSettings aa_settings;
+    int shadow_map_resolution = 0;
+    float shadow_map_bias = 0.05f;
+    bool use_bvh = false;
+    BVHLayout bvh_layout = BVH_COMPACT;
+    int sort_batch = 0;
+    int ball_count = 10;
+    int instance_count = 0;
+    bool tile_cull = false;
+    bool shadow_lists = false;
+    bool multi_view = false;
+    bool show_hud = false;
+    bool raster = false;
+    bool reproject = false;
+    bool move_camera = false;
+    float lod_scale = 0.0f;
+    std::string batch_path;
+    double deadline_ms = 0.0;
+    DeadlineOrder deadline_order = DEADLINE_CENTER;
+    std::string shm_name;
+    int shm_slots = 3;
+    int first_frame = 0;
+    int last_frame = -1;
+    std::string output_path = "-";
+    std::string ooc_path;
+    std::string ooc_write_path;
+    int ooc_grid = 0;               // 0 picks about 4096 balls per chunk
+    size_t ooc_budget = 256;        // MB
+    unsigned int seed = time(NULL);
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--wavefront")
+            wavefront = true;
+        else if(arg == "--benchmark")
+            benchmark = true;
+        else if(arg.compare(0, 12, "--benchmark=") == 0) {
+            benchmark = true;
+            benchmark_name = arg.substr(12);
+        }
+        else if(arg == "--checkerboard")
+            checkerboard = true;
+        else if(arg == "--aa" && i + 1 < argc) {
+            anti_alias = true;
+            aa_settings.samples = atoi(argv[++i]);
+        }
+        else if(arg == "--aa-budget" && i + 1 < argc)
+            aa_settings.budget = atof(argv[++i]);
+        else if(arg == "--paused")
+            animate = false;
+        else if(arg == "--idle" && i + 1 < argc)
+            accumulate = std::string(argv[++i]) != "skip";
+        else if(arg == "--accumulate" && i + 1 < argc)
+            accumulate_samples = atoi(argv[++i]);
+        else if(arg == "--shadow-map" && i + 1 < argc)
+            shadow_map_resolution = atoi(argv[++i]);
+        else if(arg == "--shadow-bias" && i + 1 < argc)
+            shadow_map_bias = atof(argv[++i]);
+        else if(arg == "--accel" && i + 1 < argc) {
+            use_bvh = true;
+            bvh_layout = std::string(argv[++i]) == "wide" ? BVH_WIDE : BVH_COMPACT;
         }
+        else if(arg == "--sort-batch" && i + 1 < argc)
+            sort_batch = atoi(argv[++i]);
+        else if(arg == "--frames" && i + 2 < argc) {
+            first_frame = atoi(argv[++i]);
+            last_frame = atoi(argv[++i]);
+        }
+        else if(arg == "--output" && i + 1 < argc)
+            output_path = argv[++i];
+        else if(arg == "--ooc" && i + 1 < argc)
+            ooc_path = argv[++i];
+        else if(arg == "--ooc-write" && i + 1 < argc)
+            ooc_write_path = argv[++i];
+        else if(arg == "--ooc-grid" && i + 1 < argc)
+            ooc_grid = atoi(argv[++i]);
+        else if(arg == "--ooc-budget" && i + 1 < argc)
+            ooc_budget = atoi(argv[++i]);
+        else if(arg == "--shm" && i + 1 < argc)
+            shm_name = argv[++i];
+        else if(arg == "--shm-slots" && i + 1 < argc)
+            shm_slots = std::max(2, atoi(argv[++i]));
+        else if(arg == "--deadline" && i + 1 < argc)
+            deadline_ms = atof(argv[++i]);
+        else if(arg == "--deadline-order" && i + 1 < argc)
+            deadline_order = std::string(argv[++i]) == "changed" ? DEADLINE_CHANGED : DEADLINE_CENTER;
+        else if(arg == "--batch" && i + 1 < argc)
+            batch_path = argv[++i];
+        else if(arg == "--raster")
+            raster = true;
+        else if(arg == "--reproject")
+            reproject = true;
+        else if(arg == "--move-camera")
+            move_camera = true;
+        else if(arg == "--lod" && i + 1 < argc)
+            lod_scale = atof(argv[++i]);
+        else if(arg == "--hud")
+            show_hud = true;
+        else if(arg == "--views")
+            multi_view = true;
+        else if(arg == "--tile-cull")
+            tile_cull = true;
+        else if(arg == "--shadow-lists")
+            tile_cull = shadow_lists = true;
+        else if(arg == "--instances" && i + 1 < argc)
+            instance_count = atoi(argv[++i]);
+        else if(arg == "--balls" && i + 1 < argc)
+            ball_count = atoi(argv[++i]);
+        else if(arg == "--size" && i + 2 < argc) {
+            width = atoi(argv[++i]);
+            height = atoi(argv[++i]);
+        }
+        else
+            seed = atoi(argv[i]);
     }
 
-    // No ball was found -> Draw background
-    if(closest_distance < 0) {
-        return computeBackground(ray, scene);
+    RenderSettings settings;
+    SphereBVH bvh(bvh_layout);
+    if(use_bvh)
+        settings.bvh = &bvh;
+    InstanceBVH instance_bvh(bvh_layout);
+    // With --lod SCALE primary rays and reflections hit proxies of clusters
+    // narrower than SCALE pixels
+    SphereLOD lod(lod_scale);
+    if(lod_scale > 0.0f)
+        settings.lod = &lod;
+    // With --accel compact the tree takes over the plain balls of the scene,
+    // unless a mode reads the scene's Ball records itself
+    bool adopt_balls = use_bvh && bvh_layout == BVH_COMPACT && lod_scale <= 0.0f && !raster && !tile_cull
+                       && !multi_view && ooc_path.empty();
+    auto buildTrees = [&](Scene &scene, bool adopt) {
+        if(use_bvh && adopt)
+            bvh.adopt(scene);
+        else if(use_bvh)
+            bvh.build(scene.getBalls());
+        if(lod_scale > 0.0f) {
+            lod.build(scene.getBalls());
+            lod.setView(scene.getCamera(), height);
+        }
+        settings.instances = nullptr;
+        if(!scene.getInstances().empty()) {
+            instance_bvh.build(scene);
+            settings.instances = &instance_bvh;
+        }
+    };
+
+    // Chunk file with the same balls as setupScene(ball_count, seed)
+    if(!ooc_write_path.empty()) {
+        std::vector<Ball> fixed = setupScene(0, seed).getBalls();
+        auto source = [&](uint64_t i) {
+            return i < (uint64_t)ball_count ? randomBall(seed, i) : fixed[i - ball_count];
+        };
+        if(ooc_grid <= 0)
+            ooc_grid = std::max(1, (int)lround(cbrt(ball_count/4096.0)));
+        if(!writeChunkFile(ooc_write_path, fixed.size() + ball_count, source, Vec3(-10.0f, -7.5f, -10.0f), Vec3(10.0f, 4.5f, 10.0f), ooc_grid)) {
+            std::cout << "Could not write " << ooc_write_path << std::endl;
+            return -1;
+        }
+        if(ooc_path.empty())
+            return 0;
     }
 
-    float specular, diffuce;
-    computeBrightness(ray, scene, normal_ray, ball, specular, diffuce);
-    // Draw color of the point
-    const Vec3 ball_color = 0.25f*(ball.getMaterial().getColor());
-
-    // Phong illumination model
-    Vec3 pixel = ball_color + ball_color*fmax(diffuce,0.0f) + ball_color*fmax(powf(specular,15), 0.0f);
+    // With a chunk store the scene only provides the camera and the lights
+    bool use_ooc = !ooc_path.empty();
+    ChunkStore store(ooc_budget*1024*1024);
+    if(use_ooc) {
+        if(!store.open(ooc_path)) {
+            std::cout << "Could not open " << ooc_path << std::endl;
+            return -1;
+        }
+        anti_alias = false;
+        accumulate = false;
+    }
 
-    if(bounces < 10) {
-        bounces++;
-        Ray new_ray = Ray(normal_ray.getPos(), (ball.getMirrored(ray.getDir(), normal_ray.getPos())));
-        pixel = 0.3f*pixel + 0.6f*trace(new_ray, scene, bounces);
+    if(benchmark && use_ooc) {
+        benchmarkOutOfCore(setupScene(0, seed), store, settings, width, height, 5);
+        return 0;
+    }
+    // Frames for other processes, the window or the headless render below
+    FrameRing ring;
+    if(!shm_name.empty() && !ring.create(shm_name, width, height, shm_slots)) {
+        std::cerr << "Could not create shared memory " << shm_name << std::endl;
+        return -1;
     }
-    return pixel;
-}
 
-unsigned __int64 getTime() {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-}
+    // Headless render of the scenes listed in batch_path to a Y4M stream,
+    // one frame per scene
+    if(!batch_path.empty()) {
+        std::ifstream list(batch_path);
+        if(!list) {
+            std::cerr << "Could not open " << batch_path << std::endl;
+            return -1;
+        }
+        std::vector<BatchJob> jobs;
+        std::string line;
+        while(std::getline(list, line)) {
+            BatchJob job = {0, ball_count, instance_count, 0, width, height, nullptr};
+            if(sscanf(line.c_str(), "%u %d %d %d", &job.seed, &job.balls, &job.instances, &job.frame) >= 1)
+                jobs.push_back(job);
+        }
+        std::vector<uint32_t> images((size_t)jobs.size()*width*height);
+        for(size_t i = 0; i < jobs.size(); i++) {
+            jobs[i].pixels = images.data() + i*width*height;
+        }
+        RenderSettings batch_settings = settings;
+        batch_settings.bvh = nullptr;
+        batch_settings.lod = nullptr;
+        BatchRenderer batch(batch_settings, use_bvh);
+        batch.render(jobs);
+        batch.printStats();
+
+        FILE *out = output_path == "-" ? stdout : fopen(output_path.c_str(), "wb");
+        if(out == nullptr) {
+            std::cerr << "Could not open " << output_path << std::endl;
+            return -1;
+        }
+#ifdef _WIN32
+        if(out == stdout)
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        std::vector<uint8_t> planes;
+        fprintf(out, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444\n", width, height);
+        for(const auto& job : jobs) {
+            writeY4MFrame(out, job.pixels, width, height, planes);
+        }
+        bool ok = !ferror(out);
+        if(out != stdout)
+            fclose(out);
+        return ok ? 0 : -1;
+    }
 
-int main(int argc, char* argv[]) {
-    int width = 1280;
-    int height = 720;
+    // Headless render of frames [first_frame, last_frame) to a file or
+    // stdout, or only to the shared memory ring when no --output is given
+    if(last_frame >= 0) {
+        Scene scene = setupScene(ball_count, seed, instance_count);
+        buildTrees(scene, adopt_balls);
+        FILE *out = stdout;
+        if(output_path != "-") {
+            out = fopen(output_path.c_str(), "wb");
+            if(out == nullptr) {
+                std::cerr << "Could not open " << output_path << std::endl;
+                return -1;
+            }
+        }
+        else if(ring.isOpen())
+            out = nullptr;
+#ifdef _WIN32
+        else
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        bool ok = renderAnimation(scene, settings, width, height, first_frame, last_frame, out, ring.isOpen() ? &ring : nullptr);
+        if(out != nullptr && out != stdout)
+            fclose(out);
+        return ok ? 0 : -1;
+    }
 
-    // Give seed for the randomizer
-    if(argc > 1)
-        srand(atoi(argv[1]));
-    else
-        srand(time(NULL));
+    if(benchmark) {
+        Scene scene = setupScene(ball_count, seed, instance_count);
+        buildTrees(scene, false);
+        if(benchmark_name == "all" || benchmark_name == "coherence")
+            benchmarkCoherence(scene, settings, width, height, 5);
+        if(benchmark_name == "all" || benchmark_name == "aa")
+            benchmarkAntiAlias(scene, settings, width, height, 5);
+        if(benchmark_name == "all" || benchmark_name == "shadowmap")
+            benchmarkShadowMaps(scene, settings, width, height, 5);
+        if(benchmark_name == "all" || benchmark_name == "checkerboard")
+            benchmarkCheckerboard(scene, settings, width, height, 10);
+        if(benchmark_name == "all" || benchmark_name == "bvh")
+            benchmarkBVH(scene, width, height);
+        if(benchmark_name == "all" || benchmark_name == "lod")
+            benchmarkLOD(scene, settings, width, height, 3, seed, 500000);
+        if(benchmark_name == "all" || benchmark_name == "instances")
+            benchmarkInstances(scene, width, height);
+        if(benchmark_name == "all" || benchmark_name == "tilecull")
+            benchmarkTileCulling(scene, settings, width, height, 5);
+        if(benchmark_name == "all" || benchmark_name == "deadline")
+            benchmarkDeadline(scene, settings, width, height, 10);
+        if(benchmark_name == "all" || benchmark_name == "raster")
+            benchmarkRaster(scene, settings, width, height, 5);
+        if(benchmark_name == "all" || benchmark_name == "reproject")
+            benchmarkReprojection(scene, settings, width, height, 10);
+        if(benchmark_name == "all" || benchmark_name == "batch")
+            benchmarkBatch(settings, ball_count, seed, 96, 96, 256);
+        if(benchmark_name == "all" || benchmark_name == "views")
+            benchmarkViews(scene, settings, width/2, height/2, 5);
+        return 0;
+    }
 
     // Create display
     AE_Display* display = new AE_Display();
     if(!display->createWindow("Raytracer",width,height))
         return -1;
 
-    Scene scene = setupScene(10);
+    Scene scene = use_ooc ? setupScene(0, seed) : setupScene(ball_count, seed, instance_count);
     std::vector<Ray> rays;
+    buildTrees(scene, adopt_balls);
+    uint64_t bvh_version = scene.getBallsVersion();
+
+    TraceFn trace_fn = selectTrace(scene, settings);
+    if(trace_fn == traceGeneric)
+        std::cout << "Using generic trace pipeline" << std::endl;
 
     // Fps count
-    unsigned __int64 time_prev = getTime();
-    unsigned __int64 time_now;
+    uint64_t time_prev = getTime();
+    uint64_t time_now;
     float frames = 0.0f;
     computeRays(rays, width, height, scene.getCamera());
 
+    WavefrontRenderer wavefront_renderer;
+    wavefront_renderer.setSortBatch(sort_batch);
+    std::vector<uint32_t> framebuffer(width*height);
+    AdaptiveAntiAliaser anti_aliaser(aa_settings);
+    std::vector<int> ball_ids(width*height);
+    FrameAccumulator accumulator(accumulate_samples);
+    CheckerboardRenderer checkerboard_renderer;
+    OutOfCoreRenderer ooc_renderer;
+    SphereRasterizer rasterizer;
+    ReprojectionCache reprojection;
+    TileCuller tiles(16, shadow_lists);
+    uint64_t tiles_version = -1;
+    ShadowMaps shadow_maps(shadow_map_resolution, shadow_map_bias);
+    if(shadow_map_resolution > 0)
+        settings.shadow_maps = &shadow_maps;
+
+    // With --deadline a frame stops when its time is up, and the rest of it
+    // is traced while the scene stays still
+    DeadlineRenderer deadline_renderer(16, deadline_order);
+    bool deadline_complete = true;
+    if(deadline_ms > 0)
+        anti_alias = false;
+
+    // With --views the window shows monitorViews() in its four quarters
+    Renderer view_renderer(settings);
+    if(multi_view) {
+        anti_alias = false;
+        accumulate = false;
+    }
+
+    // Performance overlay and the knobs it shows, see handleKnobs()
+    Hud hud;
+    RenderCounters counters;
+    HudStats hud_stats;
+    if(show_hud)
+        settings.counters = &counters;
+    view_renderer.setSettings(settings);
+    int scale = 1;
+    int render_w = width;
+    int render_h = height;
+    std::vector<uint32_t> screen;
+
+    // Version of the scene currently on screen
+    bool rendered = false;
+    uint64_t rendered_version = 0;
+    uint64_t rays_version = scene.getCameraVersion();
+
     while(!display->closeRequested()) {
         display->pollEvents();
-        Vec3 camera_pos = scene.getCamera().getPos();
-        
-#pragma omp parallel for schedule(guided)
-        for(int x = 0; x < width; x++) {
+        if(display->keyPressed(SDLK_SPACE))
+            animate = !animate;
+        int old_scale = scale;
+        if(handleKnobs(display, settings, show_hud, scale)) {
+            settings.counters = show_hud ? &counters : nullptr;
+            view_renderer.setSettings(settings);
+            rendered = false;
+            // Pixels kept from earlier frames were traced with the old settings
+            checkerboard_renderer.reset();
+            deadline_renderer.reset();
+            reprojection.reset();
+        }
+        if(scale != old_scale) {
+            render_w = width/scale;
+            render_h = height/scale;
+            computeRays(rays, render_w, render_h, scene.getCamera());
+            lod.setView(scene.getCamera(), render_h);
+            rays_version = scene.getCameraVersion();
+            tiles_version = -1;
+        }
+
+        bool dirty = !rendered || scene.getVersion() != rendered_version || !deadline_complete;
+        bool traced = true;
+        double frame_begin = getSeconds();
+        if(dirty) {
+            if(scene.getCameraVersion() != rays_version) {
+                computeRays(rays, render_w, render_h, scene.getCamera());
+                rays_version = scene.getCameraVersion();
+            }
+            trace_fn = selectTrace(scene, settings);
+            if(scene.getBallsVersion() != bvh_version) {
+                buildTrees(scene, adopt_balls);
+                bvh_version = scene.getBallsVersion();
+            }
+            if(settings.shadow_maps != nullptr)
+                shadow_maps.update(scene);
+            if(tile_cull && scene.getCameraVersion() + scene.getBallsVersion() != tiles_version) {
+                tiles.build(scene, render_w, render_h);
+                tiles_version = scene.getCameraVersion() + scene.getBallsVersion();
+            }
+
+            int *frame_ids = anti_alias ? ball_ids.data() : nullptr;
+            if(use_ooc)
+                ooc_renderer.render(rays, scene, store, settings, render_w, render_h, framebuffer.data());
+            else if(multi_view) {
+                std::vector<Camera> cameras = monitorViews(scene.getCamera());
+                std::vector<RenderContext> views;
+                for(int v = 0; v < (int)cameras.size(); v++) {
+                    uint32_t *quarter = framebuffer.data() + (v / 2)*(render_h/2)*render_w + (v % 2)*(render_w/2);
+                    views.push_back(RenderContext(scene, cameras[v], render_w/2, render_h/2, quarter));
+                    views.back().stride = render_w;
+                }
+                view_renderer.renderViews(views);
+            }
+            else if(reproject)
+                reprojection.render(rays, scene, settings, render_w, render_h, framebuffer.data(), frame_ids);
+            else if(raster)
+                rasterizer.render(rays, scene, trace_fn, settings, render_w, render_h, framebuffer.data(), frame_ids);
+            else if(deadline_ms > 0)
+                deadline_complete = deadline_renderer.render(rays, scene, trace_fn, settings, render_w, render_h, framebuffer.data(), deadline_ms/1000.0);
+            else if(checkerboard)
+                checkerboard_renderer.render(rays, scene, trace_fn, settings, render_w, render_h, framebuffer.data(), frame_ids);
+            else if(wavefront)
+                wavefront_renderer.render(scene, settings, render_w, render_h, framebuffer.data(), frame_ids);
+            else
+                renderFrame(rays, scene, trace_fn, settings, render_w, render_h, framebuffer.data(), frame_ids, tile_cull ? &tiles : nullptr);
+            if(anti_alias)
+                anti_aliaser.apply(scene, trace_fn, settings, render_w, render_h, ball_ids.data(), framebuffer.data());
+
+            if(accumulate)
+                accumulator.reset(framebuffer.data(), render_w*render_h);
+            rendered = true;
+            rendered_version = scene.getVersion();
+        } else if(accumulate && !accumulator.converged()) {
+            // Nothing changed, refine the image instead
+            accumulator.addSample(scene, trace_fn, settings, render_w, render_h, framebuffer.data());
+        } else {
+            // Nothing to do, just present the last frame again
+            SDL_Delay(15);
+            traced = false;
+        }
+        if(traced)
+            hud.addFrameTime((getSeconds() - frame_begin)*1000.0);
+
+        // The window still shows the last frame, unless the overlay changes
+        if(traced || show_hud) {
+            // Scale up to the window and draw the overlay on a copy, the
+            // renderers keep using their own last frame
+            const uint32_t *shown = framebuffer.data();
+            if(scale > 1 || show_hud) {
+                screen.resize(width*height);
+                for(int y = 0; y < height; y++) {
+                    for(int x = 0; x < width; x++) {
+                        screen[y*width + x] = framebuffer[std::min(y/scale, render_h - 1)*render_w + std::min(x/scale, render_w - 1)];
+                    }
+                }
+                shown = screen.data();
+            }
+            if(traced && ring.isOpen())
+                ring.publish(shown);
+            if(show_hud) {
+                hud_stats.update(counters, settings, render_w, render_h, scale, traced);
+                hud.draw(screen.data(), width, height, hud_stats.getLines());
+            }
+
             for(int y = 0; y < height; y++) {
-                Ray ray = rays[y*width + x];
-                Vec3 c = trace(ray, scene, 0);
-                uint32_t color = (uint8_t)(c.x*255.0f) << 16 | (uint8_t)(c.y*255.0f) << 8 | (uint8_t)(c.z*255.0f);
-                display->setPixel(x, y, color);
+                for(int x = 0; x < width; x++) {
+                    display->setPixel(x, y, shown[y*width + x]);
+                }
             }
+            display->update();
         }
-        display->update();
-        rays.clear();
         //moveRays(rays, scene.getCamera());
         //rotateRayDirections(ray_dirs, -0.01f);
-        scene.update();
+        if(animate)
+            scene.update();
+        if(move_camera) {
+            Camera camera = scene.getCamera();
+            camera.move(Vec3(0.0f, 0.0f, 0.05f));
+            scene.setCamera(camera);
+        }
 
         // Fps count
-        frames += 1.0f;
+        if(traced)
+            frames += 1.0f;
         time_now = getTime();
         if(time_now - time_prev >= 3000) {
             time_prev = time_now;
             std::cout << "FPS: " << frames/3 << std::endl;
             frames = 0;
+            if(use_ooc) {
+                ooc_renderer.printStats(store);
+                ooc_renderer.resetStats(&store);
+            }
+            if(wavefront) {
+                wavefront_renderer.printStats();
+                wavefront_renderer.resetStats();
+            }
+            if(deadline_ms > 0) {
+                deadline_renderer.printStats();
+                deadline_renderer.resetStats();
+            }
+            if(reproject) {
+                reprojection.printStats();
+                reprojection.resetStats();
+            }
+            if(checkerboard) {
+                checkerboard_renderer.printStats();
+                checkerboard_renderer.resetStats();
+            }
+            if(anti_alias) {
+                anti_aliaser.printStats();
+                anti_aliaser.resetStats();
+            }
         }
     }
     display->closeWindow();
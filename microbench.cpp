@@ -0,0 +1,288 @@
+/*
+ * Microbenchmarks for the ray tracer kernels
+ *
+ * Every kernel runs over a fixed set of generated inputs. The best of
+ * several runs is reported as ns/op and ops/cycle, where cycles come from
+ * the time stamp counter on x86. The Vec3x8 kernels are timed per lane,
+ * so their rows compare directly with the scalar ones. Before timing, the
+ * wide kernels are checked lane by lane against the scalar code.
+ */
+
+#include <cstdio>
+#include <string>
+#include "Raytracer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+inline uint64_t readCycles() {
+    return __rdtsc();
+}
+#else
+inline uint64_t readCycles() {
+    return 0;
+}
+#endif
+
+const int INPUTS = 4096;
+const int RUNS = 7;
+
+// Sum of all lanes, for the sink
+inline float laneSum(float a) {
+    return a;
+}
+template<int N>
+float laneSum(const FloatN<N> &a) {
+    float sum = 0.0f;
+    for(int i = 0; i < N; i++) sum += a[i];
+    return sum;
+}
+
+// Runs f(i) for every input until about min_ops operations are done, RUNS
+// times, and prints the fastest run. An f that handles several lanes counts
+// as lanes operations. f returns a float or a FloatN, and all of every
+// result is summed so that the compiler cannot drop any of the work.
+template<typename F>
+float bench(const char *name, int min_ops, F f, int lanes = 1) {
+    int reps = std::max(1, min_ops / (INPUTS*lanes));
+    double best_ns = INFINITY;
+    double best_cycles = INFINITY;
+    decltype(f(0)) sink(0.0f);
+    for(int run = 0; run < RUNS; run++) {
+        double begin = getSeconds();
+        uint64_t cycles = readCycles();
+        for(int r = 0; r < reps; r++) {
+            for(int i = 0; i < INPUTS; i++) {
+                sink = sink + f(i);
+            }
+        }
+        cycles = readCycles() - cycles;
+        double ops = (double)reps*INPUTS*lanes;
+        best_ns = std::min(best_ns, (getSeconds() - begin)*1e9/ops);
+        best_cycles = std::min(best_cycles, cycles/ops);
+    }
+    if(best_cycles > 0)
+        printf("%-26s %10.2f ns/op %10.4f ops/cycle\n", name, best_ns, 1.0/best_cycles);
+    else
+        printf("%-26s %10.2f ns/op %10s ops/cycle\n", name, best_ns, "n/a");
+    return laneSum(sink);
+}
+
+Vec3 randomVec(uint32_t seed, float scale) {
+    return Vec3(hashFloat(seed)*2 - 1, hashFloat(seed + 1)*2 - 1, hashFloat(seed + 2)*2 - 1)*scale;
+}
+
+bool near(float a, float b, float tolerance) {
+    return fabsf(a - b) <= tolerance*std::max(1.0f, fabsf(b));
+}
+bool near(const Vec3 &a, const Vec3 &b, float tolerance) {
+    return near(a.x, b.x, tolerance) && near(a.y, b.y, tolerance) && near(a.z, b.z, tolerance);
+}
+
+// Compares every lane of the wide kernels with the scalar code they replace
+// and prints the failing ones. Returns the number of failing lanes.
+int checkWide(const std::vector<Ball> &balls, const std::vector<Ray> &hit_rays, const std::vector<Ray> &miss_rays,
+              const std::vector<Vec3> &surface, const Vec3 &light_pos) {
+    int failures = 0;
+    auto check = [&](bool ok, const char *kernel, int i) {
+        if(!ok && failures++ < 10)
+            printf("check failed: %s, input %d\n", kernel, i);
+    };
+    for(int g = 0; g < INPUTS/8; g++) {
+        Vec3x8 centers, origins, dirs, miss_origins, miss_dirs, points;
+        Floatx8 radii;
+        for(int l = 0; l < 8; l++) {
+            int i = g*8 + l;
+            Vec3 dir = hit_rays[i].getDir();
+            dir.normalize();
+            Vec3 miss_dir = miss_rays[i].getDir();
+            miss_dir.normalize();
+            centers.set(l, balls[i].getPos());
+            radii.set(l, balls[i].getRadius());
+            origins.set(l, hit_rays[i].getPos());
+            dirs.set(l, dir);
+            miss_origins.set(l, miss_rays[i].getPos());
+            miss_dirs.set(l, miss_dir);
+            points.set(l, surface[i]);
+        }
+        Floatx8 distance(-1.0f), miss_distance(-1.0f);
+        MaskN<8> hit = intersectSphereWide(centers, radii, origins, dirs, distance);
+        MaskN<8> miss_hit = intersectSphereWide(centers, radii, miss_origins, miss_dirs, miss_distance);
+        Vec3x8 normals = sphereNormalWide(centers, points);
+        Vec3x8 fast_normals = sphereNormalWide(centers, points, true);
+        Vec3x8 mirrored = mirroredWide(dirs, normals);
+        Vec3x8 fast_mirrored = mirroredWide(dirs, fast_normals, true);
+        MaskN<8> lit;
+        for(int l = 0; l < 8; l++) lit.v[l] = l % 2 == 0 ? -1 : 0;
+        Floatx8 diffuce, specular;
+        lightTermsWide(points, normals, mirrored, light_pos, lit, diffuce, specular);
+
+        for(int l = 0; l < 8; l++) {
+            int i = g*8 + l;
+            const Ball &b = balls[i];
+            float d = -1.0f;
+            bool scalar_hit = b.intersect(hit_rays[i], d);
+            check(hit[l] == scalar_hit && (!scalar_hit || near(distance[l], d, 1e-4f)), "intersectSphereWide hit", i);
+            d = -1.0f;
+            scalar_hit = b.intersect(miss_rays[i], d);
+            check(miss_hit[l] == scalar_hit && (!scalar_hit || near(miss_distance[l], d, 1e-4f)), "intersectSphereWide miss", i);
+
+            Vec3 normal = b.getNormal(surface[i]);
+            check(near(normals.get(l), normal, 1e-5f), "sphereNormalWide", i);
+            check(near(fast_normals.get(l), normal, 1e-2f), "sphereNormalWide fast", i);
+            Vec3 scalar_mirrored = b.getMirrored(hit_rays[i].getDir(), surface[i]);
+            check(near(mirrored.get(l), scalar_mirrored, 1e-4f), "mirroredWide", i);
+            check(near(fast_mirrored.get(l), scalar_mirrored, 2e-2f), "mirroredWide fast", i);
+
+            Vec3 light_dir = light_pos - surface[i];
+            light_dir.normalize();
+            float scalar_diffuce = l % 2 == 0 ? normal.dotProduct(light_dir) : 0.0f;
+            float scalar_specular = l % 2 == 0 ? scalar_mirrored.dotProduct(light_dir) : 0.0f;
+            check(near(diffuce[l], scalar_diffuce, 1e-4f) && near(specular[l], scalar_specular, 1e-4f), "lightTermsWide", i);
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char* argv[]) {
+    int min_ops = argc > 1 ? atoi(argv[1]) : 4000000;
+    float sink = 0.0f;
+
+    // Inputs
+    std::vector<Vec3> vectors(INPUTS);
+    std::vector<Ball> balls(INPUTS);
+    std::vector<Ray> hit_rays(INPUTS), miss_rays(INPUTS);
+    std::vector<Vec3> surface(INPUTS);
+    std::vector<float> angles_x(INPUTS), angles_y(INPUTS);
+    std::vector<Vec3> colors(INPUTS);
+    for(int i = 0; i < INPUTS; i++) {
+        uint32_t seed = i*16;
+        vectors[i] = randomVec(seed, 10.0f);
+        Vec3 center = randomVec(seed + 3, 10.0f);
+        float radius = 0.5f + hashFloat(seed + 6)*2;
+        balls[i] = Ball(center, Material(Vec3(0.5f), 1.0f), radius);
+
+        // Hit rays start outside and aim inside the ball, miss rays aim well beside it
+        Vec3 origin = center + randomVec(seed + 7, 1.0f)*(4*radius) + Vec3(4*radius);
+        Vec3 target = center + randomVec(seed + 10, 0.5f*radius);
+        hit_rays[i] = Ray(origin, target - origin);
+        Vec3 side = Vec3(target.y - origin.y, origin.x - target.x, 0.0f);
+        side.normalize();
+        miss_rays[i] = Ray(origin, target + side*(3*radius) - origin);
+
+        Vec3 normal = randomVec(seed + 13, 1.0f);
+        normal.normalize();
+        surface[i] = center + normal*radius;
+        angles_x[i] = hashFloat(seed + 14)*2 - 1;
+        angles_y[i] = hashFloat(seed + 15)*2 - 1;
+        colors[i] = Vec3(hashFloat(seed + 1), hashFloat(seed + 2), hashFloat(seed + 3));
+    }
+
+    // The same inputs eight at a time in structure of arrays lanes
+    const int GROUPS = INPUTS/8;
+    std::vector<Vec3x8> wide_vectors(GROUPS), wide_centers(GROUPS), wide_origins(GROUPS), wide_dirs(GROUPS), wide_surface(GROUPS);
+    std::vector<Floatx8> wide_radii(GROUPS);
+    for(int g = 0; g < GROUPS; g++) {
+        wide_vectors[g] = Vec3x8::load(&vectors[g*8]);
+        wide_surface[g] = Vec3x8::load(&surface[g*8]);
+        for(int l = 0; l < 8; l++) {
+            const Ball &b = balls[g*8 + l];
+            Vec3 dir = hit_rays[g*8 + l].getDir();
+            dir.normalize();
+            wide_centers[g].set(l, b.getPos());
+            wide_radii[g].set(l, b.getRadius());
+            wide_origins[g].set(l, hit_rays[g*8 + l].getPos());
+            wide_dirs[g].set(l, dir);
+        }
+    }
+
+    // A small scene for the scene level kernels, half of the shadow rays blocked
+    Scene scene = setupScene(16, 1);
+    const Light &light = scene.getLights()[0];
+    std::vector<Ray> background_rays(INPUTS);
+    std::vector<Vec3> shadow_points(INPUTS);
+    for(int i = 0; i < INPUTS; i++) {
+        Vec3 dir = i % 8 == 0 ? light.getPos() - scene.getCamera().getPos() + randomVec(i, 5.0f) : randomVec(i*16, 1.0f);
+        background_rays[i] = Ray(scene.getCamera().getPos(), dir);
+        const Ball &b = scene.getBalls()[i % scene.getBalls().size()];
+        Vec3 normal = i % 2 == 0 ? light.getPos() - b.getPos() : b.getPos() - light.getPos();
+        normal.normalize();
+        shadow_points[i] = b.getPos() + normal*(b.getRadius()*1.001f);
+    }
+    Scene large = setupScene(1000, 1);
+    SphereBVH bvh;
+    bvh.build(large.getBalls());
+    ShadowMaps shadow_maps(512, 0.05f);
+    shadow_maps.update(scene);
+
+    int failures = checkWide(balls, hit_rays, miss_rays, surface, light.getPos());
+    printf("wide kernels: %d lanes checked, %d failed\n", INPUTS, failures);
+
+    printf("%d inputs, best of %d runs\n", INPUTS, RUNS);
+    sink += bench("Vec3::normalize", min_ops, [&](int i) {
+        Vec3 v = vectors[i];
+        v.normalize();
+        return v.x + v.y + v.z;
+    });
+    sink += bench("Ball::intersect hit", min_ops, [&](int i) {
+        float distance = 0.0f;
+        return balls[i].intersect(hit_rays[i], distance) ? distance : 0.0f;
+    });
+    sink += bench("Ball::intersect miss", min_ops, [&](int i) {
+        float distance = 0.0f;
+        return balls[i].intersect(miss_rays[i], distance) ? distance : 0.0f;
+    });
+    sink += bench("Ball::getMirrored", min_ops, [&](int i) {
+        Vec3 mirrored = balls[i].getMirrored(hit_rays[i].getDir(), surface[i]);
+        return mirrored.x + mirrored.y + mirrored.z;
+    });
+    sink += bench("Vec3x8::normalize", min_ops, [&](int i) {
+        Vec3x8 v = wide_vectors[i % GROUPS];
+        v.normalize();
+        return v.x + v.y + v.z;
+    }, 8);
+    sink += bench("Vec3x8::normalize fast", min_ops, [&](int i) {
+        Vec3x8 v = wide_vectors[i % GROUPS];
+        v.normalize(true);
+        return v.x + v.y + v.z;
+    }, 8);
+    sink += bench("intersectSphereWide<8>", min_ops, [&](int i) {
+        int g = i % GROUPS;
+        Floatx8 distance(0.0f);
+        intersectSphereWide(wide_centers[g], wide_radii[g], wide_origins[g], wide_dirs[g], distance);
+        return distance;
+    }, 8);
+    sink += bench("mirroredWide<8>", min_ops, [&](int i) {
+        int g = i % GROUPS;
+        Vec3x8 mirrored = mirroredWide(wide_dirs[g], sphereNormalWide(wide_centers[g], wide_surface[g]));
+        return mirrored.x + mirrored.y + mirrored.z;
+    }, 8);
+    sink += bench("lightTermsWide<8>", min_ops, [&](int i) {
+        int g = i % GROUPS;
+        Floatx8 diffuce, specular;
+        lightTermsWide(wide_surface[g], wide_vectors[g], wide_dirs[g], light.getPos(), MaskN<8>(true), diffuce, specular);
+        return diffuce + specular;
+    }, 8);
+    sink += bench("vectorAngle", min_ops, [&](int i) {
+        return vectorAngle(angles_x[i], angles_y[i]);
+    });
+    sink += bench("computeBackground", min_ops, [&](int i) {
+        Vec3 background = computeBackground(background_rays[i], scene);
+        return background.x + background.y + background.z;
+    });
+    sink += bench("checkShadow (19 balls)", min_ops/8, [&](int i) {
+        const Ball &b = scene.getBalls()[i % scene.getBalls().size()];
+        return checkShadow(scene, light, shadow_points[i], b) ? 1.0f : 0.0f;
+    });
+    sink += bench("SphereBVH::anyHit (1003)", min_ops/8, [&](int i) {
+        return bvh.anyHit(Ray(shadow_points[i], light.getPos() - shadow_points[i])) ? 1.0f : 0.0f;
+    });
+    sink += bench("ShadowMaps::occluded", min_ops, [&](int i) {
+        return shadow_maps.occluded(0, light.getPos(), shadow_points[i]) ? 1.0f : 0.0f;
+    });
+    sink += bench("packColor", min_ops, [&](int i) {
+        return (float)packColor(colors[i]);
+    });
+
+    printf("checksum %g\n", sink);
+    return failures > 0 ? 1 : 0;
+}